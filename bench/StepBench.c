@@ -0,0 +1,842 @@
+/*
+ * File: StepBench.c
+ * Project: Stepper Motor Control via I2C
+ * Description: Host benchmark for the motor paths, built against the register model in HostSim.c.
+ *              Runs motor_init(), pca_write_motor_pins() from a cold shadow, full_step_motor() and
+ *              the 200 step move from main() at 100, 400 and 1000 KHz, each programmed through
+ *              I2C_init_speed() with the PSC/SCLL/SCLH it planned. Prints one JSON document with
+ *              bytes and bus time per step, the step rate the bus can sustain, coil update skew and
+ *              delay() iterations, so runs can be diffed between versions. Every coil pattern the
+ *              outputs show during a step path must be a full step entry, anything else is counted
+ *              in coil_glitches. full_step_och_ack repeats full_step_motor with atomic updates off
+ *              to show the intermediate states they remove. stream_200 and stream_200_replay run
+ *              the same move compiled by motor_compile_move(), the replay reuses the compiled
+ *              frames. move_200_dma and stream_200_dma repeat the move and the replay with the EDMA
+ *              feeding the I2C1 FIFO, dma_bytes counts what it moved. move_200_recover starts the
+ *              move with a NACKed frame and a slave holding SDA low, recoveries counts the ladder
+ *              tiers it took to get through. move_200_ring_full keeps the ring full for 10 ticks
+ *              part way through the move, the refused steps must be retried with their whole entry
+ *              and the coils still go through every full step entry once and in order.
+ *              move_200_scl_hold runs the move in the motor_idle() loop with a slave holding SCL
+ *              low on two frames, their deadlines must stall them into the ladder, the first is
+ *              given up on and motor_recover() must leave the coils on the move's last entry.
+ *              microstep_200 runs 1/16 microsteps forward and back, every update must keep the coil
+ *              current vector on the circle and turn it one increment the way the move goes, and
+ *              the way back must end on the outputs it started from. multiaxis_xy moves M3/M4 and
+ *              M1/M2 by 200 and -100 full steps and back, each port must go one entry at a time the
+ *              way its axis goes, stay within a step of the line and reach its target on the same
+ *              Timer5 tick as the other. wave_200 and
+ *              half_200 run the move and back in wave and half step, every update must be the next
+ *              entry of the mode's sequence the way the move goes and the way back must end on the
+ *              entry it started from. button_200 presses the push button with the CPU spinning in
+ *              CPU_WAIT(), button_200_sleep with it in the motor_idle() loop of main() and the
+ *              I2C1/Timer5 clocks gated. wake_latency_ns is the
+ *              press to Timer5 counting the move's first interval, sleep_ns and clock_gated_ns the
+ *              time spent asleep and with both clocks off, gated_accesses must stay 0. verify reads
+ *              the board back with motor_verify() between moves, verify_brownout after a power
+ *              cycle of the board, mismatches counts the registers that differed from the shadow
+ *              and a second read must find none. limit_200 opens a limit switch bound with
+ *              motor_bind_limit() part way through the move, stop_latency_ns is the edge to the
+ *              step generator stopped, steps_after_stop counts coil updates from overflows after
+ *              the edge and must be 0, events the edges the GPIO event queue held. group_block
+ *              adds two boards on SUBADR1 and writes a block to them right after a reset, every
+ *              register must arrive without MODE1 AI. After pca_group_sync_start() the next block
+ *              must be one frame, and the boards and pca_default after pca_dev_start() must be
+ *              awake with AI on and read back the same as their shadows.
+ *
+ *              The exit status is nonzero if any path failed: a nonzero status, a coil glitch on
+ *              a path with atomic updates on, a microstep the wrong way, a drive sequence entry
+ *              skipped or the wrong way, a two-axis step skipped or off the line, a gated access,
+ *              a step after a limit stop or a group block that missed a register. The failures are
+ *              listed on stderr.
+ *
+ *              gcc -std=gnu99 -O2 -DHWREG_SIM -Iinclude bench/StepBench.c src/BeagleBoneMaster.c \
+ *                  src/MotorControllerLib.c src/MotionPlanner.c src/HostSim.c src/Profiler.c \
+ *                  src/Trace.c -o step_bench
+ *
+ *              Add -DPROFILER to also dump the probe histograms to stderr, and
+ *              -DMOTOR_PORT=MOTOR_PORT_M1M2 to run every path on the M1/M2 wiring.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../include/BeagleBoneMaster.h"
+#include "../include/MotorControllerLib.h"
+#include "../include/MotionPlanner.h"
+#include "../include/HostSim.h"
+#include "../include/Profiler.h"
+
+#define BENCH_VERSION 15
+#define PCA_HW_ADDRESS 0x60     // FeatherWing with no address jumpers
+#define FULL_STEP_CALLS 64
+#define BENCH_SETTLE_NS 100000
+//Same move as main()
+#define NUMSTEPS 200
+#define MAX_VELOCITY 1000
+#define ACCELERATION 8000
+#define JERK 80000
+#define LIMIT_PIN 12            // GPIO1_12, P8_12
+#define LIMIT_AFTER_STEPS 50
+#define RING_FULL_AFTER_STEPS 100
+#define RING_FULL_STEPS 10       // ticks the ring is kept full for
+#define RING_FILLER_CHANNEL (MOTOR_PORT == MOTOR_PORT_M3M4 ? 8 : 0)   // LEDn..LEDn+7, clear of the port
+#define SCL_HOLD_FRAMES 2       // frames the stuck slave wedges, the first one is given up on
+#define SCL_HOLD_LIMIT_NS 2000000000ull   // the move and its recovery must be done by then
+#define COIL_CURRENT_FULL 4096  // PWMA/PWMB duty of a coil at full current
+#define COIL_PWMA PCA_CHANNEL(PCA_Controller.LED2_ON_L)     // coil enables of the MOTOR_PORT port
+#define COIL_PWMB PCA_CHANNEL(PCA_Controller.LED7_ON_L)
+#define XY_STEPS0 NUMSTEPS        // two-axis move, 4 steps of axis 0 for every 2 back on axis 1
+#define XY_STEPS1 (-NUMSTEPS / 2)
+#define XY_VELOCITY 400         // ticks per second, two 7 byte frames a tick fit 100 KHz
+#define MICROSTEP_VELOCITY 400  // 1/16 steps per second, a 24 byte LED2..LED7 burst each fits 100 KHz
+#define GROUP_BOARDS 2
+#define GROUP_BOARD_ADDRESS 0x61  // first of the boards next to the motor board
+#define GROUP_ADDRESS 0x71      // SUBADR1 power-on value
+
+//Globals main.c provides on target
+volatile unsigned int svc_stack[1];
+volatile unsigned int irq_stack[1];
+volatile int push_button;
+
+typedef struct {
+    const char *name;
+    uint32_t steps;             // coil updates the path made
+    hwsim_stats_t start;
+    uint64_t start_ns;
+    uint32_t start_recoveries;
+    uint32_t start_mismatches;
+    uint32_t start_errors;      // i2c_tx_errors, frames the engine gave up on
+    uint64_t press_ns;          // push button edge, 0 for paths without one
+    uint64_t first_interval_ns; // period before the first step of the pressed move
+    uint64_t stop_latency_ns;   // limit edge to the generator stopped, 0 without one
+    uint32_t events;            // GPIO events taken from the queue
+    _Bool glitches_expected;    // atomic updates off, intermediate coil states are the point
+    int err;
+} bench_run_t;
+
+static uint32_t bench_bus_khz;
+static uint32_t bench_failures;
+
+static uint32_t bench_recoveries(void){
+    return i2c_recovery.retries + i2c_recovery.bus_clears + i2c_recovery.restarts + i2c_recovery.reinits;
+}
+
+// Coil update window, one per step. Skew is first to last output change in a window,
+// latency is Timer5 overflow to the last change for timed steps
+static struct {
+    _Bool open;
+    uint64_t first_ns;
+    uint64_t last_ns;
+    uint64_t run_first_ns;      // first change of the path, 0 until there is one
+    uint64_t run_first_overflow_ns; // Timer5 overflow that made it
+    uint32_t overflow;          // overflow count the window belongs to
+    uint64_t skew_max_ns;
+    uint64_t latency_max_ns;
+    _Bool timed;
+    _Bool check;                // step path, every visible pattern must be a full step entry
+    uint32_t glitches;
+    uint64_t stop_ns;           // limit edge, 0 until there is one
+    uint32_t after_stop;        // updates made by overflows after it
+    int microstep;              // microstep path, +1 forward, -1 reverse, 0 off
+    _Bool micro_last_valid;
+    int32_t micro_last_a;       // signed coil currents of the last update
+    int32_t micro_last_b;
+    uint32_t micro_steps;       // updates that moved the current vector the right way
+    uint32_t micro_wrong;       // updates that moved it back, or not at all
+    _Bool xy;                   // two-axis path, both ports are followed through the full steps
+    int32_t xy_steps[MOTOR_AXES];   // signed steps of the running move
+    int32_t xy_pos[MOTOR_AXES];     // signed steps seen on each port
+    int xy_phase[MOTOR_AXES];       // full step entry each port shows
+    uint32_t xy_last_overflow[MOTOR_AXES]; // Timer5 overflow of each port's latest step
+    uint32_t xy_wrong;          // skipped entries and steps off the line between the targets
+    const uint8_t *seq;         // drive sequence the MOTOR_PORT entries are followed through, NULL if off
+    uint8_t seq_len;
+    int seq_dir;                // +1 forward, -1 reverse
+    int seq_index;              // entry the port shows
+    uint32_t seq_steps;         // updates that moved one entry the way the move goes
+    uint32_t seq_wrong;         // skipped entries and steps against the move
+} coil;
+
+static const uint8_t coil_full_sequence[4] = {0x05, 0x09, 0x0A, 0x06};
+static const uint8_t coil_wave_sequence[4] = {0x04, 0x01, 0x08, 0x02};
+static const uint8_t coil_half_sequence[8] = {0x05, 0x01, 0x09, 0x08, 0x0A, 0x02, 0x06, 0x04};
+static const motor_channels_t *const xy_ports[MOTOR_AXES] = {&MotorPortM3M4, &MotorPortM1M2};
+
+static _Bool coil_pattern_valid(uint8_t pattern){
+    return pattern == 0x05 || pattern == 0x09 || pattern == 0x0A || pattern == 0x06;
+}
+
+// Signed coil currents of the MOTOR_PORT port, the duty of PWMA/PWMB with the sign AIN1/BIN1 select
+static int32_t coil_current_a(const hwsim_pca_t *pca){
+    uint16_t duty = pca->outputs[COIL_PWMA];
+    return pca->outputs[PCA_CHANNEL(PCA_Controller.AIN1_ON)] == 4096 ? duty : -(int32_t)duty;
+}
+
+static int32_t coil_current_b(const hwsim_pca_t *pca){
+    uint16_t duty = pca->outputs[COIL_PWMB];
+    return pca->outputs[PCA_CHANNEL(PCA_Controller.BIN1_ON)] == 4096 ? duty : -(int32_t)duty;
+}
+
+// Every microstep keeps the current vector on the circle and turns it one increment the way the
+// move goes, A follows cos and B sin so forward is counterclockwise. A vector off the circle is
+// an update caught half written
+static void coil_microstep(const hwsim_pca_t *pca){
+    int64_t a = coil_current_a(pca);
+    int64_t b = coil_current_b(pca);
+    int64_t magnitude = a * a + b * b;
+    int64_t full = (int64_t)COIL_CURRENT_FULL * COIL_CURRENT_FULL;
+
+    if (magnitude < full * 98 / 100 || magnitude > full * 102 / 100) coil.glitches++;
+    if (coil.micro_last_valid) {
+        int64_t turn = coil.micro_last_a * b - coil.micro_last_b * a;
+        int64_t ahead = coil.micro_last_a * a + coil.micro_last_b * b;
+        if (turn * coil.microstep > 0 && ahead > 0) {
+            coil.micro_steps++;
+        } else {
+            coil.micro_wrong++;
+        }
+    }
+    coil.micro_last_valid = 1;
+    coil.micro_last_a = a;
+    coil.micro_last_b = b;
+}
+
+// AIN1/AIN2/BIN1/BIN2 levels of any port, hwsim_coil_pattern() only knows MOTOR_PORT
+static int coil_axis_phase(const hwsim_pca_t *pca, const motor_channels_t *map){
+    uint8_t pattern = (pca->outputs[map->AIN1] == 4096) << AIN1 | (pca->outputs[map->AIN2] == 4096) << AIN2
+                    | (pca->outputs[map->BIN1] == 4096) << BIN1 | (pca->outputs[map->BIN2] == 4096) << BIN2;
+    for (int i = 0; i < 4; i++) {
+        if (coil_full_sequence[i] == pattern) return i;
+    }
+    return -1;
+}
+
+// Each port moves one full step entry at a time the way its axis goes, and the slower axis stays
+// within a step of the line between the targets, one more while the other port's frame is out
+static void coil_xy(const hwsim_pca_t *pca){
+    int32_t major = coil.xy_steps[0] < 0 ? -coil.xy_steps[0] : coil.xy_steps[0];
+    int32_t minor = coil.xy_steps[1] < 0 ? -coil.xy_steps[1] : coil.xy_steps[1];
+    if (minor > major) major = minor;
+
+    for (int a = 0; a < MOTOR_AXES; a++) {
+        int phase = coil_axis_phase(pca, xy_ports[a]);
+        if (phase < 0) {
+            coil.glitches++;
+            continue;
+        }
+        if (phase == coil.xy_phase[a]) continue;
+        int delta = (phase - coil.xy_phase[a]) & 3;
+        if (delta == 1 && coil.xy_steps[a] > 0) {
+            coil.xy_pos[a]++;
+        } else if (delta == 3 && coil.xy_steps[a] < 0) {
+            coil.xy_pos[a]--;
+        } else {
+            coil.xy_wrong++;
+        }
+        coil.xy_phase[a] = phase;
+        coil.xy_last_overflow[a] = hwsim_stats.timer_overflows;
+    }
+    int64_t off_line = (int64_t)coil.xy_pos[0] * coil.xy_steps[1] - (int64_t)coil.xy_pos[1] * coil.xy_steps[0];
+    if (off_line < 0) off_line = -off_line;
+    if (off_line > 2 * (int64_t)major) coil.xy_wrong++;
+}
+
+// Entry of the followed drive sequence the MOTOR_PORT port shows, -1 if none
+static int coil_sequence_index(const hwsim_pca_t *pca){
+    uint8_t pattern = hwsim_coil_pattern(pca);
+    for (int i = 0; i < coil.seq_len; i++) {
+        if (coil.seq[i] == pattern) return i;
+    }
+    return -1;
+}
+
+// Each update moves one entry of the sequence the way the move goes, any other pattern is
+// an update caught half written
+static void coil_sequence(const hwsim_pca_t *pca){
+    int index = coil_sequence_index(pca);
+    if (index < 0) {
+        coil.glitches++;
+        return;
+    }
+    if (index == coil.seq_index) return;
+    if (((index - coil.seq_index - coil.seq_dir) % coil.seq_len) == 0) {
+        coil.seq_steps++;
+    } else {
+        coil.seq_wrong++;
+    }
+    coil.seq_index = index;
+}
+
+// Starts following a two-axis move from the entries the ports show now
+static void coil_xy_begin(const hwsim_pca_t *pca, int32_t steps0, int32_t steps1){
+    coil.xy = 1;
+    coil.xy_steps[0] = steps0;
+    coil.xy_steps[1] = steps1;
+    for (int a = 0; a < MOTOR_AXES; a++) {
+        coil.xy_pos[a] = 0;
+        coil.xy_phase[a] = coil_axis_phase(pca, xy_ports[a]);
+        coil.xy_last_overflow[a] = 0;
+    }
+}
+
+static void coil_window_close(void){
+    if (!coil.open) return;
+    if (coil.last_ns - coil.first_ns > coil.skew_max_ns) coil.skew_max_ns = coil.last_ns - coil.first_ns;
+    coil.open = 0;
+}
+
+static void coil_hook(const hwsim_pca_t *pca){
+    uint64_t now = hwsim_time_ns();
+    if (!coil.run_first_ns) {
+        coil.run_first_ns = now;
+        coil.run_first_overflow_ns = hwsim_stats.last_overflow_ns;
+    }
+    if (coil.check && !coil_pattern_valid(hwsim_coil_pattern(pca))) coil.glitches++;
+    if (coil.microstep) coil_microstep(pca);
+    if (coil.xy) coil_xy(pca);
+    if (coil.seq) coil_sequence(pca);
+    if (coil.stop_ns && hwsim_stats.last_overflow_ns > coil.stop_ns) coil.after_stop++;
+    if (coil.timed && coil.open && coil.overflow != hwsim_stats.timer_overflows) coil_window_close();
+    if (!coil.open) {
+        coil.open = 1;
+        coil.first_ns = now;
+        coil.overflow = hwsim_stats.timer_overflows;
+    }
+    coil.last_ns = now;
+    if (coil.timed && now - hwsim_stats.last_overflow_ns > coil.latency_max_ns) {
+        coil.latency_max_ns = now - hwsim_stats.last_overflow_ns;
+    }
+}
+
+static void bench_begin(bench_run_t *run, const char *name, _Bool timed, _Bool check){
+    // The STOP of the previous path's last frame lands after its ARDY, let it finish first
+    hwsim_advance_ns(BENCH_SETTLE_NS);
+    run->name = name;
+    run->steps = 0;
+    run->err = 0;
+    run->start = hwsim_stats;
+    run->start_ns = hwsim_time_ns();
+    run->start_recoveries = bench_recoveries();
+    run->start_mismatches = pca_verify_stats.mismatches;
+    run->start_errors = i2c_tx_errors;
+    run->press_ns = 0;
+    run->stop_latency_ns = 0;
+    run->events = 0;
+    run->glitches_expected = 0;
+    coil.open = 0;
+    coil.run_first_ns = 0;
+    coil.skew_max_ns = 0;
+    coil.latency_max_ns = 0;
+    coil.timed = timed;
+    coil.check = check;
+    coil.glitches = 0;
+    coil.stop_ns = 0;
+    coil.after_stop = 0;
+    coil.microstep = 0;
+    coil.micro_last_valid = 0;
+    coil.micro_steps = 0;
+    coil.micro_wrong = 0;
+    coil.xy = 0;
+    coil.xy_wrong = 0;
+    coil.seq = NULL;
+    coil.seq_steps = 0;
+    coil.seq_wrong = 0;
+}
+
+// A path that breaks what the driver promises fails the whole run
+static void bench_check(const bench_run_t *run, _Bool ok, const char *what){
+    if (ok) return;
+    fprintf(stderr, "step_bench: %s at %u KHz: %s\n", run->name, bench_bus_khz, what);
+    bench_failures++;
+}
+
+static void bench_end(bench_run_t *run, _Bool last){
+    coil_window_close();
+    bench_check(run, run->err == 0, "status not 0");
+    bench_check(run, run->glitches_expected || coil.glitches == 0, "intermediate coil state visible");
+    // Shows the check sees intermediate states at all
+    bench_check(run, !run->glitches_expected || coil.glitches > 0, "no intermediate state with atomic updates off");
+    bench_check(run, hwsim_stats.gated_accesses == run->start.gated_accesses, "access to a gated module");
+    bench_check(run, coil.after_stop == 0, "step after the limit stop");
+    bench_check(run, coil.micro_wrong == 0, "microstep against the move direction");
+    bench_check(run, coil.xy_wrong == 0, "two-axis step skipped, backwards or off the line");
+    bench_check(run, coil.seq_wrong == 0, "drive sequence entry skipped or against the move direction");
+
+    uint32_t frames = hwsim_stats.frames - run->start.frames;
+    uint32_t bytes = hwsim_stats.bytes - run->start.bytes;
+    uint64_t busy_ns = hwsim_stats.bus_busy_ns - run->start.bus_busy_ns;
+    uint64_t elapsed_ns = hwsim_time_ns() - run->start_ns;
+    uint32_t steps = run->steps ? run->steps : 1;
+    uint64_t busy_per_step = busy_ns / steps;
+    // Press to Timer5 counting the first interval, what waking and ungating the clocks adds
+    uint64_t wake_ns = 0;
+    if (run->press_ns && coil.run_first_ns) {
+        wake_ns = coil.run_first_overflow_ns - run->first_interval_ns - run->press_ns;
+    }
+
+    printf("        {\"path\": \"%s\", \"status\": %d, \"steps\": %u, \"frames\": %u, \"bytes\": %u, "
+           "\"bytes_per_step\": %.2f, \"bus_busy_ns_per_step\": %llu, \"max_step_rate_hz\": %llu, "
+           "\"elapsed_ns\": %llu, \"coil_skew_ns_max\": %llu, \"step_latency_ns_max\": %llu, "
+           "\"delay_iterations\": %llu, \"irqs\": %u, \"dma_bytes\": %u, \"recoveries\": %u, "
+           "\"wake_latency_ns\": %llu, \"sleep_ns\": %llu, \"clock_gated_ns\": %llu, \"gated_accesses\": %u, "
+           "\"mismatches\": %u, \"stop_latency_ns\": %llu, \"steps_after_stop\": %u, \"events\": %u, "
+           "\"coil_glitches\": %u}%s\n",
+           run->name, run->err, run->steps, frames, bytes,
+           (double)bytes / steps, (unsigned long long)busy_per_step,
+           (unsigned long long)(busy_per_step ? 1000000000ull / busy_per_step : 0),
+           (unsigned long long)elapsed_ns, (unsigned long long)coil.skew_max_ns,
+           (unsigned long long)coil.latency_max_ns,
+           (unsigned long long)(hwsim_stats.delay_cycles - run->start.delay_cycles),
+           hwsim_stats.irqs - run->start.irqs, hwsim_stats.dma_bytes - run->start.dma_bytes,
+           bench_recoveries() - run->start_recoveries, (unsigned long long)wake_ns,
+           (unsigned long long)(hwsim_stats.sleep_ns - run->start.sleep_ns),
+           (unsigned long long)(hwsim_stats.clock_gated_ns - run->start.clock_gated_ns),
+           hwsim_stats.gated_accesses - run->start.gated_accesses,
+           pca_verify_stats.mismatches - run->start_mismatches, (unsigned long long)run->stop_latency_ns,
+           coil.after_stop, run->events, coil.glitches, last ? "" : ",");
+}
+
+#ifdef PROFILER
+static void bench_print_line(const char *line){
+    fprintf(stderr, "%s\n", line);
+}
+#endif
+
+static void bench_wait_idle(bench_run_t *run){
+    while (!run->err && (motor_busy() || !I2C_tx_idle())) {
+        I2C_tx_service();
+        if (!I2C_tx_stalled()) CPU_WAIT();
+    }
+    if (!run->err && i2c_tx_errors != run->start_errors) run->err = I2C_ERR_NACK;
+}
+
+// The idle loop of main(), sleeps with the clocks gated until the move is done and they are gated again
+static void bench_sleep_idle(bench_run_t *run){
+    do {
+        motor_idle();
+    } while (!run->err && (motor_busy() || !per_clocks_gated()));
+    if (!run->err && i2c_tx_errors != run->start_errors) run->err = I2C_ERR_NACK;
+}
+
+// Falling edge on GPIO1_3, the GPIO1 ISR queues the bound move
+static void bench_press(bench_run_t *run, const motion_profile_t *profile){
+    motion_move_t move;
+
+    planner_begin_move(&move, profile, NUMSTEPS);
+    run->first_interval_ns = (uint64_t)planner_interval(&move, 0) * 1000000000ull / Timer5.CLK_FREQ;
+    run->press_ns = hwsim_time_ns();
+    hwsim_gpio1_set_input(GPIO1.GPIO1_3_SIGNAL, 0);
+    hwsim_gpio1_set_input(GPIO1.GPIO1_3_SIGNAL, 1);
+}
+
+static void bench_bus(uint32_t bus_khz, _Bool last){
+    static motion_profile_t profile;
+    static move_stream_t stream;
+    bench_run_t run;
+    i2c_timing_t timing = {0};
+
+    bench_bus_khz = bus_khz;
+    hwsim_reset();
+    hwsim_add_pca(PCA_HW_ADDRESS);
+    hwsim_set_output_hook(coil_hook);
+    PROF_INIT();
+
+    // Same bring up as main(), the transmit engine waits until the move
+    gpio1_init();
+    IRQ_init();
+    timer5_init();
+    I2C_plan_timing(I2C1.SYS_CLK * 1000, bus_khz, &timing);
+    if (I2C_init_speed(bus_khz) < 0) {
+        fprintf(stderr, "step_bench: no SCL timing for %u KHz\n", bus_khz);
+        bench_failures++;
+        return;
+    }
+    pca_shadow_invalidate();
+
+    printf("    {\"bus_khz\": %u, \"psc\": %u, \"scll\": %u, \"sclh\": %u, \"scl_khz\": %u, \"paths\": [\n",
+           bus_khz, timing.psc, timing.scll, timing.sclh, hwsim_bus_khz());
+
+    bench_begin(&run, "motor_init", 0, 0);
+    run.err = motor_init();
+    run.steps = 1;
+    bench_end(&run, 0);
+
+    // Whole LED3..LED6 block, the cost of a step when the shadow knows nothing
+    bench_begin(&run, "pca_write_motor_pins_cold", 0, 1);
+    for (int i = 0; i < FULL_STEP_CALLS && !run.err; i++) {
+        pca_shadow_invalidate();
+        coil_window_close();
+        run.err = pca_write_motor_pins(0x06);  // step 4, so full_step_motor(1) below moves
+        run.steps++;
+    }
+    bench_end(&run, 0);
+
+    // Diff writes through the shadow, the polled step path
+    bench_begin(&run, "full_step_motor", 0, 1);
+    for (int i = 0; i < FULL_STEP_CALLS && !run.err; i++) {
+        coil_window_close();
+        run.err = full_step_motor(i + 1);
+        run.steps++;
+    }
+    bench_end(&run, 0);
+
+    // Same steps with MODE2 OCH set, each acknowledged register reaches the outputs on its own
+    bench_begin(&run, "full_step_och_ack", 0, 1);
+    run.glitches_expected = 1;
+    run.err = motor_set_atomic(0);
+    for (int i = 0; i < FULL_STEP_CALLS && !run.err; i++) {
+        coil_window_close();
+        run.err = full_step_motor(i + 1);
+        run.steps++;
+    }
+    if (!run.err) run.err = motor_set_atomic(1);
+    bench_end(&run, 0);
+
+    // The move main() makes on a button press, Timer5 paced with queued frames
+    planner_build_profile(&profile, MAX_VELOCITY, ACCELERATION, JERK);
+    I2C_tx_engine_start();
+    clear_interrupt_mask_bit();
+
+    bench_begin(&run, "move_200", 1, 1);
+    run.err = motor_start_move(NUMSTEPS, MOTOR_FORWARD, &profile);
+    bench_wait_idle(&run);
+    run.steps = NUMSTEPS;
+    bench_end(&run, 0);
+
+    // Compiled once, the Timer5 ISR only sends frames
+    bench_begin(&run, "stream_200", 1, 1);
+    run.err = motor_compile_move(&stream, NUMSTEPS, MOTOR_FORWARD, &profile);
+    if (!run.err) run.err = motor_start_stream(&stream);
+    bench_wait_idle(&run);
+    run.steps = NUMSTEPS;
+    bench_end(&run, 0);
+
+    // 200 full steps end on the phase they started from, nothing is compiled again
+    bench_begin(&run, "stream_200_replay", 1, 1);
+    run.err = motor_start_stream(&stream);
+    bench_wait_idle(&run);
+    run.steps = NUMSTEPS;
+    bench_end(&run, 0);
+
+    // Same frames, the EDMA loads the FIFO and the I2C1 ISR only runs on ARDY
+    I2C_tx_engine_start_dma();
+    bench_begin(&run, "move_200_dma", 1, 1);
+    run.err = motor_start_move(NUMSTEPS, MOTOR_FORWARD, &profile);
+    bench_wait_idle(&run);
+    run.steps = NUMSTEPS;
+    bench_end(&run, 0);
+
+    bench_begin(&run, "stream_200_dma", 1, 1);
+    run.err = motor_start_stream(&stream);
+    bench_wait_idle(&run);
+    run.steps = NUMSTEPS;
+    bench_end(&run, 0);
+
+    // Button press as main() sees it, first awake, then asleep with I2C1 and Timer5 gated
+    motor_bind_button(NUMSTEPS, MOTOR_FORWARD, &profile);
+    hwsim_gpio1_set_input(GPIO1.GPIO1_3_SIGNAL, 1);
+    bench_begin(&run, "button_200", 1, 1);
+    bench_press(&run, &profile);
+    bench_wait_idle(&run);
+    run.steps = NUMSTEPS;
+    bench_end(&run, 0);
+
+    while (!per_clocks_gated()) motor_idle();
+    bench_begin(&run, "button_200_sleep", 1, 1);
+    bench_press(&run, &profile);
+    bench_sleep_idle(&run);
+    run.steps = NUMSTEPS;
+    bench_end(&run, 0);
+
+    // First frame NACKed, then the START of every retry lost until SCL pulses free SDA
+    bench_begin(&run, "move_200_recover", 1, 1);
+    hwsim_i2c_nack_frames(1);
+    hwsim_i2c_hold_sda(3);
+    run.err = motor_start_move(NUMSTEPS, MOTOR_FORWARD, &profile);
+    bench_wait_idle(&run);
+    run.steps = NUMSTEPS;
+    bench_end(&run, 0);
+
+    // The ring is filled with frames that rewrite 31 registers clear of the motor port as they
+    // are, so step frames are refused for a few ticks. Each refused step is retried with its
+    // whole entry, the coils must still go through every full step entry once and in order
+    bench_begin(&run, "move_200_ring_full", 1, 1);
+    uint32_t misses = motor_step_misses;
+    coil.seq = coil_full_sequence;
+    coil.seq_len = 4;
+    coil.seq_dir = 1;
+    coil.seq_index = coil_sequence_index(hwsim_pca(0));
+    run.err = motor_start_move(NUMSTEPS, MOTOR_FORWARD, &profile);
+    while (!run.err && motor_busy() && hwsim_stats.timer_overflows - run.start.timer_overflows < RING_FULL_AFTER_STEPS) {
+        I2C_tx_service();
+        if (!I2C_tx_stalled()) CPU_WAIT();
+    }
+    uint8_t filler[I2C_FRAME_MAX];
+    filler[0] = PCA_LED_ON_L(RING_FILLER_CHANNEL);
+    for (int i = 1; i < I2C_FRAME_MAX; i++) filler[i] = hwsim_pca(0)->regs[filler[0] + i - 1];
+    while (!run.err && motor_busy() && hwsim_stats.timer_overflows - run.start.timer_overflows < RING_FULL_AFTER_STEPS + RING_FULL_STEPS) {
+        while (I2C_tx_enqueue(PCA_HW_ADDRESS, filler, I2C_FRAME_MAX) == I2C_OK) {}
+        I2C_tx_service();
+        if (!I2C_tx_stalled()) CPU_WAIT();
+    }
+    bench_wait_idle(&run);
+    hwsim_advance_ns(BENCH_SETTLE_NS);
+    bench_check(&run, motor_step_misses != misses, "no step refused by the full ring");
+    bench_check(&run, coil.seq_steps == NUMSTEPS, "full step count");
+    coil.seq = NULL;
+    run.steps = NUMSTEPS;
+    bench_end(&run, 0);
+
+    // A slave holds SCL low from the address byte of two frames, nothing but their deadlines
+    // stalls them. The first climbs every tier and is given up on, the second gets through after
+    // the soft reset and motor_recover() puts the board back. In the motor_idle() loop of main(),
+    // the reset board shows all coils off for a moment so the pattern check is off
+    bench_begin(&run, "move_200_scl_hold", 1, 0);
+    i2c_recovery_stats_t hold_start = i2c_recovery;
+    uint8_t hold_pattern = hwsim_coil_pattern(hwsim_pca(0));
+    hwsim_i2c_hold_scl(SCL_HOLD_FRAMES);
+    run.err = motor_start_move(NUMSTEPS, MOTOR_FORWARD, &profile);
+    do {
+        motor_idle();
+    } while (!run.err && (motor_busy() || !per_clocks_gated()) && hwsim_time_ns() - run.start_ns < SCL_HOLD_LIMIT_NS);
+    bench_check(&run, per_clocks_gated() && I2C_tx_idle(), "engine not idle and gated after the stuck SCL");
+    bench_check(&run, i2c_recovery.timeouts - hold_start.timeouts >= SCL_HOLD_FRAMES, "wedged frame not stalled by its deadline");
+    bench_check(&run, i2c_recovery.bus_clears != hold_start.bus_clears, "no bus clear");
+    bench_check(&run, i2c_recovery.restarts - hold_start.restarts == SCL_HOLD_FRAMES, "no soft reset per wedged frame");
+    bench_check(&run, i2c_recovery.failures - hold_start.failures == 1 && i2c_tx_errors - run.start_errors == 1, "not exactly one frame given up");
+    bench_check(&run, i2c_recovery.reinits != hold_start.reinits, "board not rebuilt by motor_recover()");
+    bench_check(&run, hwsim_coil_pattern(hwsim_pca(0)) == hold_pattern, "coils not on the move's last full step entry");
+    run.steps = NUMSTEPS;
+    bench_end(&run, 0);
+
+    // 1/16 microsteps on the PWMA/PWMB duty, the move and back. 200 positions from a full step
+    // end half way to the next one, one coil at zero, and the way back ends where it started
+    static motion_profile_t micro_profile;
+    planner_build_profile(&micro_profile, MICROSTEP_VELOCITY, ACCELERATION, JERK);
+    bench_begin(&run, "microstep_200", 1, 0);
+    run.err = motor_set_microstep(MICROSTEP_MAX);
+    bench_wait_idle(&run);
+    hwsim_advance_ns(BENCH_SETTLE_NS);
+    const hwsim_pca_t *board = hwsim_pca(0);
+    uint16_t coil_start[16];
+    for (int ch = 0; ch < 16; ch++) coil_start[ch] = board->outputs[ch];
+    coil.microstep = 1;
+    coil.micro_last_valid = 1;
+    coil.micro_last_a = coil_current_a(board);
+    coil.micro_last_b = coil_current_b(board);
+    if (!run.err) run.err = motor_start_move(NUMSTEPS, MOTOR_FORWARD, &micro_profile);
+    bench_wait_idle(&run);
+    hwsim_advance_ns(BENCH_SETTLE_NS);
+    bench_check(&run, (board->outputs[COIL_PWMA] == 0) != (board->outputs[COIL_PWMB] == 0), "not half way between full steps");
+    bench_check(&run, board->outputs[COIL_PWMA] + board->outputs[COIL_PWMB] == COIL_CURRENT_FULL, "coil not at full current");
+    coil.microstep = -1;
+    if (!run.err) run.err = motor_start_move(NUMSTEPS, MOTOR_REVERSE, &micro_profile);
+    bench_wait_idle(&run);
+    hwsim_advance_ns(BENCH_SETTLE_NS);
+    for (int ch = 0; ch < 16; ch++) {
+        bench_check(&run, board->outputs[ch] == coil_start[ch], "reverse move did not return");
+    }
+    bench_check(&run, coil.micro_steps == 2 * NUMSTEPS, "microstep count");
+    coil.microstep = 0;
+    if (!run.err) run.err = motor_set_microstep(0);
+    bench_wait_idle(&run);
+    run.steps = 2 * NUMSTEPS;
+    bench_end(&run, 0);
+
+    // Two axes, M3/M4 and M1/M2 on one board. Both ports must reach their targets on the same
+    // tick, the move back returns them to the entries they started on
+    static motion_profile_t xy_profile;
+    planner_build_profile(&xy_profile, XY_VELOCITY, ACCELERATION, JERK);
+    bench_begin(&run, "multiaxis_xy", 1, 1);
+    run.err = motor_multiaxis_init(&MotorPortM3M4, &MotorPortM1M2);
+    bench_wait_idle(&run);
+    hwsim_advance_ns(BENCH_SETTLE_NS);
+    int xy_start[MOTOR_AXES];
+    for (int a = 0; a < MOTOR_AXES; a++) xy_start[a] = coil_axis_phase(board, xy_ports[a]);
+    for (int leg = 0; leg < 2 && !run.err; leg++) {
+        int32_t steps0 = leg ? -XY_STEPS0 : XY_STEPS0;
+        int32_t steps1 = leg ? -XY_STEPS1 : XY_STEPS1;
+        coil_xy_begin(board, steps0, steps1);
+        run.err = motor_queue_move_xy(steps0, steps1, &xy_profile);
+        bench_wait_idle(&run);
+        hwsim_advance_ns(BENCH_SETTLE_NS);
+        bench_check(&run, coil.xy_pos[0] == steps0 && coil.xy_pos[1] == steps1, "two-axis target missed");
+        bench_check(&run, coil.xy_last_overflow[0] == coil.xy_last_overflow[1], "axes did not arrive together");
+        coil.xy = 0;
+    }
+    for (int a = 0; a < MOTOR_AXES; a++) {
+        bench_check(&run, coil_axis_phase(board, xy_ports[a]) == xy_start[a], "move back did not return");
+    }
+    if (!run.err) run.err = motor_set_drive_mode(DRIVE_FULL);
+    bench_wait_idle(&run);
+    run.steps = 2 * NUMSTEPS;
+    bench_end(&run, 0);
+
+    // Wave and half step, the move and back. Every update is the next entry of the mode's
+    // sequence the way the move goes, and the way back ends on the entry it started from
+    static const struct {
+        const char *name;
+        drive_mode_t mode;
+        const uint8_t *sequence;
+        uint8_t length;
+    } drive_paths[] = {
+        {"wave_200", DRIVE_WAVE, coil_wave_sequence, 4},
+        {"half_200", DRIVE_HALF, coil_half_sequence, 8},
+    };
+    for (int m = 0; m < 2; m++) {
+        bench_begin(&run, drive_paths[m].name, 1, 0);
+        run.err = motor_set_drive_mode(drive_paths[m].mode);
+        bench_wait_idle(&run);
+        hwsim_advance_ns(BENCH_SETTLE_NS);
+        coil.seq = drive_paths[m].sequence;
+        coil.seq_len = drive_paths[m].length;
+        coil.seq_index = coil_sequence_index(board);
+        int seq_start = coil.seq_index;
+        bench_check(&run, seq_start >= 0, "drive mode did not start on an entry of its sequence");
+        coil.seq_dir = 1;
+        if (!run.err) run.err = motor_start_move(NUMSTEPS, MOTOR_FORWARD, &profile);
+        bench_wait_idle(&run);
+        hwsim_advance_ns(BENCH_SETTLE_NS);
+        coil.seq_dir = -1;
+        if (!run.err) run.err = motor_start_move(NUMSTEPS, MOTOR_REVERSE, &profile);
+        bench_wait_idle(&run);
+        hwsim_advance_ns(BENCH_SETTLE_NS);
+        bench_check(&run, coil.seq_index == seq_start, "reverse move did not return");
+        bench_check(&run, coil.seq_steps == 2 * NUMSTEPS, "drive mode step count");
+        coil.seq = NULL;
+        if (!run.err) run.err = motor_set_drive_mode(DRIVE_FULL);
+        bench_wait_idle(&run);
+        run.steps = 2 * NUMSTEPS;
+        bench_end(&run, 0);
+    }
+
+    // Reads only reach the board's own address, the writes above went out on ALLCALL
+    pca_default.address = PCA_HW_ADDRESS;
+    bench_begin(&run, "verify", 0, 0);
+    run.err = motor_verify();
+    run.steps = 1;
+    bench_end(&run, 0);
+
+    // Brown-out, the first read finds the power-on registers and rebuilds the board
+    bench_begin(&run, "verify_brownout", 0, 0);
+    hwsim_pca_power_cycle(hwsim_pca(0));
+    run.err = motor_verify();
+    if (run.err > 0) {
+        // The rebuild went into the ring, read again once the engine has sent it
+        while (!I2C_tx_idle()) {
+            I2C_tx_service();
+            if (!I2C_tx_stalled()) CPU_WAIT();
+        }
+        run.err = motor_verify();
+    }
+    run.steps = 1;
+    bench_end(&run, 0);
+
+    // Limit switch opens part way through the move, the GPIO1 ISR stops it on the edge
+    gpio_event_t event;
+    while (gpio1_event_pop(&event)) {}     // the button presses above
+    hwsim_gpio1_set_input(1u << LIMIT_PIN, 1);
+    motor_bind_limit(LIMIT_PIN, GPIO_EDGE_FALLING);
+    bench_begin(&run, "limit_200", 1, 1);
+    run.err = motor_start_move(NUMSTEPS, MOTOR_FORWARD, &profile);
+    while (!run.err && motor_busy() && hwsim_stats.timer_overflows - run.start.timer_overflows < LIMIT_AFTER_STEPS) {
+        I2C_tx_service();
+        if (!I2C_tx_stalled()) CPU_WAIT();
+    }
+    uint32_t stops = motor_limit_stops;
+    coil.stop_ns = hwsim_time_ns();
+    hwsim_gpio1_set_input(1u << LIMIT_PIN, 0);
+    while (motor_busy()) hwsim_nop();
+    run.stop_latency_ns = hwsim_time_ns() - coil.stop_ns;
+    run.steps = hwsim_stats.timer_overflows - run.start.timer_overflows;
+    bench_wait_idle(&run);
+    if (!run.err && motor_limit_stops != stops + 1) run.err = -1;
+    while (gpio1_event_pop(&event)) {
+        if (event.pin == LIMIT_PIN && event.level == 0) run.events++;
+    }
+    hwsim_gpio1_set_input(1u << LIMIT_PIN, 1);
+    motor_bind_limit(LIMIT_PIN, GPIO_EDGE_NONE);
+    bench_end(&run, 0);
+
+    // Two more boards on SUBADR1. After a reset they don't auto-increment, a block must still
+    // reach every register it covers. pca_group_sync_start() turns AI on, then it is one frame
+    static pca_dev_t group_boards[GROUP_BOARDS];
+    static pca_dev_t *const group_members[GROUP_BOARDS] = {&group_boards[0], &group_boards[1]};
+    static const pca_group_t group = {GROUP_ADDRESS, group_members, GROUP_BOARDS};
+    static const uint8_t led5_block[4] = {0x00, 0x01, 0x00, 0x08};    // on at 256, off at 2048
+    static const uint8_t led6_block[4] = {0x00, 0x02, 0x00, 0x0C};
+    hwsim_pca_t *group_sim[GROUP_BOARDS];
+    for (int b = 0; b < GROUP_BOARDS; b++) {
+        group_sim[b] = hwsim_add_pca(GROUP_BOARD_ADDRESS + b);
+        pca_dev_init(&group_boards[b], GROUP_BOARD_ADDRESS + b);
+    }
+    bench_begin(&run, "group_block", 0, 0);
+    run.err = pca_reset();
+    if (!run.err) run.err = pca_group_init(&group, 1);
+    if (!run.err && (run.err = pca_group_write_block(&group, PCA_LED_ON_L(5), led5_block, 4)) > 0) run.err = 0;
+    bench_wait_idle(&run);
+    hwsim_advance_ns(BENCH_SETTLE_NS);
+    for (int b = 0; b < GROUP_BOARDS && !run.err; b++) {
+        for (int i = 0; i < 4; i++) {
+            bench_check(&run, group_sim[b]->regs[PCA_LED_ON_L(5) + i] == led5_block[i], "block without AI missed a register");
+        }
+        bench_check(&run, pca_dev_verify(&group_boards[b]) == 0, "shadow differs after a block without AI");
+    }
+
+    if (!run.err) run.err = pca_group_sync_start(&group);
+    bench_wait_idle(&run);
+    uint32_t frames = hwsim_stats.frames;
+    if (!run.err && (run.err = pca_group_write_block(&group, PCA_LED_ON_L(6), led6_block, 4)) > 0) run.err = 0;
+    bench_wait_idle(&run);
+    hwsim_advance_ns(BENCH_SETTLE_NS);
+    bench_check(&run, hwsim_stats.frames - frames == 1, "block with AI on not one frame");
+    for (int b = 0; b < GROUP_BOARDS && !run.err; b++) {
+        uint8_t mode1 = group_sim[b]->regs[PCA_Controller.MODE1_REG];
+        bench_check(&run, (mode1 & PCA_Controller.MODE1_AUTO_INC) && !(mode1 & PCA_Controller.MODE1_SLEEP), "group not awake with AI on");
+        for (int i = 0; i < 4; i++) {
+            bench_check(&run, group_sim[b]->regs[PCA_LED_ON_L(6) + i] == led6_block[i], "block with AI on missed a register");
+        }
+        bench_check(&run, pca_dev_verify(&group_boards[b]) == 0, "shadow differs after a block with AI on");
+    }
+    bench_check(&run, pca_group_write_block(&group, PCA_LED_ON_L(6), led6_block, 4) == 0, "repeated block sent again");
+
+    // The motor board lost AI with the reset too, pca_dev_start() brings it back on its own
+    if (!run.err) run.err = pca_dev_start(&pca_default);
+    bench_wait_idle(&run);
+    uint8_t mode1 = hwsim_pca(0)->regs[PCA_Controller.MODE1_REG];
+    bench_check(&run, (mode1 & PCA_Controller.MODE1_AUTO_INC) && !(mode1 & PCA_Controller.MODE1_SLEEP), "board not awake with AI on");
+    bench_check(&run, run.err || pca_dev_verify(&pca_default) == 0, "shadow differs after pca_dev_start()");
+    run.steps = 2;
+    bench_end(&run, 1);
+
+    printf("    ]}%s\n", last ? "" : ",");
+#ifdef PROFILER
+    fprintf(stderr, "profile at %u KHz\n", bus_khz);
+    profiler_dump(bench_print_line);
+#endif
+}
+
+int main(void){
+    static const uint32_t bus_khz[] = {100, 400, 1000};
+    const int runs = sizeof(bus_khz) / sizeof(bus_khz[0]);
+    int failed = 0;
+
+    printf("{\"benchmark\": \"step_bench\", \"version\": %d, \"runs\": [\n", BENCH_VERSION);
+    for (int i = 0; i < runs; i++) {
+        // Each bus rate runs in its own process so the driver starts from its reset state
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            bench_bus(bus_khz[i], i == runs - 1);
+            fflush(stdout);
+            _exit(bench_failures ? 1 : 0);
+        }
+        int status;
+        if (pid < 0 || waitpid(pid, &status, 0) < 0) return 1;
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) failed = 1;
+    }
+    printf("]}\n");
+    return failed;
+}
@@ -0,0 +1,119 @@
+/*
+ * File: TimingCheck.c
+ * Project: Stepper Motor Control via I2C
+ * Description: Host check of the I2C1 SCL timing planner. I2C_plan_timing() must give the
+ *              PSC/SCLL/SCLH of the mode table in the README for 100, 400 and 1000 KHz from the
+ *              48 MHz functional clock, a rate no faster than asked, and I2C_ERR_BAD_SPEED for
+ *              rates and clocks it can't meet. I2C_init_speed() must program the planned values,
+ *              read back from the simulator as the SCL rate it clocks, and refuse a bad rate.
+ *              Prints every mismatch and exits nonzero if there is one.
+ *
+ *              gcc -std=gnu99 -O2 -DHWREG_SIM -Iinclude bench/TimingCheck.c src/BeagleBoneMaster.c \
+ *                  src/MotorControllerLib.c src/MotionPlanner.c src/HostSim.c src/Profiler.c \
+ *                  src/Trace.c -o timing_check
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include "../include/BeagleBoneMaster.h"
+#include "../include/HostSim.h"
+
+#define FCLK_KHZ 48000          // I2C1 functional clock, I2C1.SYS_CLK
+
+//Globals main.c provides on target
+volatile unsigned int svc_stack[1];
+volatile unsigned int irq_stack[1];
+volatile int push_button;
+
+typedef struct {
+    uint32_t bus_khz;
+    uint32_t psc;
+    uint32_t scll;
+    uint32_t sclh;
+} timing_case_t;
+
+// The README mode table
+static const timing_case_t timing_cases[] = {
+    {100, 11, 15, 13},
+    {400, 3, 14, 4},
+    {1000, 1, 9, 3},
+};
+
+typedef struct {
+    uint32_t fclk_khz;
+    uint32_t bus_khz;
+    const char *why;
+} reject_case_t;
+
+static const reject_case_t reject_cases[] = {
+    {FCLK_KHZ, 0, "no rate"},
+    {FCLK_KHZ, 1001, "above Fast-mode Plus"},
+    {FCLK_KHZ, 5000, "far above Fast-mode Plus"},
+    {FCLK_KHZ, 1, "SCLL does not fit 8 bits"},
+    {FCLK_KHZ, 5, "SCLL does not fit 8 bits"},
+    {2000, 100, "clock below the standard mode ICLK"},
+    {8000, 400, "clock below the fast mode ICLK"},
+    {16000, 1000, "clock below the Fast-mode Plus ICLK"},
+};
+
+static int failures;
+
+static void check(_Bool ok, const char *what, uint32_t fclk_khz, uint32_t bus_khz, int64_t got, int64_t want){
+    if (ok) return;
+    printf("FAIL %s: fclk %u KHz, bus %u KHz: got %lld, want %lld\n", what, fclk_khz, bus_khz,
+           (long long)got, (long long)want);
+    failures++;
+}
+
+static void check_plan(const timing_case_t *c){
+    i2c_timing_t timing = {0};
+    int err = I2C_plan_timing(FCLK_KHZ, c->bus_khz, &timing);
+
+    check(err == I2C_OK, "status", FCLK_KHZ, c->bus_khz, err, I2C_OK);
+    check(timing.psc == c->psc, "PSC", FCLK_KHZ, c->bus_khz, timing.psc, c->psc);
+    check(timing.scll == c->scll, "SCLL", FCLK_KHZ, c->bus_khz, timing.scll, c->scll);
+    check(timing.sclh == c->sclh, "SCLH", FCLK_KHZ, c->bus_khz, timing.sclh, c->sclh);
+    // ICLK / ((SCLL + 7) + (SCLH + 5)) is the rate on the wire, never faster than asked
+    uint32_t iclk_khz = FCLK_KHZ / (c->psc + 1);
+    uint32_t want_khz = iclk_khz / (c->scll + 7 + c->sclh + 5);
+    check(timing.bus_khz == want_khz, "bus_khz", FCLK_KHZ, c->bus_khz, timing.bus_khz, want_khz);
+    check(timing.bus_khz <= c->bus_khz, "rate above request", FCLK_KHZ, c->bus_khz, timing.bus_khz, c->bus_khz);
+}
+
+static void check_reject(const reject_case_t *c){
+    i2c_timing_t timing = {0};
+    int err = I2C_plan_timing(c->fclk_khz, c->bus_khz, &timing);
+
+    check(err == I2C_ERR_BAD_SPEED, c->why, c->fclk_khz, c->bus_khz, err, I2C_ERR_BAD_SPEED);
+}
+
+// The planned values reach the module, the simulator clocks SCL from PSC/SCLL/SCLH
+static void check_init(const timing_case_t *c){
+    hwsim_reset();
+    int err = I2C_init_speed(c->bus_khz);
+    check(err == I2C_OK, "I2C_init_speed status", FCLK_KHZ, c->bus_khz, err, I2C_OK);
+
+    uint32_t iclk_khz = FCLK_KHZ / (c->psc + 1);
+    uint32_t want_khz = iclk_khz / (c->scll + 7 + c->sclh + 5);
+    check(hwsim_bus_khz() == want_khz, "programmed SCL rate", FCLK_KHZ, c->bus_khz, hwsim_bus_khz(), want_khz);
+}
+
+int main(void){
+    const int cases = sizeof(timing_cases) / sizeof(timing_cases[0]);
+    const int rejects = sizeof(reject_cases) / sizeof(reject_cases[0]);
+
+    for (int i = 0; i < cases; i++) {
+        check_plan(&timing_cases[i]);
+        check_init(&timing_cases[i]);
+    }
+    for (int i = 0; i < rejects; i++) {
+        check_reject(&reject_cases[i]);
+    }
+
+    hwsim_reset();
+    int err = I2C_init_speed(1001);
+    check(err == I2C_ERR_BAD_SPEED, "I2C_init_speed status", FCLK_KHZ, 1001, err, I2C_ERR_BAD_SPEED);
+
+    printf("%s: %d rates, %d rejections, %d failures\n", failures ? "FAIL" : "ok", cases, rejects + 1, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,289 @@
+/*
+ * File: TraceReplay.c
+ * Project: Stepper Motor Control via I2C
+ * Description: Host replay of a PCA frame trace (see Trace.h) against the PCA9685 model in
+ *              HostSim.c. The capture is a dump of trace_ring from a -DTRACE build, taken with a
+ *              debugger or written by a harness, on its own or anywhere inside a larger RAM dump.
+ *              Frames go out through I2C_write() at the bus rate given with -k, each at the time
+ *              it was recorded relative to the first one. Frames the driver got an error for are
+ *              counted and not sent. A frame that can't start on time because the bus is still
+ *              busy at this rate is late, late_ns_max is the worst of them. gap_us_min/max are the
+ *              recorded intervals between frames. The model state at the end of the trace is
+ *              printed per board, so a capture replays to the same JSON every time and can be
+ *              kept as a regression case. -v lists every frame on stderr.
+ *
+ *              gcc -std=gnu99 -O2 -DHWREG_SIM -Iinclude bench/TraceReplay.c src/BeagleBoneMaster.c \
+ *                  src/MotorControllerLib.c src/MotionPlanner.c src/HostSim.c src/Profiler.c \
+ *                  src/Trace.c -o trace_replay
+ *
+ *              ./trace_replay [-k bus_khz] [-a address]... [-v] capture.bin
+ *
+ *              Without -a one board answers the first slave address in the trace.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "../include/BeagleBoneMaster.h"
+#include "../include/MotorControllerLib.h"
+#include "../include/HostSim.h"
+#include "../include/Trace.h"
+
+#define REPLAY_BOARDS_MAX HWSIM_PCA_MAX
+#define REPLAY_FRAME_MAX 64         // register byte and data of one frame
+#define REPLAY_BUS_KHZ 400
+
+//Globals main.c provides on target
+volatile unsigned int svc_stack[1];
+volatile unsigned int irq_stack[1];
+volatile int push_button;
+
+// trace_ring_t header, read field by field since the capture's len need not be TRACE_LEN
+typedef struct {
+    uint16_t version;
+    uint16_t entry_size;
+    uint32_t len;
+    uint32_t clock_khz;
+    uint32_t head;
+    const trace_entry_t *entries;
+} replay_capture_t;
+
+// One frame rebuilt from its entries
+typedef struct {
+    uint32_t time;
+    uint8_t address;
+    int8_t status;
+    uint8_t len;
+    uint8_t data[REPLAY_FRAME_MAX];
+} replay_frame_t;
+
+typedef struct {
+    uint32_t entries;
+    uint32_t dropped;           // overwritten before the capture
+    uint32_t partial;           // frames whose first entries were overwritten
+    uint32_t frames;
+    uint32_t failed;            // recorded with an error, not replayed
+    uint32_t replay_errors;     // replayed frames the model did not take
+    uint32_t late;
+    uint64_t late_ns_max;
+    uint64_t gap_ns_min;
+    uint64_t gap_ns_max;
+    uint64_t gap_max_at_ns;     // time of the frame after the longest gap
+    uint64_t span_ns;
+} replay_stats_t;
+
+static uint8_t *replay_load(const char *path, long *size){
+    FILE *f = fopen(path, "rb");
+    uint8_t *buf = NULL;
+
+    if (!f) return NULL;
+    if (fseek(f, 0, SEEK_END) == 0 && (*size = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0) {
+        buf = malloc(*size);
+        if (buf && fread(buf, 1, *size, f) != (size_t)*size) {
+            free(buf);
+            buf = NULL;
+        }
+    }
+    fclose(f);
+    return buf;
+}
+
+// First ring in the dump with a header this tool understands
+static int replay_find(const uint8_t *buf, long size, replay_capture_t *cap){
+    const long header = offsetof(trace_ring_t, entries);
+
+    for (long at = 0; at + header <= size; at += 4) {
+        const trace_ring_t *ring = (const trace_ring_t *)(buf + at);
+        if (ring->magic != TRACE_MAGIC || ring->version != TRACE_VERSION) continue;
+        if (ring->entry_size != sizeof(trace_entry_t) || !ring->len || (ring->len & (ring->len - 1))) continue;
+        if (at + header + (long)ring->len * ring->entry_size > size) continue;
+        cap->version = ring->version;
+        cap->entry_size = ring->entry_size;
+        cap->len = ring->len;
+        cap->clock_khz = ring->clock_khz ? ring->clock_khz : TRACE_CLOCK_KHZ;
+        cap->head = ring->head;
+        cap->entries = ring->entries;
+        return 0;
+    }
+    return -1;
+}
+
+static uint64_t replay_ticks_to_ns(uint64_t ticks, uint32_t clock_khz){
+    return ticks * 1000000ull / clock_khz;
+}
+
+static void replay_send(const replay_frame_t *frame, uint64_t at_ns, replay_stats_t *stats, _Bool verbose){
+    uint64_t now = hwsim_time_ns();
+
+    if (now < at_ns) {
+        hwsim_advance_ns(at_ns - now);
+    } else if (now > at_ns) {
+        stats->late++;
+        if (now - at_ns > stats->late_ns_max) stats->late_ns_max = now - at_ns;
+    }
+    if (verbose) {
+        fprintf(stderr, "%12llu us  0x%02x  reg 0x%02x  len %2u  status %d\n",
+                (unsigned long long)(at_ns / 1000), frame->address, frame->data[0],
+                frame->len, frame->status);
+    }
+    if (frame->status != I2C_OK) {
+        stats->failed++;
+        return;
+    }
+    // A general call carries its command byte alone
+    uint32_t len = frame->address ? frame->len : 1;
+    if (I2C_write(frame->address, frame->data, len) != I2C_OK) stats->replay_errors++;
+}
+
+static void replay_run(const replay_capture_t *cap, replay_stats_t *stats, _Bool verbose){
+    uint32_t oldest = cap->head > cap->len ? cap->head - cap->len : 0;
+    replay_frame_t frame = {0};
+    _Bool open = 0;
+    _Bool first = 1;
+    uint32_t prev_time = 0;
+    uint64_t elapsed_ns = 0;
+    uint64_t start_ns = hwsim_time_ns();
+
+    memset(stats, 0, sizeof(*stats));
+    stats->dropped = oldest;
+    stats->gap_ns_min = UINT64_MAX;
+
+    for (uint32_t n = oldest; n <= cap->head; n++) {
+        const trace_entry_t *e = n < cap->head ? &cap->entries[n & (cap->len - 1)] : NULL;
+
+        if (e && (e->address & TRACE_CONT)) {
+            stats->entries++;
+            if (open && frame.len < REPLAY_FRAME_MAX) {
+                frame.data[frame.len++] = e->value;
+            } else if (n == oldest) {
+                stats->partial++;   // the start of this frame was overwritten, its bytes are skipped
+            }
+            continue;
+        }
+        if (open) {
+            replay_send(&frame, start_ns + elapsed_ns, stats, verbose);
+            stats->frames++;
+            open = 0;
+        }
+        if (!e) break;
+
+        stats->entries++;
+        if (!first) {
+            uint64_t gap = replay_ticks_to_ns((uint32_t)(e->time - prev_time), cap->clock_khz);
+            elapsed_ns += gap;
+            if (gap < stats->gap_ns_min) stats->gap_ns_min = gap;
+            if (gap > stats->gap_ns_max) {
+                stats->gap_ns_max = gap;
+                stats->gap_max_at_ns = elapsed_ns;
+            }
+        }
+        first = 0;
+        prev_time = e->time;
+        frame.time = e->time;
+        frame.address = e->address;
+        frame.status = e->status;
+        frame.data[0] = e->reg;
+        frame.data[1] = e->value;
+        frame.len = 2;
+        open = 1;
+    }
+    stats->span_ns = elapsed_ns;
+    if (stats->gap_ns_min == UINT64_MAX) stats->gap_ns_min = 0;
+}
+
+// First slave address in the trace, general calls aside
+static uint8_t replay_first_address(const replay_capture_t *cap){
+    uint32_t oldest = cap->head > cap->len ? cap->head - cap->len : 0;
+
+    for (uint32_t n = oldest; n < cap->head; n++) {
+        uint8_t address = cap->entries[n & (cap->len - 1)].address;
+        if (address && !(address & TRACE_CONT)) return address;
+    }
+    return PCA_ADDRESS;
+}
+
+static void replay_print(const replay_capture_t *cap, const replay_stats_t *stats, uint32_t bus_khz, int boards){
+    printf("{\"tool\": \"trace_replay\", \"version\": %u, \"bus_khz\": %u, \"clock_khz\": %u, "
+           "\"ring_len\": %u, \"head\": %u,\n", cap->version, bus_khz, cap->clock_khz, cap->len, cap->head);
+    printf(" \"entries\": %u, \"dropped\": %u, \"partial_frames\": %u, \"frames\": %u, \"failed\": %u, "
+           "\"replay_errors\": %u, \"late_frames\": %u, \"late_ns_max\": %llu,\n",
+           stats->entries, stats->dropped, stats->partial, stats->frames, stats->failed,
+           stats->replay_errors, stats->late, (unsigned long long)stats->late_ns_max);
+    printf(" \"span_us\": %llu, \"gap_us_min\": %llu, \"gap_us_max\": %llu, \"gap_max_at_us\": %llu,\n",
+           (unsigned long long)(stats->span_ns / 1000), (unsigned long long)(stats->gap_ns_min / 1000),
+           (unsigned long long)(stats->gap_ns_max / 1000), (unsigned long long)(stats->gap_max_at_ns / 1000));
+    printf(" \"boards\": [\n");
+    for (int b = 0; b < boards; b++) {
+        const hwsim_pca_t *pca = hwsim_pca(b);
+        printf("    {\"address\": %u, \"mode1\": %u, \"mode2\": %u, \"pre_scale\": %u, \"coil_pattern\": %u, "
+               "\"output_updates\": %u, \"outputs\": [", pca->address, pca->regs[PCA_Controller.MODE1_REG],
+               pca->regs[PCA_Controller.MODE2_REG], pca->regs[PCA_Controller.PRE_SCALE],
+               hwsim_coil_pattern(pca), pca->output_updates);
+        for (int ch = 0; ch < 16; ch++) {
+            printf("%u%s", pca->outputs[ch], ch < 15 ? ", " : "");
+        }
+        printf("]}%s\n", b < boards - 1 ? "," : "");
+    }
+    printf(" ]}\n");
+}
+
+static void replay_usage(void){
+    fprintf(stderr, "usage: trace_replay [-k bus_khz] [-a address]... [-v] capture.bin\n");
+}
+
+int main(int argc, char **argv){
+    uint32_t bus_khz = REPLAY_BUS_KHZ;
+    uint8_t addresses[REPLAY_BOARDS_MAX];
+    int boards = 0;
+    _Bool verbose = 0;
+    const char *path = NULL;
+    replay_capture_t cap;
+    replay_stats_t stats;
+    long size = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-k") && i + 1 < argc) {
+            bus_khz = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-a") && i + 1 < argc && boards < REPLAY_BOARDS_MAX) {
+            addresses[boards++] = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-v")) {
+            verbose = 1;
+        } else if (argv[i][0] != '-' && !path) {
+            path = argv[i];
+        } else {
+            replay_usage();
+            return 2;
+        }
+    }
+    if (!path) {
+        replay_usage();
+        return 2;
+    }
+
+    uint8_t *buf = replay_load(path, &size);
+    if (!buf) {
+        fprintf(stderr, "trace_replay: can't read %s\n", path);
+        return 1;
+    }
+    if (replay_find(buf, size, &cap) < 0) {
+        fprintf(stderr, "trace_replay: no trace ring in %s\n", path);
+        return 1;
+    }
+
+    hwsim_reset();
+    if (!boards) addresses[boards++] = replay_first_address(&cap);
+    for (int b = 0; b < boards; b++) {
+        hwsim_add_pca(addresses[b]);
+    }
+    if (I2C_init_speed(bus_khz) < 0) {
+        fprintf(stderr, "trace_replay: no SCL timing for %u KHz\n", bus_khz);
+        return 1;
+    }
+
+    replay_run(&cap, &stats, verbose);
+    replay_print(&cap, &stats, bus_khz, boards);
+    free(buf);
+    return stats.replay_errors ? 1 : 0;
+}
@@ -9,30 +9,88 @@
 #ifndef BEAGLEBONEMASTER_H_
 #define BEAGLEBONEMASTER_H_
 
+#include <stdint.h>
+
 //macro to access hardware registers----------------------------------------------------------------------
 #define HWREG(x) (*((volatile unsigned int *)(x)))
 
+//Driver register access and CPU hints. Target builds dereference the address, host builds
+//compiled with -DHWREG_SIM run every access through the register model in HostSim.c
+#ifdef HWREG_SIM
+#include "HostSim.h"
+#define HWREG_READ(x)       hwreg_read(x)
+#define HWREG_WRITE(x, v)   hwreg_write((x), (v))
+#define CPU_NOP()           hwsim_nop()     // one cycle of a delay loop
+#define CPU_WAIT()          hwsim_idle()    // sleep until the next event, as WFI would
+#define DMA_ADDR(p)         hwsim_dma_addr(p)   // host pointers do not fit a 32 bit EDMA address
+#define CPU_DSB()           __sync_synchronize()
+#else
+#define HWREG_READ(x)       HWREG(x)
+#define HWREG_WRITE(x, v)   (HWREG(x) = (v))
+#define CPU_NOP()           asm("NOP")
+#define CPU_WAIT()          asm volatile("WFI" ::: "memory")   // sleep until an interrupt is pending
+#define DMA_ADDR(p)         ((uint32_t)(uintptr_t)(p))
+#define CPU_DSB()           asm volatile("DSB" ::: "memory")    // earlier stores reach memory before later accesses
+#endif
+
 //extern defs & Globals
 extern volatile int timerFlag;
 extern volatile int push_button;
 
-//typedefs
+//Board options, override with -D at build time
+#ifndef I2C1_BUS_KHZ
+#define I2C1_BUS_KHZ 400        // SCL rate I2C_init() sets up
+#endif
+
+//typedefs. Each register map is defined static const right after its type, so every file sees
+//the values and BASE + OFFSET folds into one immediate. No copy is stored unless its address is taken
 
 typedef struct { //Clock Module Peripherals
     uint32_t const CM_PER_BASE;  // Clock module base address
     uint32_t const CM_PER_GPIO1_CLKCTRL; //Location of GPIO1 clock
     uint32_t const CM_PER_I2C1_CLKCTRL; //Location of I2C1 Module
+    uint32_t const CM_PER_TIMER5_CLKCTRL; //Location of Timer5 clock
+    uint32_t const CM_PER_TIMER4_CLKCTRL; //Location of Timer4 clock, the edge timestamp counter
+    uint32_t const CM_PER_TPCC_CLKCTRL; //Location of the EDMA3 channel controller clock
+    uint32_t const CM_PER_TPTC0_CLKCTRL; //Location of the EDMA3 transfer controller 0 clock
+    // Commands
+    uint32_t const MODULEMODE_ENABLE;   //CLKCTRL value that clocks the module
+    uint32_t const MODULEMODE_DISABLE;  //CLKCTRL value that gates it, registers keep their contents
+    uint32_t const IDLEST_MASK;         //CLKCTRL bits reporting the module state
+    uint32_t const IDLEST_FUNC;         //Module clocked and accessible
+    uint32_t const IDLEST_DISABLED;     //Module clock gated, an access would fault
+    uint32_t const POLL_TIMEOUT;        //IDLEST polls before a transition is given up on
 } clk_mods_t; 
 
+static const clk_mods_t clocks = {
+    .CM_PER_BASE = 0x44E00000,
+    .CM_PER_GPIO1_CLKCTRL = 0xAC,
+    .CM_PER_I2C1_CLKCTRL = 0x48,
+    .CM_PER_TIMER5_CLKCTRL = 0xEC,
+    .CM_PER_TIMER4_CLKCTRL = 0x88,
+    .CM_PER_TPCC_CLKCTRL = 0xBC,
+    .CM_PER_TPTC0_CLKCTRL = 0x24,
+    // Commands
+    .MODULEMODE_ENABLE = 0x2,
+    .MODULEMODE_DISABLE = 0x0,
+    .IDLEST_MASK = 0x30000,
+    .IDLEST_FUNC = 0x0,
+    .IDLEST_DISABLED = 0x30000,
+    .POLL_TIMEOUT = 1000
+};
+
 //GPIO configuration registers and associated commands
 typedef struct {
     uint32_t const CM_PER_CLKCTRL;  // Clock module control register
     uint32_t const BASE;            // Base address of GPIO1
+    uint32_t const DATAIN;          // Pin level register
+    uint32_t const RISEDETECT;      // Rising edge detection register
     uint32_t const FALLDETECT;      // Falling edge detection register
     uint32_t const DEBOUNCE_ENBL;   // Debounce enable register
     uint32_t const DEBOUNCETIME;    // Debounce time register
     uint32_t const IRQSTATUS;       // IRQ status register
     uint32_t const IRQSTATUS_SET_0; // IRQ status set register
+    uint32_t const IRQSTATUS_CLR_0; // IRQ enable clear register
     uint32_t const SYSCONFIG;       // System configuration register
     // Commands
     uint32_t const TURN_ON_CLK_AND_DB;     //turn on clock and turn on debounce clock
@@ -40,23 +98,88 @@ typedef struct {
     uint32_t const GPIO1_3_SIGNAL;         //this signal line for target GPIO1 bit
 } GPIOConfigs_t;
 
-extern const GPIOConfigs_t GPIO1;
+static const GPIOConfigs_t GPIO1 = {
+    .BASE = 0x4804C000,
+    .DATAIN = 0x138,
+    .RISEDETECT = 0x148,
+    .FALLDETECT = 0x14C,
+    .DEBOUNCE_ENBL = 0x150,
+    .DEBOUNCETIME = 0x154,
+    .IRQSTATUS = 0x2C,
+    .IRQSTATUS_SET_0 = 0x34,
+    .IRQSTATUS_CLR_0 = 0x3C,
+    .SYSCONFIG = 0x10,
+    .TURN_ON_CLK_AND_DB = 0x00040002, 
+    .DBNC_SET_TIME = 0xA0,     
+    .GPIO1_3_SIGNAL = 0x8     //gpio1_3 signal bit 1000'b
+};
 
 //Interrupt controller and associated commands
 typedef struct {
     uint32_t const BASE;          // Interrupt Controller Base Address
     uint32_t const SYSCONFIG;     // Offset for the System Configuration Register
+    uint32_t const SIR_IRQ;       // Offset to the active IRQ number register
     uint32_t const CONTROL;        // Offset to control register for new irq generation
-    uint32_t const MIR_CLEAR2;    // Offset to clear the interrupt mask for set 2
-    uint32_t const MIR_CLEAR3;    // Offset to clear the interrupt mask for set 3
+    uint32_t const IRQ_PRIORITY;  // Offset to the active IRQ priority register
+    uint32_t const THRESHOLD;     // Offset to the priority threshold register
+    uint32_t const MIR_CLEAR0;    // Offset to clear the interrupt mask for set 0
+    uint32_t const MIR_SET0;      // Offset to set the interrupt mask for set 0
+    uint32_t const MIR_STRIDE;    // Distance between the mask registers of two sets
+    uint32_t const ILR0;          // Offset to the priority/routing register of interrupt 0
     // Commands
     uint32_t const RESET;         // Command to reset the interrupt controller
-    uint32_t const UNMASK_TIMER5; // Command to unmask Timer 5 interrupts
-    uint32_t const UNMASK_GPIO1;  // Command to unmask GPIO1 interrupts
     uint32_t const NEW_IRQ;       // Command to allow new irq signals
+    uint32_t const ACTIVE_IRQ_MASK;   // SIR_IRQ bits holding the interrupt number
+    uint32_t const SPURIOUS_IRQ;      // SIR_IRQ bits set when no interrupt is active
+    uint32_t const PRIORITY_MASK;     // IRQ_PRIORITY bits holding the priority
+    uint32_t const THRESHOLD_OFF;     // THRESHOLD value that lets every priority through
+    // Interrupt numbers and priorities, 0 is the highest priority
+    uint32_t const IRQ_I2C1;
+    uint32_t const IRQ_TIMER5;
+    uint32_t const IRQ_GPIO1A;
+    uint32_t const PRIORITY_TIMER5;
+    uint32_t const PRIORITY_I2C1;
+    uint32_t const PRIORITY_GPIO1;
 } InterruptConfigs_t;
 
-extern const InterruptConfigs_t INTCConfig;
+#define INTC_NUM_IRQS 128
+#define INTC_MAX_PRIORITY 0x3F      // lowest priority, ILR holds 6 bits
+
+typedef void (*irq_handler_t)(void);
+
+extern volatile uint32_t irq_spurious;  // SIR_IRQ reads with nothing active, or with no handler
+
+//gcc IRQ entry, irq_director() is jumped to straight from the vector table
+#if defined(__arm__) && !defined(HWREG_SIM)
+#define IRQ_ENTRY __attribute__((interrupt("IRQ")))
+#else
+#define IRQ_ENTRY
+#endif
+
+static const InterruptConfigs_t INTCConfig = {
+    .BASE = 0x48200000,
+    .SYSCONFIG = 0x10,
+    .SIR_IRQ = 0x40,
+    .CONTROL = 0x48,
+    .IRQ_PRIORITY = 0x60,
+    .THRESHOLD = 0x68,
+    .MIR_CLEAR0 = 0x88,
+    .MIR_SET0 = 0x8C,
+    .MIR_STRIDE = 0x20,
+    .ILR0 = 0x100,
+    .RESET = 0x2,
+    .NEW_IRQ = 0x01,
+    .ACTIVE_IRQ_MASK = 0x7F,
+    .SPURIOUS_IRQ = 0xFFFFFF80,
+    .PRIORITY_MASK = 0x7F,
+    .THRESHOLD_OFF = 0xFF,
+    .IRQ_I2C1 = 71,
+    .IRQ_TIMER5 = 93,
+    .IRQ_GPIO1A = 98,
+    .PRIORITY_TIMER5 = 4,
+    .PRIORITY_I2C1 = 4,            //same level as the step timer, see IRQ_init()
+    .PRIORITY_GPIO1 = 16
+};
 
 //Beaglebone P9 Pad Registers and Mode Mux
 typedef struct {
@@ -66,7 +189,12 @@ typedef struct {
     uint32_t const MODE2_SELECT;      // Mode2 select command for I2C1 pins
 } P9HeaderConfig_t;
 
-extern const P9HeaderConfig_t P9HeaderConfig;
+static const P9HeaderConfig_t P9HeaderConfig = {
+    .BASE = 0x44E10000,
+    .CONF_SPI0_D1 = 0x958,
+    .CONF_SPI0_CS0 = 0x95C,
+    .MODE2_SELECT = 0x32
+};
 
 //I2C1 Registers Set & Commands
 typedef struct {
@@ -81,19 +209,285 @@ typedef struct {
     uint32_t const SA;              // Slave address register offset
     uint32_t const CNT;             // Count register offset
     uint32_t const IRQSTATUS_RAW;   // IRQ status register offset
+    uint32_t const IRQSTATUS;       // IRQ status clear register offset (write 1 to clear)
+    uint32_t const IRQENABLE_SET;   // IRQ enable set register offset
+    uint32_t const IRQENABLE_CLR;   // IRQ enable clear register offset
+    uint32_t const DMATXENABLE_SET; // TX DMA request enable register offset
+    uint32_t const DMATXENABLE_CLR; // TX DMA request disable register offset
+    uint32_t const SYSS;            // Reset status register offset
+    uint32_t const SYSTEST;         // Test register offset, drives SCL/SDA directly for bus recovery
     // I2C Commands
-    uint32_t const SYS_CLK;         // Clock frequency for this module
-    uint32_t const ICLK;            // I2C internal clock frequency
-    uint32_t const FS_MD_FREQUENCE; // F/S mode frequency for the SCL line
-    uint32_t const SCL_LOW_TIME;     //Low and High time for 400 KHz frequency
-    uint32_t const SCL_HIGH_TIME;
-    uint32_t const PSC_VALUE;       // Value to load into prescalar register
+    uint32_t const SYS_CLK;         // Functional clock in MHz, PSC divides it down to ICLK
+    uint32_t const FS_MD_FREQUENCE; // SCL rate in KHz I2C_init() plans for
     uint32_t const START_TRANSFER;  // Start transfer command
+    uint32_t const START_NO_STOP;   // START_TRANSFER without STP, the frame ends in a repeated START
+    uint32_t const START_RECEIVE;   // Master receive frame, START/address/data.../STOP
     uint32_t const ENABLE_MODULE;   // Enable module command
     uint32_t const IRQ_RESET;       // Clear all IRQ signals command
+    uint32_t const CLEAR_ALL_IRQ;   // Write 1 to clear mask for every status bit
+    uint32_t const STOP_CONDITION;  // CON STP bit, releases the bus after a NACK
+    uint32_t const BUF_XDMA_EN;     // BUF bit, TX FIFO requests go to the EDMA instead of XRDY
+    uint32_t const BUF_TXFIFO_CLR;  // BUF bit, empties the TX FIFO
+    uint32_t const DMA_REQ_ENABLE;  // DMATXENABLE bit for the TX request line
+    uint32_t const SOFT_RESET;      // SYSC SRST bit
+    uint32_t const RESET_DONE;      // SYSS RDONE bit
+    uint32_t const SYSTEST_IO_MODE; // ST_EN | TMODE = 3, SCL_O/SDA_O drive the pins
+    uint32_t const SYSTEST_SCL_O;   // SCL released (high) when set
+    uint32_t const SYSTEST_SDA_O;   // SDA released (high) when set
+    uint32_t const SYSTEST_SDA_I;   // SDA_I_FUNC, level on the SDA pin
+    uint32_t const RECOVERY_PULSES; // SCL pulses that free a slave stuck in the middle of a byte
+    uint32_t const RECOVERY_HALF_CLOCK; // delay() counts per half SCL period of the recovery clock, ~5 us
+    // IRQSTATUS_RAW bits
+    uint32_t const STATUS_AL;       // Arbitration lost
+    uint32_t const STATUS_NACK;     // No acknowledge from slave
+    uint32_t const STATUS_ARDY;     // Register access ready, transfer complete
+    uint32_t const STATUS_RRDY;     // Receive FIFO holds data
+    uint32_t const STATUS_XRDY;     // Transmit FIFO ready for data
+    uint32_t const STATUS_BF;       // Bus free, a STOP finished
+    uint32_t const STATUS_BB;       // Bus busy
+    uint32_t const POLL_TIMEOUT;    // Status polls before a wait gives up
 } I2CConfig_t;
 
-extern const I2CConfig_t I2C1;
+//Return codes for I2C transactions, zero is success
+typedef enum {
+    I2C_OK = 0,
+    I2C_ERR_TIMEOUT = -1,
+    I2C_ERR_NACK = -2,
+    I2C_ERR_ARB_LOST = -3,
+    I2C_ERR_BUS_BUSY = -4,
+    I2C_ERR_QUEUE_FULL = -5,
+    I2C_ERR_BAD_SPEED = -6
+} i2c_status_t;
+
+//PSC/SCLL/SCLH for one SCL rate, see I2C_plan_timing()
+typedef struct {
+    uint32_t psc;
+    uint32_t scll;
+    uint32_t sclh;
+    uint32_t bus_khz;       // rate these values give, never above the requested one
+} i2c_timing_t;
+
+#define I2C_FRAME_MAX 32      // bytes per queued frame, matches the TX FIFO depth
+#define I2C_TX_QUEUE_LEN 16   // frames in the transmit ring, must be a power of two
+
+//One queued transaction, data[0] is normally the slave's register pointer
+typedef struct {
+    uint8_t address;
+    uint8_t len;
+    uint8_t data[I2C_FRAME_MAX];
+} i2c_frame_t;
+
+extern volatile uint32_t i2c_tx_errors;
+
+#define I2C_RETRY_MAX 2       // plain retries of a failed frame before the bus is cleared
+#define I2C_TX_SLACK_US 200   // on top of twice a queued frame's bus time before it is overdue
+
+//Recovery ladder counters, one per tier. A failed frame is retried I2C_RETRY_MAX times, then
+//again after SCL pulses, then after an I2C1 soft reset. Only then is it given up on
+typedef struct {
+    uint32_t retries;       // tier 1, frame sent again as is
+    uint32_t bus_clears;    // tier 2, SCL pulses and a STOP from I2C_bus_clear()
+    uint32_t restarts;      // tier 3, I2C_restart()
+    uint32_t reinits;       // tier 4, boards rebuilt from their shadow by motor_recover()
+    uint32_t failures;      // frames given up after tier 3
+    uint32_t timeouts;      // engine frames stalled past their deadline, see I2C_tx_service()
+} i2c_recovery_stats_t;
+
+extern i2c_recovery_stats_t i2c_recovery;
+
+static const I2CConfig_t I2C1 = {
+    .BASE = 0x4802A000,            
+    .SYSC = 0x10,                  
+    .PSC = 0xB0,                  
+    .SCLL = 0xB4,                  
+    .SCLH = 0xB8,                  
+    .BUF = 0x94,                   
+    .DATA = 0x9C,                 
+    .CON = 0xA4,                  
+    .SA = 0xAC,                    
+    .CNT = 0x98,                   
+    .IRQSTATUS_RAW = 0x24,        
+    .IRQSTATUS = 0x28,
+    .IRQENABLE_SET = 0x2C,
+    .IRQENABLE_CLR = 0x30,
+    .DMATXENABLE_SET = 0x38,
+    .DMATXENABLE_CLR = 0x40,
+    .SYSS = 0x90,
+    .SYSTEST = 0xBC,
+    // Commands
+    .SYS_CLK = 48,                 //PER_CLKOUTM2 / 4
+    .FS_MD_FREQUENCE = I2C1_BUS_KHZ,        
+    .START_TRANSFER = 0x8603,      
+    .START_NO_STOP = 0x8601,
+    .START_RECEIVE = 0x8403,
+    .ENABLE_MODULE = 0x8000,       
+    .IRQ_RESET = 0x00,
+    .CLEAR_ALL_IRQ = 0x7FFF,
+    .STOP_CONDITION = 0x02,
+    .BUF_XDMA_EN = 0x80,
+    .BUF_TXFIFO_CLR = 0x40,
+    .DMA_REQ_ENABLE = 0x1,
+    .SOFT_RESET = 0x2,
+    .RESET_DONE = 0x1,
+    .SYSTEST_IO_MODE = 0xB000,
+    .SYSTEST_SCL_O = 0x4,
+    .SYSTEST_SDA_O = 0x1,
+    .SYSTEST_SDA_I = 0x40,
+    .RECOVERY_PULSES = 9,
+    .RECOVERY_HALF_CLOCK = 2500,
+    .STATUS_AL = 0x01,
+    .STATUS_NACK = 0x02,
+    .STATUS_ARDY = 0x04,
+    .STATUS_RRDY = 0x08,
+    .STATUS_XRDY = 0x10,
+    .STATUS_BF = 0x100,
+    .STATUS_BB = 0x1000,
+    .POLL_TIMEOUT = 100000
+};
+
+//EDMA3 channel controller registers, PaRAM layout & Commands
+typedef struct {
+    uint32_t const BASE;            // Base address of EDMA3CC
+    uint32_t const DCHMAP0;         // Channel to PaRAM set map of channel 0, 4 bytes per channel
+    uint32_t const EMCR;            // Event missed clear register offset
+    uint32_t const ECR;             // Event clear register offset
+    uint32_t const SECR;            // Secondary event clear register offset
+    uint32_t const EESR;            // Event enable set register offset
+    uint32_t const EECR;            // Event enable clear register offset
+    uint32_t const PARAM0;          // PaRAM set 0 offset
+    uint32_t const PARAM_SIZE;      // Bytes per PaRAM set
+    // PaRAM entry offsets
+    uint32_t const OPT;
+    uint32_t const SRC;
+    uint32_t const A_B_CNT;         // ACNT in 15:0, BCNT in 31:16
+    uint32_t const DST;
+    uint32_t const SRC_DST_BIDX;    // SRCBIDX in 15:0, DSTBIDX in 31:16
+    uint32_t const LINK_BCNTRLD;
+    uint32_t const SRC_DST_CIDX;
+    uint32_t const CCNT;
+    // Commands
+    uint32_t const CLK_ENABLE;      // MODULEMODE enable for the TPCC and TPTC0 clocks
+    uint32_t const EVT_I2C1_TX;     // I2CTXEVT1, also the channel and PaRAM set used for it
+    uint32_t const OPT_STATIC;      // PaRAM set is neither updated nor linked after a transfer
+    uint32_t const OPT_AB_SYNC;     // SYNCDIM, one event moves BCNT arrays of ACNT bytes
+    uint32_t const OPT_TCC_SHIFT;   // Transfer complete code position
+    uint32_t const LINK_NULL;       // No link
+    uint32_t const DCHMAP_SHIFT;    // PaRAM set number position in DCHMAP
+} EDMAConfig_t;
+
+static const EDMAConfig_t EDMA = {
+    .BASE = 0x49000000,
+    .DCHMAP0 = 0x100,
+    .EMCR = 0x308,
+    .ECR = 0x1008,
+    .SECR = 0x1040,
+    .EESR = 0x1030,
+    .EECR = 0x1028,
+    .PARAM0 = 0x4000,
+    .PARAM_SIZE = 0x20,
+    .OPT = 0x00,
+    .SRC = 0x04,
+    .A_B_CNT = 0x08,
+    .DST = 0x0C,
+    .SRC_DST_BIDX = 0x10,
+    .LINK_BCNTRLD = 0x14,
+    .SRC_DST_CIDX = 0x18,
+    .CCNT = 0x1C,
+    // Commands
+    .CLK_ENABLE = 0x2,
+    .EVT_I2C1_TX = 26,
+    .OPT_STATIC = 0x8,
+    .OPT_AB_SYNC = 0x4,
+    .OPT_TCC_SHIFT = 12,
+    .LINK_NULL = 0xFFFF,
+    .DCHMAP_SHIFT = 5
+};
+
+//DMTimer5 Registers Set & Commands
+typedef struct {
+    uint32_t const BASE;            // Base address of DMTimer5
+    uint32_t const CLKSEL;          // CLKSEL_TIMER5_CLK register (absolute address in CM_DPLL)
+    uint32_t const IRQ_EOI;         // End of interrupt register offset
+    uint32_t const IRQSTATUS;       // IRQ status register offset (write 1 to clear)
+    uint32_t const IRQENABLE_SET;   // IRQ enable set register offset
+    uint32_t const IRQENABLE_CLR;   // IRQ enable clear register offset
+    uint32_t const TCLR;            // Control register offset
+    uint32_t const TCRR;            // Counter register offset
+    uint32_t const TLDR;            // Load register offset
+    // Timer Commands
+    uint32_t const CLK_ENABLE;      // MODULEMODE enable for CM_PER_TIMER5_CLKCTRL
+    uint32_t const CLKSEL_32KHZ;    // Select CLK_32KHZ as the functional clock
+    uint32_t const CLKSEL_M_OSC;    // Select the 24 MHz CLK_M_OSC as the functional clock
+    uint32_t const CLK_FREQ;        // Functional clock frequency in Hz
+    uint32_t const OVF_IT;          // Overflow interrupt bit
+    uint32_t const START_AUTO_RELOAD; // ST | AR, count and reload TCRR from TLDR on overflow
+    uint32_t const STOP;            // Stop counting
+} TimerConfig_t;
+
+static const TimerConfig_t Timer5 = {
+    .BASE = 0x48046000,
+    .CLKSEL = 0x44E00518,
+    .IRQ_EOI = 0x20,
+    .IRQSTATUS = 0x28,
+    .IRQENABLE_SET = 0x2C,
+    .IRQENABLE_CLR = 0x30,
+    .TCLR = 0x38,
+    .TCRR = 0x3C,
+    .TLDR = 0x40,
+    // Commands
+    .CLK_ENABLE = 0x2,
+    .CLKSEL_32KHZ = 0x2,
+    .CLKSEL_M_OSC = 0x1,
+    .CLK_FREQ = 32768,
+    .OVF_IT = 0x2,
+    .START_AUTO_RELOAD = 0x3,
+    .STOP = 0x0
+};
+
+//DMTimer4, free running from CLK_M_OSC with TLDR = 0 so it wraps every 179 s. Never gated
+static const TimerConfig_t Timer4 = {
+    .BASE = 0x48044000,
+    .CLKSEL = 0x44E00510,
+    .IRQ_EOI = 0x20,
+    .IRQSTATUS = 0x28,
+    .IRQENABLE_SET = 0x2C,
+    .IRQENABLE_CLR = 0x30,
+    .TCLR = 0x38,
+    .TCRR = 0x3C,
+    .TLDR = 0x40,
+    // Commands
+    .CLK_ENABLE = 0x2,
+    .CLKSEL_32KHZ = 0x2,
+    .CLKSEL_M_OSC = 0x1,
+    .CLK_FREQ = 24000000,
+    .OVF_IT = 0x2,
+    .START_AUTO_RELOAD = 0x3,
+    .STOP = 0x0
+};
+
+#define GPIO1_PINS 32
+#define GPIO1_BUTTON_PIN 3          // push button, bit of GPIO1.GPIO1_3_SIGNAL
+#define GPIO_EVENT_QUEUE_LEN 32     // edges the queue holds, must be a power of two
+
+//Edges gpio1_watch() captures on a pin
+typedef enum {
+    GPIO_EDGE_NONE = 0x0,           // pin not watched
+    GPIO_EDGE_RISING = 0x1,
+    GPIO_EDGE_FALLING = 0x2,
+    GPIO_EDGE_BOTH = 0x3
+} gpio_edge_t;
+
+//One captured edge
+typedef struct {
+    uint32_t time;                  // Timer4 count when the GPIO1 ISR ran, Timer4.CLK_FREQ ticks
+    uint8_t pin;                    // GPIO1 bit number
+    uint8_t level;                  // pin level after the edge, 1 for a rising edge
+} gpio_event_t;
+
+//Runs in the GPIO1 ISR before the edge is queued
+typedef void (*gpio_edge_handler_t)(const gpio_event_t *event);
+
+extern volatile uint32_t gpio1_events_dropped;  // edges lost to a full queue
 
 //Function Prototypes
 
@@ -103,7 +497,7 @@ extern const I2CConfig_t I2C1;
 void setup_stacks(int stack_size);
 
 /*
- * Initializes i2c bus with a 400 KHz internal clock:
+ * Initializes i2c bus at I2C1.FS_MD_FREQUENCE (I2C1_BUS_KHZ, 400 KHz by default):
  * 
  * Beagle Bone -> Bus Master
  * PCA Controller-> Slave 
@@ -111,13 +505,110 @@ void setup_stacks(int stack_size);
 void I2C_init(void);
 
 /*
- * This function performs a soft reset of the I2C1 Module
+ * Same, at any SCL rate up to 1000 KHz (Fast-mode Plus, the PCA9685 supports it).
+ * Returns I2C_ERR_BAD_SPEED and leaves the module disabled if no timing fits.
+ */
+int I2C_init_speed(uint32_t bus_khz);
+
+/*
+ * Works out PSC, SCLL and SCLH for bus_khz from a functional clock of fclk_khz.
+ * PSC brings ICLK to the rate the AM335x TRM suggests for the mode, the SCL period is split
+ * between low and high in the ratio of the I2C spec minimums, tLOW = (SCLL + 7) and
+ * tHIGH = (SCLH + 5) ICLK cycles, and both must meet those minimums and fit 8 bits.
+ * Returns I2C_OK or I2C_ERR_BAD_SPEED. Pure arithmetic, no register access.
+ */
+int I2C_plan_timing(uint32_t fclk_khz, uint32_t bus_khz, i2c_timing_t *timing);
+
+/*
+ * Polls IRQSTATUS_RAW until any bit in flags is set. Returns I2C_OK, or an error code
+ * as soon as NACK or arbitration lost shows up, or I2C_ERR_TIMEOUT after I2C1.POLL_TIMEOUT reads.
+ */
+int I2C_wait(uint32_t flags);
+
+/*
+ * Sends len bytes to a 7 bit slave address as one START/address/data.../STOP frame.
+ * Waits for a free bus, feeds the FIFO on XRDY and returns once ARDY signals completion.
+ * On NACK a STOP is issued so the bus is released. Returns an i2c_status_t code.
+ */
+int I2C_write(uint8_t address, const uint8_t *data, uint32_t len);
+
+/*
+ * I2C_write() with the bus tiers of the recovery ladder, see i2c_recovery_stats_t. Worst case
+ * is I2C_RETRY_MAX + 3 attempts, one bus clear and one soft reset. Returns the last attempt's code.
+ */
+int I2C_write_recover(uint8_t address, const uint8_t *data, uint32_t len);
+
+/*
+ * Combined transaction: wlen bytes to address without a STOP, then a repeated START and rlen bytes
+ * read into rdata before the STOP. wdata is normally the slave's register pointer. Polled, with no
+ * recovery ladder since a failed read changes nothing. With the transmit engine running the ring
+ * must be empty, otherwise I2C_ERR_BUS_BUSY comes back at once; frames queued during the transfer
+ * go out after its STOP. Returns an i2c_status_t code.
+ */
+int I2C_write_read(uint8_t address, const uint8_t *wdata, uint32_t wlen, uint8_t *rdata, uint32_t rlen);
+
+/*
+ * Frees SDA from a slave that is holding it low, e.g. after a reset in the middle of a read:
+ * up to I2C1.RECOVERY_PULSES SCL pulses through SYSTEST until SDA reads high, then a STOP.
+ * Takes at most about 100 us. Returns I2C_OK if SDA came free, I2C_ERR_BUS_BUSY otherwise.
+ */
+int I2C_bus_clear(void);
+
+/*
+ * Interrupt driven transmit engine. Frames are pushed into a single producer, single consumer
+ * ring by I2C_tx_enqueue() and drained by I2C1_irq_handler(): XRDY feeds the FIFO, ARDY retires
+ * the frame and starts the next one. Only one context may enqueue. I2C_write() must not be used
+ * while the engine is running. Failed frames are dropped and counted in i2c_tx_errors.
+ */
+void I2C_tx_engine_start(void);
+extern _Bool i2c_tx_running;
+static inline _Bool I2C_tx_engine_running(void){
+    return i2c_tx_running;
+}
+
+/*
+ * Same engine with the FIFO fed by EDMA3 instead of XRDY. Before each frame the ISR points the
+ * I2C1 TX channel's PaRAM set at the frame in the ring and sets the TX threshold to the frame
+ * length, so one DMA request moves the whole frame and the CPU never touches DATA. ARDY still
+ * retires the frame and starts the next one, it is the only I2C1 interrupt per frame.
+ * The EDMA reads the ring from RAM, it must not sit in a write-back cached region.
+ */
+void I2C_tx_engine_start_dma(void);
+
+/*
+ * Powers the EDMA3 channel controller and transfer controller 0, maps the I2C1 TX event to its
+ * own PaRAM set on queue 0 and fills in the parts of the set that stay the same for every frame.
+ */
+void EDMA_init(void);
+int I2C_tx_enqueue(uint8_t address, const uint8_t *data, uint32_t len);
+_Bool I2C_tx_idle(void);
+
+/*
+ * The engine climbs the same ladder. On NACK or AL its ISR only sends the STOP, keeps the frame
+ * at the head of the ring and stalls the engine. I2C_tx_service(), called from the idle loop,
+ * runs the frame's tier, waits for BB to clear and starts it again; once the bus tiers run out
+ * the frame is dropped. A frame gets twice its bus time plus I2C_TX_SLACK_US from its START, by
+ * Timer4. A slave holding SCL low raises no interrupt at all, so I2C_tx_service() stalls a frame
+ * still on the bus past that deadline itself and it climbs the same ladder.
+ * I2C_tx_stalled() tells the idle loop not to sleep on a stalled engine.
+ * I2C_tx_take_fault() returns 1 once after a drop so the motor layer can rebuild the boards
+ * from their shadows (tier 4).
+ */
+void I2C_tx_service(void);
+_Bool I2C_tx_stalled(void);
+_Bool I2C_tx_take_fault(void);
+void I2C1_irq_handler(void);
+
+/*
+ * This function performs a soft reset of the I2C1 Module. The SCL timing of the last
+ * I2C_init_speed() is programmed again and a running transmit engine gets its interrupt and
+ * DMA request enables back, queued frames stay queued.
  */
 void I2C_restart(void);
 
 /*
- * This function enables the clock and debounce for GPIO1, configures GPIO1
- * to detect falling edge interrupts, and sets the debounce time.
+ * This function enables the clock and debounce for GPIO1, sets the debounce time, starts the
+ * Timer4 timestamps, and watches GPIO1_3 (the push button) for debounced falling edges.
 */
 void gpio1_init(void);
 
@@ -129,16 +620,33 @@ void gpio1_enable_irq(void);
 void gpio1_disable_irq(void);
 
 /*
- * Initializes the irq signals need for this program, it unmasks the signals for 
- * timer5 and gpio1 modules
+ * Resets the interrupt controller and registers the handlers this program uses: timer5, i2c1
+ * and gpio1. Timer5 and I2C1 share a priority because the I2C transmit ring expects its
+ * producer (the step ISR) and consumer (the I2C1 ISR) not to preempt each other.
  */
 void IRQ_init(void);
 
 /*
- * IRQ signal handler, check interrupt source between gpio1 and timer5. Can be updated to
- * include additional interrupt signals.You must update the startup_ARMCA8 file (name is dependent on compiler used) 
- * to check these IRQ signals. 
- * Specifically, the irq vector table will need to be updated to include this function as shown below. 
+ * Installs handler for INTC line irq with priority 0 (highest) .. 0x3F, routed to IRQ, and
+ * unmasks the line. Returns 0, or -1 for an out of range line or priority.
+ * irq_unregister() masks the line again and removes the handler.
+ */
+int irq_register(uint32_t irq, irq_handler_t handler, uint8_t priority);
+void irq_unregister(uint32_t irq);
+
+/*
+ * Only lines with a priority numerically below the threshold reach the CPU,
+ * INTC_MAX_PRIORITY + 1 or more turns the threshold off.
+ */
+void irq_set_threshold(uint8_t priority);
+
+/*
+ * IRQ entry, reads the active line from INTC SIR_IRQ and calls its registered handler, so
+ * the cost is the same for every source. Built with -DIRQ_NESTING the handler runs with IRQs
+ * enabled in SVC mode and the threshold raised to its own priority, so only higher priority
+ * lines preempt it.
+ * You must update the startup_ARMCA8 file (name is dependent on compiler used) so the irq
+ * vector jumps here, as shown below.
  * -> __isr_vector:
         LDR   pc, [pc,#24]       @ 0x00 Reset
         LDR   pc, [pc,#-8]       @ 0x04 Undefined Instruction
@@ -152,18 +660,42 @@ void IRQ_init(void);
  */
 void irq_director(void);
 
+/*
+ * GPIO1 bank A handler. Takes the Timer4 count once, then for every pin that saw an edge calls the
+ * pin's handler and pushes a gpio_event_t into the single producer, single consumer event queue.
+ * A press on GPIO1_3 queues the move bound by motor_bind_button()
+ */
+void gpio1_irq_handler(void);
+
+/*
+ * Watches a GPIO1 input for the given edges, GPIO_EDGE_NONE stops watching it. debounce turns on
+ * the bank's debounce for the pin, which delays the edge by the debounce time set in gpio1_init().
+ * handler may be NULL if the edges only need to be queued. Returns 0, or -1 for a bad pin.
+ */
+int gpio1_watch(uint8_t pin, gpio_edge_t edges, _Bool debounce, gpio_edge_handler_t handler);
+
+/*
+ * Takes the oldest edge from the queue, returns 0 if it is empty. One consumer only.
+ */
+_Bool gpio1_event_pop(gpio_event_t *event);
+
+/*
+ * Starts Timer4 counting from CLK_M_OSC, free running, as the edge timestamp clock.
+ * timer4_count() reads it, differences of two counts are right across the wrap.
+ */
+void timer4_init(void);
+uint32_t timer4_count(void);
+
 /**
- * Initializes Timer5 for one-shot operations. Configures Timer5 to operate with a 32KHz internal clock. The timer is set up
- * to generate an interrupt on overflow, which is used as a signal to delay each motor command. 
+ * Initializes Timer5 as the step clock. Configures Timer5 to operate with a 32KHz internal clock. The timer is set up
+ * in auto-reload mode to generate an interrupt on every overflow, each overflow is one motor step.
  */
 void timer5_init(void);
 
 /*
- * Starts Timer5 counting for a single operation - one shot interrupt timer. Each start loads the 
- * desired clock time using the below formula. In this program a long and short timer is used for 
- * sending motor step, and I2C commands. 
- * 
- * The Timer Load Register (TCRR) is calculated based on the desired time delay
+ * Converts a step rate into Timer5 ticks, and ticks into the value loaded into TCRR/TLDR.
+ *
+ * The Timer Load Register (TLDR) is calculated based on the desired time delay
  * using the following formula from the Sitara manual (page 4447):
  *
  * TLDR = 0xFFFFFFFF - ((DesiredTime * TimerClockFrequency) / ClockDivider) + 1
@@ -171,11 +703,45 @@ void timer5_init(void);
  * Where:
  * - TimerClockFrequency = 32,768 Hz (32KHz internal clock)
  * - ClockDivider is set to 1 by default
- * - DesiredTime is the time in seconds after which the timer interrupt should occur
+ * - DesiredTime is the time in seconds after which the timer interrupt should occur, 1 / step rate
+ */
+uint32_t timer5_rate_to_ticks(uint32_t steps_per_sec);
+uint32_t timer5_load_value(uint32_t ticks);
+
+/*
+ * Starts Timer5 counting, the first overflow comes after first_ticks. Every later period is
+ * taken from TLDR, which is reloaded into TCRR in hardware on overflow, so the step timing does
+ * not depend on interrupt latency. timer5_set_period() changes TLDR, the new period takes effect
+ * from the overflow after the one currently counting.
+ */
+void timer5_start(uint32_t first_ticks, uint32_t reload_ticks);
+void timer5_set_period(uint32_t ticks);
+void timer5_stop(void);
+
+/*
+ * Timer5 overflow handler, acknowledges the interrupt and runs the motor step generator
  */
-void timer5_start(void);
+void timer5_irq_handler(void);
+
+/*
+ * Clock gating between moves. per_clocks_gate() sets MODULEMODE to disabled for I2C1 and Timer5
+ * once the transmit engine is empty and SCL/SDA are released, and returns 0 without gating while
+ * a frame is still on the bus. The caller makes sure no move is pending and holds IRQs masked.
+ * per_clocks_ungate() turns both back on and waits for IDLEST to read functional. timer5_start(),
+ * I2C_write() and a kick of the idle transmit engine call it, so no path reaches a gated module.
+ */
+int per_clocks_gate(void);
+void per_clocks_ungate(void);
+_Bool per_clocks_gated(void);
 
 //unmasks CPSR IRQ Bit
 void clear_interrupt_mask_bit(void);
 
+/*
+ * Critical section around state shared with ISRs. irq_save() masks IRQs and returns the previous
+ * CPSR I bit, irq_restore() puts it back, so the pair nests and is safe inside a handler.
+ */
+uint32_t irq_save(void);
+void irq_restore(uint32_t state);
+
 #endif
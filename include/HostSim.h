@@ -0,0 +1,97 @@
+/*
+ * Host simulator for off-target builds, compile every source file with -DHWREG_SIM.
+ *
+ * HWREG_READ/HWREG_WRITE land here instead of dereferencing AM335x addresses. The model covers
+ * the peripherals this project drives: I2C1 (FIFO, status bits, bus timing from PSC/SCLL/SCLH,
+ * the TX DMA request, SYSTEST pin control, soft reset), EDMA3 channels 0..31 with PaRAM sets,
+ * linking and completion codes, GPIO1 edge detection, the INTC masks and priorities, DMTimer5,
+ * DMTimer4 as a free running count, the CM_PER module clocks of I2C1, Timer5 and Timer4
+ * (accesses while gated are counted and dropped),
+ * bus fault injection, and any number of PCA9685 slaves on the I2C1 bus
+ * with register state, auto-increment, address matching and outputs.
+ *
+ * Time is simulated. Register accesses, delay() cycles and idle waits advance it, and bus bytes
+ * and timer overflows complete when it reaches them. Pending, unmasked interrupts call
+ * irq_director() just as the IRQ vector would on the board.
+ */
+#ifndef HOST_SIM_H_
+#define HOST_SIM_H_
+
+#include <stdint.h>
+
+#define HWSIM_PCA_MAX 8
+
+// One PCA9685 on the bus
+typedef struct {
+    uint8_t address;            // 7 bit hardware address (A5..A0 pins)
+    uint8_t regs[256];          // register file
+    uint16_t outputs[16];       // visible channel levels, 0 = off .. 4096 = fully on
+    uint8_t pointer;            // register pointer
+    uint32_t output_updates;    // times the visible outputs changed
+} hwsim_pca_t;
+
+// Counters since hwsim_reset()
+typedef struct {
+    uint32_t frames;            // START conditions
+    uint32_t bytes;             // bytes clocked on the bus, address bytes included
+    uint32_t nacks;
+    uint64_t bus_busy_ns;       // time SCL was clocking
+    uint64_t delay_cycles;      // delay() loop iterations
+    uint32_t irqs;              // irq_director() entries
+    uint32_t irq_depth_max;     // deepest IRQ nesting seen
+    uint32_t timer_overflows;   // DMTimer5 overflows
+    uint64_t last_overflow_ns;  // time of the latest one
+    uint32_t dma_events;        // EDMA transfer requests served
+    uint32_t dma_bytes;         // bytes the EDMA moved
+    uint64_t sleep_ns;          // time the CPU spent in CPU_WAIT()
+    uint64_t clock_gated_ns;    // time the I2C1 and Timer5 module clocks were both off
+    uint32_t gated_accesses;    // register accesses to a module with its clock off, a fault on the board
+} hwsim_stats_t;
+
+extern hwsim_stats_t hwsim_stats;
+
+// Register access backend for HWREG_READ / HWREG_WRITE
+uint32_t hwreg_read(uint32_t addr);
+void hwreg_write(uint32_t addr, uint32_t value);
+
+// CPU model, CPU_NOP() / CPU_WAIT() and the CPSR I bit
+void hwsim_nop(void);
+void hwsim_idle(void);
+void hwsim_cpu_irq_enable(void);
+void hwsim_cpu_irq_disable(void);
+int hwsim_cpu_irq_masked(void);
+
+// 32 bit EDMA address for host memory, backs DMA_ADDR(). Each region is a 4 KB window from the
+// first pointer seen in it, the EDMA model reads through the window
+uint32_t hwsim_dma_addr(const void *ptr);
+
+// Harness control
+void hwsim_reset(void);
+hwsim_pca_t *hwsim_add_pca(uint8_t address);
+hwsim_pca_t *hwsim_pca(int index);
+void hwsim_pca_power_cycle(hwsim_pca_t *pca);   // brown-out, back to the power-on registers
+void hwsim_advance_ns(uint64_t ns);
+uint64_t hwsim_time_ns(void);
+
+// SCL rate the driver programmed, or the forced rate if one is set (0 clears it)
+uint32_t hwsim_bus_khz(void);
+void hwsim_force_bus_khz(uint32_t khz);
+
+// Fault injection. The next frames get no ACK, as if a glitch hit the address byte. A slave
+// holds SDA low until it has seen the given number of SCL pulses, every START loses arbitration.
+// A slave holds SCL low from the address byte of each of the next frames, the frame never ends,
+// BB stays up and every START is lost until a SYSC soft reset
+void hwsim_i2c_nack_frames(uint32_t frames);
+void hwsim_i2c_hold_sda(uint32_t pulses);
+void hwsim_i2c_hold_scl(uint32_t frames);
+
+// Drives GPIO1 input pins, edges raise the detection status the driver enabled
+void hwsim_gpio1_set_input(uint32_t pin_mask, int level);
+
+// Visible AIN1/AIN2/BIN1/BIN2 levels of the MOTOR_PORT port, bits as in the README truth table
+uint8_t hwsim_coil_pattern(const hwsim_pca_t *pca);
+
+// Called every time a PCA9685's visible outputs change
+void hwsim_set_output_hook(void (*hook)(const hwsim_pca_t *pca));
+
+#endif
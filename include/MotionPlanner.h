@@ -0,0 +1,46 @@
+/*
+ * Motion planner for the stepper motor. Turns (max velocity, acceleration, jerk) into a table of
+ * per-step intervals in Timer5 ticks. All ramp math is integer fixed point and runs once when the
+ * profile is built, the step ISR only indexes the table.
+ */
+#ifndef MOTION_PLANNER_H_
+#define MOTION_PLANNER_H_
+
+#include <stdint.h>
+
+#define PLANNER_RAMP_MAX 256   // longest acceleration ramp in steps
+
+// Precomputed acceleration ramp, deceleration replays it backwards
+typedef struct {
+    uint16_t ramp[PLANNER_RAMP_MAX]; // Timer5 ticks before each accelerating step, ramp[0] starts from rest
+    uint16_t ramp_len;               // entries in use
+    uint16_t cruise;                 // Timer5 ticks per step at max velocity
+} motion_profile_t;
+
+// Per move view of a profile, fixes how much of the ramp fits into the move
+typedef struct {
+    const motion_profile_t *profile;
+    uint32_t steps;
+    uint32_t ramp;      // accelerating steps, the same number decelerate
+    uint32_t peak;      // ticks per step between the ramps
+} motion_move_t;
+
+/*
+ * Builds the ramp for a move limited by max_velocity (steps/s), accel (steps/s^2) and
+ * jerk (steps/s^3). jerk = 0 gives a trapezoidal profile, otherwise the acceleration
+ * ramps up and back down (S-curve). Returns 0, or -1 for a zero velocity or acceleration.
+ */
+int planner_build_profile(motion_profile_t *profile, uint32_t max_velocity, uint32_t accel, uint32_t jerk);
+
+// Profile without a ramp, every step at steps_per_sec
+void planner_constant_profile(motion_profile_t *profile, uint32_t steps_per_sec);
+
+void planner_begin_move(motion_move_t *move, const motion_profile_t *profile, uint32_t steps);
+
+// Ticks between step - 1 and step, step 0 is measured from the start of the move
+uint32_t planner_interval(const motion_move_t *move, uint32_t step);
+
+// Total move duration in Timer5 ticks
+uint32_t planner_move_ticks(const motion_profile_t *profile, uint32_t steps);
+
+#endif
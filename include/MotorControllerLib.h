@@ -1,6 +1,22 @@
 #ifndef MOTOR_CONTROLLER_H_
 #define MOTOR_CONTROLLER_H_
 
+#include "MotionPlanner.h"
+
+// Board wiring, chosen at build time, e.g. -DPCA_ADDRESS=0x60 -DMOTOR_PORT=MOTOR_PORT_M1M2.
+// A port is six channels from its PWMA: PWMA, AIN2, AIN1, BIN1, BIN2, PWMB
+#define MOTOR_PORT_M3M4 2       // LED2..LED7, the wiring in the README truth table
+#define MOTOR_PORT_M1M2 8       // LED8..LED13
+#ifndef PCA_ADDRESS
+#define PCA_ADDRESS 0x70        // ALLCALL, answered by any board that has not changed it
+#endif
+#ifndef MOTOR_PORT
+#define MOTOR_PORT MOTOR_PORT_M3M4
+#endif
+
+#define PCA_LED0_ON_L 0x06
+#define PCA_LED_ON_L(channel) (PCA_LED0_ON_L + (channel) * 4)
+#define PCA_CHANNEL(reg) (((reg) - PCA_LED0_ON_L) / 4)  // channel whose ON_L..OFF_H block holds reg
 
 // Defines PCA9685 (motor controller) configuration settings and register addresses
 typedef struct {
@@ -23,26 +39,128 @@ typedef struct {
     uint8_t const LED2_ON_H;
     uint8_t const LED7_ON_H;
 
+    // Coil enable channels, PWMA = LED2 and PWMB = LED7. LED2_ON_L starts the LED2..LED7 block
+    uint8_t const LED2_ON_L;
+    uint8_t const LED7_ON_L;
+
     // Mode registers
     uint8_t const MODE1_REG;
     uint8_t const MODE2_REG;
 
     // Initial values to configure modes
     uint8_t const MODE1_OSC_BIT_CLEAR;
+    uint8_t const MODE1_AUTO_INC;   // Register pointer auto-increments after each data byte
+    uint8_t const MODE1_SLEEP;      // Oscillator off, PRE_SCALE can only be written while set
+    uint8_t const MODE1_RESTART;    // Resumes PWM channels after sleep
+    uint8_t const MODE2_OUTDRV;     // Totem pole outputs, the power-on setting
+    uint8_t const MODE2_OCH;        // Outputs change on ACK instead of on STOP
+
+    // PWM clock, PRE_SCALE = round(OSC_CLK / (4096 * rate)) - 1
+    uint8_t const OSC_CLK_MHZ;
+    uint8_t const PWM_RATE_KHZ;
     uint8_t const DISABLE_PWM;
 
-    // Step sequence values (AIN1, AIN2, BIN1, BIN2)
-    uint8_t const STEP1;    //0101'b
-    uint8_t const STEP2;    //1001'b
-    uint8_t const STEP3;    //1010'b
-    uint8_t const STEP4;    //0110'b
+    // First register of the contiguous H-bridge input block (LED3_ON_L..LED6_OFF_H)
+    uint8_t const LED3_ON_L;
 
     // PWM output control
     uint8_t const PWM_OUTPUT_ENABLE;
     uint8_t const PWM_OUTPUT_DISABLE;
 } PCAConfig_t;
 
-extern const PCAConfig_t PCA_Controller;
+// Register map of the MOTOR_PORT wiring. The LEDn names are the M3/M4 channels
+static const PCAConfig_t PCA_Controller = {
+    .ADDRESS = PCA_ADDRESS, // Adjusted for 7-bit addressing
+    .PRE_SCALE = 0xFE,
+    .ALL_LED_OFF_H = 0xFD,
+    .RESET = 0x06,
+    //Motor H-Bridge Signal Line Addresses
+    .AIN1_ON = PCA_LED_ON_L(MOTOR_PORT + 2) + 1,
+    .AIN1_OFF = PCA_LED_ON_L(MOTOR_PORT + 2) + 3,
+    .AIN2_ON = PCA_LED_ON_L(MOTOR_PORT + 1) + 1,
+    .AIN2_OFF = PCA_LED_ON_L(MOTOR_PORT + 1) + 3,
+    .BIN1_ON = PCA_LED_ON_L(MOTOR_PORT + 3) + 1,
+    .BIN1_OFF = PCA_LED_ON_L(MOTOR_PORT + 3) + 3,
+    .BIN2_ON = PCA_LED_ON_L(MOTOR_PORT + 4) + 1,
+    .BIN2_OFF = PCA_LED_ON_L(MOTOR_PORT + 4) + 3,
+    //LED2 and LED7 need to be turned on for H-Bridge to be enabled
+    .LED2_ON_H = PCA_LED_ON_L(MOTOR_PORT) + 1,
+    .LED7_ON_H = PCA_LED_ON_L(MOTOR_PORT + 5) + 1,
+    .LED2_ON_L = PCA_LED_ON_L(MOTOR_PORT),
+    .LED7_ON_L = PCA_LED_ON_L(MOTOR_PORT + 5),
+    //Mode control regs
+    .MODE1_REG = 0x00,
+    .MODE2_REG = 0x01,
+    //Internal Oscillator, turns on
+    .MODE1_OSC_BIT_CLEAR = 0x01,
+    //Auto-increment bit, lets one frame write the whole H-bridge block
+    .MODE1_AUTO_INC = 0x20,
+    .MODE1_SLEEP = 0x10,
+    .MODE1_RESTART = 0x80,
+    .MODE2_OUTDRV = 0x04,
+    .MODE2_OCH = 0x08,
+    //25 MHz internal oscillator, 1 KHz PWM for the coil enables
+    .OSC_CLK_MHZ = 25,
+    .PWM_RATE_KHZ = 1,
+    //Turn off PWM functionality
+    .DISABLE_PWM = 0x10,
+    //LED3_ON_L, start of the AIN2/AIN1/BIN1/BIN2 register block
+    .LED3_ON_L = PCA_LED_ON_L(MOTOR_PORT + 1),
+    //Turns on signal line
+    .PWM_OUTPUT_ENABLE = 0x10,
+    //Turns off signal line
+    .PWM_OUTPUT_DISABLE = 0x00
+};
+
+#define PCA_MOTOR_BLOCK_LEN 16  // LED3..LED6, four registers per channel
+#define PCA_COIL_BLOCK_LEN 24  // LED2..LED7, enables and H-bridge inputs of both coils
+#define PCA_PWM_FULL 4096       // duty value for a fully on channel
+#define PCA_REG_COUNT 256       // size of the shadow register file
+#define PCA_BURST_MAX 31        // data bytes per frame, register byte fills the 32 byte TX FIFO
+#define PCA_MERGE_GAP 2         // clean registers a burst resends rather than open a new frame
+
+// Bus usage counters, every frame counts its slave address byte
+typedef struct {
+    uint32_t transactions;
+    uint32_t bytes;
+} pca_bus_stats_t;
+
+extern pca_bus_stats_t pca_stats;
+
+// Read-back results, see pca_dev_verify()
+typedef struct {
+    uint32_t checks;        // boards read back and compared
+    uint32_t mismatches;    // registers that differed from their shadow
+    uint8_t last_reg;       // latest register that differed
+} pca_verify_stats_t;
+
+extern pca_verify_stats_t pca_verify_stats;
+
+#define PCA_DEVICES_MAX 8       // boards pca_reset() keeps shadows for
+
+// One PCA9685 on I2C1 with its own shadow, a register is only trusted once its valid bit is set
+typedef struct {
+    uint8_t address;                            // 7 bit slave address
+    uint8_t shadow[PCA_REG_COUNT];
+    uint8_t shadow_valid[PCA_REG_COUNT / 8];
+    _Bool auto_inc;                             // MODE1 AI as last written, kept when the shadow is invalidated
+} pca_dev_t;
+
+// Boards answering one ALLCALL or SUBADR address, a write to it reaches all of them in one frame
+typedef struct {
+    uint8_t address;                            // 7 bit group address
+    pca_dev_t *const *members;
+    uint8_t count;
+} pca_group_t;
+
+// The board the motor functions and the pca_* calls without a device drive
+extern pca_dev_t pca_default;
+
+// Prebuilt bus frame: register byte followed by the values for the H-bridge block
+typedef struct {
+    uint8_t len;                            // bytes used, register byte included
+    uint8_t data[PCA_MOTOR_BLOCK_LEN + 1];
+} pca_frame_t;
 
 typedef enum inputs{
     BIN2,
@@ -51,19 +169,195 @@ typedef enum inputs{
     AIN1
 } inputs_t;
 
+// Step sequence tables for the step generator, see motor_set_drive_mode()
+typedef enum {
+    DRIVE_WAVE,     // one coil at a time
+    DRIVE_FULL,     // two-phase full step, STEP1..STEP4
+    DRIVE_HALF      // eight-state half step
+} drive_mode_t;
+
+typedef enum {
+    MOTOR_FORWARD,  // STEP1 -> STEP2 -> STEP3 -> STEP4
+    MOTOR_REVERSE
+} motor_dir_t;
+
+#define MOTOR_AXES 2            // steppers one PCA9685 can drive
+
+// One queued move, see motor_queue_move(). Axis 1 only moves in multi-axis mode
+typedef struct {
+    uint32_t steps;                     // step timer ticks, the largest axis count
+    const motion_profile_t *profile;
+    uint32_t axis_steps[MOTOR_AXES];
+    motor_dir_t direction[MOTOR_AXES];
+} motion_cmd_t;
+
+// PCA9685 channel numbers of one stepper port, see motor_multiaxis_init()
+typedef struct {
+    uint8_t const PWMA;
+    uint8_t const AIN2;
+    uint8_t const AIN1;
+    uint8_t const BIN1;
+    uint8_t const BIN2;
+    uint8_t const PWMB;
+} motor_channels_t;
+
+#define MOTOR_CHANNELS(pwma) {(pwma), (pwma) + 1, (pwma) + 2, (pwma) + 3, (pwma) + 4, (pwma) + 5}
+
+extern const motor_channels_t MotorPortM3M4;
+extern const motor_channels_t MotorPortM1M2;
+
+#define MOTION_QUEUE_LEN 8      // power of two
+#define MOVE_STREAM_LEN 256     // compiled steps a stream holds, power of two
+
+// One compiled step: the frame goes out on a Timer5 overflow, then reload is queued in TLDR
+typedef struct {
+    uint32_t reload;
+    pca_frame_t frame;
+} move_step_t;
+
+// A move compiled into ready frames, see motor_compile_move(). The compiler fills steps[] ahead
+// of the Timer5 ISR, which only sends them
+typedef struct {
+    move_step_t steps[MOVE_STREAM_LEN];
+    volatile uint32_t head;             // steps compiled
+    volatile uint32_t tail;             // steps sent
+    uint32_t total;
+    motion_move_t move;
+    motor_dir_t direction;
+    const void *table;                  // drive table the frames belong to
+    uint8_t start_phase;
+    uint8_t end_phase;
+    uint8_t phase;                      // phase after the last compiled step
+} move_stream_t;
+
+extern volatile uint32_t motor_stream_underruns; // overflows that found no compiled step
+
+extern volatile uint32_t motor_step_misses;     // step writes the ring refused, retried on the next overflow
+
+extern volatile uint32_t motion_queue_dropped;  // moves refused because the queue was full
+
+extern volatile uint32_t motor_limit_stops;     // moves a limit switch cut short
+
 //TODO: Make a struct to hold PCA values??? Future implementation
 //FIXME: tomorrow finish fixing these functions then you are ready to submit. 
 
 uint8_t calc_prescale(int osc_clk_mhz, int update_rate_khz);
+int pca_set_prescale(uint8_t prescale);
+
+// Bus functions return an i2c_status_t code (I2C_OK on success), see BeagleBoneMaster.h
+int motor_init(void);
+
+int pca_write_burst(uint8_t start_reg, const uint8_t *data, uint8_t len);
+int pca_write_byte_cached(uint8_t ctrl_reg, uint8_t value);
+int pca_write_block(uint8_t start_reg, const uint8_t *block, uint8_t len);
+int pca_write_sparse(uint8_t start_reg, const uint8_t *block, uint8_t len);
+int pca_write_frame(const pca_frame_t *frame);
+void pca_shadow_invalidate(void);
+
+// Per board versions of the calls above, pca_dev_init() registers the board's shadow with pca_reset().
+// A board starts without MODE1 auto-increment, its bursts and blocks then go out one register per
+// frame until pca_dev_start() or pca_group_sync_start() has turned AI on
+int pca_dev_init(pca_dev_t *dev, uint8_t address);
+int pca_dev_start(pca_dev_t *dev);
+int pca_dev_write_byte(pca_dev_t *dev, uint8_t ctrl_reg, uint8_t value);
+int pca_dev_write_burst(pca_dev_t *dev, uint8_t start_reg, const uint8_t *data, uint8_t len);
+int pca_dev_write_byte_cached(pca_dev_t *dev, uint8_t ctrl_reg, uint8_t value);
+int pca_dev_write_block(pca_dev_t *dev, uint8_t start_reg, const uint8_t *block, uint8_t len);
+void pca_dev_shadow_invalidate(pca_dev_t *dev);
 
-void motor_init(void);
+// Single register write to pca_default, inline so callers go straight to pca_dev_write_byte()
+static inline int pca_write_byte(uint8_t ctrl_reg, uint8_t value){
+    return pca_dev_write_byte(&pca_default, ctrl_reg, value);
+}
 
-void pca_write_byte(volatile uint8_t ctrl_reg, volatile uint8_t value);
+// Read back. A board only answers reads on its own address, ALLCALL and SUBADR are write only, so
+// pca_default needs -DPCA_ADDRESS set to its board's address. pca_dev_verify() reads MODE1..LED15
+// and PRE_SCALE in two combined frames and returns how many registers differ from the shadow,
+// registers the shadow doesn't know are skipped. Reads never change the shadow
+int pca_dev_read_block(pca_dev_t *dev, uint8_t start_reg, uint8_t *buf, uint8_t len);
+int pca_dev_verify(pca_dev_t *dev);
+int pca_verify(void);
 
-void full_step_motor(int step);
-void pca_write_motor_pins(uint8_t stepnum);
-void pca_set_motor_pin_state(uint8_t on_register, uint8_t off_register, _Bool state);
+// Broadcast writes, one frame updates the same registers on every member whatever the board
+// count. pca_group_init() programs the group address into slot 0 (ALLCALLADR) or 1..3 (SUBADRn).
+// pca_group_sync_start() wakes the members with AI on, a block reaches them one register per
+// frame before that
+int pca_group_init(const pca_group_t *group, uint8_t slot);
+int pca_group_write_byte(const pca_group_t *group, uint8_t ctrl_reg, uint8_t value);
+int pca_group_write_block(const pca_group_t *group, uint8_t start_reg, const uint8_t *block, uint8_t len);
+int pca_group_sync_start(const pca_group_t *group);
+
+int full_step_motor(int step);
+int pca_write_motor_pins(uint8_t stepnum);
+int pca_set_motor_pin_state(uint8_t on_register, uint8_t off_register, _Bool state);
+
+// Atomic coil updates, on after motor_init(). MODE2 OCH is cleared so a frame's registers only
+// reach the outputs at its STOP, every coil write is a single frame, and multi-axis ticks merge
+// both ports into one burst. Off sets OCH, outputs then follow each acknowledged register
+int motor_set_atomic(_Bool on);
 void delay(unsigned int counts);
-void pca_reset(void);
+
+// Microstepping: one electrical cycle is 64 positions, 16 per full step. The coil currents
+// follow cos/sin from a 12 bit table and are written as PWM duty on LED2/LED7 in one burst
+#define MICROSTEP_MAX 16
+int pca_write_microstep(uint8_t position);
+int motor_set_microstep(uint8_t resolution);
+int motor_set_drive_mode(drive_mode_t mode);
+
+// Timer5 driven step generator, the pattern writes are queued from the timer ISR.
+// Step intervals come from a motion_profile_t built by MotionPlanner.h
+int motor_start_move(uint32_t steps, motor_dir_t direction, const motion_profile_t *profile);
+_Bool motor_busy(void);
+void motor_step_tick(void);
+
+// Move queue, callable from main or any ISR. A move queued while another runs starts on the
+// overflow after the last step of the one before it, the timer never stops in between.
+// Returns I2C_ERR_QUEUE_FULL when MOTION_QUEUE_LEN moves are already waiting
+int motor_queue_move(uint32_t steps, motor_dir_t direction, const motion_profile_t *profile);
+uint32_t motor_queue_depth(void);
+
+// Move streams, table drive modes only. motor_compile_move() plans the move and compiles its
+// first MOVE_STREAM_LEN steps. A move that fits is kept whole, motor_start_stream() can then run
+// it again without compiling as long as the coils are back where it started. Longer moves are
+// compiled in chunks by motor_stream_fill() from the foreground while they run
+int motor_compile_move(move_stream_t *stream, uint32_t steps, motor_dir_t direction, const motion_profile_t *profile);
+uint32_t motor_stream_fill(move_stream_t *stream);
+int motor_start_stream(move_stream_t *stream);
+
+// Multi-axis mode: two steppers on their own channel maps, stepped with the current drive table.
+// A move gives signed steps per axis, Bresenham interpolation makes both arrive on the same tick
+// and each tick's changed registers go out through pca_write_sparse(). motor_set_drive_mode()
+// or motor_set_microstep() return to single axis mode
+int motor_multiaxis_init(const motor_channels_t *axis0, const motor_channels_t *axis1);
+int motor_queue_move_xy(int32_t steps0, int32_t steps1, const motion_profile_t *profile);
+
+// Stops the step generator where it is and drops every queued move, the coils stay on the last
+// step sent. Callable from any ISR. Returns the steps that were not taken
+uint32_t motor_stop(void);
+
+// A limit switch on a GPIO1 pin, undebounced. The watched edge calls motor_stop() from the GPIO1
+// ISR, so no step is queued after it. Moves queued later run as usual, the edge is in the GPIO event queue
+int motor_bind_limit(uint8_t pin, gpio_edge_t edge);
+
+// The move each push button press queues, motor_button_pressed() runs from the GPIO1 ISR
+void motor_bind_button(uint32_t steps, motor_dir_t direction, const motion_profile_t *profile);
+void motor_button_pressed(void);
+int pca_reset(void);
+
+// Last tier of the bus recovery ladder, writes every board's shadow back to it (motor_init() for a
+// default board that has none). Polled writes call it when the bus tiers fail, the step ISR after
+// the transmit engine drops a frame, motor_idle() between moves. Counted in i2c_recovery.reinits
+int motor_recover(void);
+
+// Reads every registered board back between moves and rebuilds them all with motor_recover() if
+// any register differs. Returns the registers that differed, or I2C_ERR_BUS_BUSY during a move
+int motor_verify(void);
+
+// One pass of the foreground idle loop. Rebuilds the boards after a dropped frame, otherwise gates
+// the I2C1 and Timer5 clocks when no move is pending, then sleeps until the next interrupt
+void motor_idle(void);
+
+// Bus time in microseconds for the recorded traffic: 9 SCL clocks per byte plus START/STOP
+uint32_t pca_bus_time_us(const pca_bus_stats_t *stats, uint32_t bus_khz);
 
 #endif
@@ -0,0 +1,73 @@
+/*
+ * Hot path profiler on the Cortex-A8 PMU cycle counter (CCNT). Each probe keeps min/max/mean
+ * and a log2 histogram of its cycle counts in RAM. Build with -DPROFILER to turn it on,
+ * otherwise every PROF_* macro compiles to nothing. Under HWREG_SIM the cycle counter is the
+ * simulator clock, counted as a 1 GHz MPU.
+ */
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+#include <stdint.h>
+
+#define PROF_BUCKETS 32     // bucket n counts samples in [2^(n-1), 2^n), bucket 0 counts zeros
+
+typedef enum {
+    PROF_PCA_WRITE_BYTE,    // pca_write_byte() call
+    PROF_MOTOR_PINS,        // pca_write_motor_pins() call
+    PROF_IRQ,               // irq_director() entry to exit
+    PROF_EDGE_TO_STEP,      // push button IRQ to the first coil write of a move started from idle
+    PROF_STEP_TICK,         // motor_step_tick() call, queued moves and streams
+    PROF_PROBES
+} prof_probe_t;
+
+typedef struct {
+    uint32_t start;         // CCNT at prof_arm(), for probes that end in another context
+    _Bool armed;            // prof_arm() seen, prof_end_armed() not yet
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;         // mean = total / count
+    uint32_t hist[PROF_BUCKETS];
+} prof_stats_t;
+
+// Probe table, readable from a debugger as is
+extern prof_stats_t prof_stats[PROF_PROBES];
+
+// Receives one line of text at a time, e.g. a UART puts
+typedef void (*prof_out_t)(const char *line);
+
+// PROF_BEGIN() declares a local holding the start count and PROF_END() records from it, so a
+// probe entered again from an ISR or a nested IRQ times its own interval. PROF_ARM() and
+// PROF_END_ARMED() keep the start in the probe, for an interval that ends in another context
+#ifdef PROFILER
+#define PROF_INIT()                 profiler_init()
+#define PROF_BEGIN(start)           uint32_t start = prof_cycles()
+#define PROF_END(probe, start)      prof_end(probe, start)
+#define PROF_ARM(probe)             prof_arm(probe)
+#define PROF_END_ARMED(probe)       prof_end_armed(probe)
+#else
+#define PROF_INIT()                 ((void)0)
+#define PROF_BEGIN(start)           ((void)0)
+#define PROF_END(probe, start)      ((void)0)
+#define PROF_ARM(probe)             ((void)0)
+#define PROF_END_ARMED(probe)       ((void)0)
+#endif
+
+// Enables the PMU and CCNT and clears every probe
+void profiler_init(void);
+void profiler_reset(void);
+// Enables and resets CCNT alone, for users of prof_cycles() that keep no probes
+void prof_counter_start(void);
+uint32_t prof_cycles(void);
+
+// prof_end() records the cycles since start. An armed probe measures one interval at a time,
+// prof_end_armed() without prof_arm() is ignored
+void prof_end(prof_probe_t probe, uint32_t start);
+void prof_arm(prof_probe_t probe);
+void prof_end_armed(prof_probe_t probe);
+void prof_record(prof_probe_t probe, uint32_t cycles);
+
+// Writes one summary line per probe, followed by its non-empty histogram buckets
+void profiler_dump(prof_out_t out);
+
+#endif
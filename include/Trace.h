@@ -0,0 +1,59 @@
+/*
+ * Binary trace of the PCA frames the driver sends. Every frame pca_write_byte(), pca_reset() and
+ * the other pca_* writers hand to the bus adds one 8 byte entry per data byte to a ring in RAM,
+ * with the CCNT time the driver got the status back. Build with -DTRACE to turn it on, otherwise
+ * every TRACE_* macro compiles to nothing. The ring is lock-free: a frame reserves its entries
+ * with one atomic add on head, so the foreground and nested ISRs can record at the same time.
+ * bench/TraceReplay.c replays a capture of trace_ring against the PCA9685 model on the host.
+ */
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+#define TRACE_LEN 256               // entries in the ring, power of two
+#define TRACE_MAGIC 0x45435254      // "TRCE" little endian, finds the ring in a RAM dump
+#define TRACE_VERSION 1
+#define TRACE_CLOCK_KHZ 1000000     // CCNT of a 1 GHz MPU, the simulator clock under HWREG_SIM
+#define TRACE_CONT 0x80             // address bit 7, next data byte of the frame in the entry before
+
+// One data byte on the bus. A general call records its command byte in reg with value 0
+typedef struct {
+    uint32_t time;          // CCNT when the frame was sent or queued
+    uint8_t address;        // 7 bit slave address, TRACE_CONT set on every byte after the first
+    uint8_t reg;            // register the byte went to
+    uint8_t value;
+    int8_t status;          // i2c_status_t of the frame
+} trace_entry_t;
+
+// Layout a capture file has, little endian as the AM335x stores it
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_size;    // sizeof(trace_entry_t)
+    uint32_t len;           // TRACE_LEN
+    uint32_t clock_khz;     // rate of trace_entry_t.time
+    volatile uint32_t head; // entries ever reserved, the newest is at (head - 1) % len
+    trace_entry_t entries[TRACE_LEN];
+} trace_ring_t;
+
+// The ring, readable from a debugger as is, e.g. gdb: dump binary value trace.bin trace_ring
+extern trace_ring_t trace_ring;
+
+#ifdef TRACE
+#define TRACE_INIT()                                trace_init()
+#define TRACE_FRAME(address, frame, len, status)    trace_frame(address, frame, len, status)
+#else
+#define TRACE_INIT()                                ((void)0)
+#define TRACE_FRAME(address, frame, len, status)    ((void)0)
+#endif
+
+// Starts CCNT and empties the ring
+void trace_init(void);
+void trace_reset(void);
+
+// Records a frame as the driver builds them, frame[0] is the register pointer, or the command
+// byte of a general call
+void trace_frame(uint8_t address, const uint8_t *frame, uint32_t len, int status);
+
+#endif
@@ -3,71 +3,9 @@
 #include <stdint.h>
 #include "../include/BeagleBoneMaster.h"
 #include "../include/MotorControllerLib.h"
+#include "../include/Profiler.h"
 
 
-//Typedef constant declarations
-const clk_mods_t clocks = {
-    .CM_PER_BASE = 0x44E00000,
-    .CM_PER_GPIO1_CLKCTRL = 0xAC,
-    .CM_PER_I2C1_CLKCTRL = 0x48 
-};
-
-const P9HeaderConfig_t P9HeaderConfig = {
-    .BASE = 0x44E10000,
-    .CONF_SPI0_D1 = 0x958,
-    .CONF_SPI0_CS0 = 0x95C,
-    .MODE2_SELECT = 0x32
-};
-
-const GPIOConfigs_t GPIO1 = {
-    .BASE = 0x4804C000,
-    .FALLDETECT = 0x14C,
-    .DEBOUNCE_ENBL = 0x150,
-    .DEBOUNCETIME = 0x154,
-    .IRQSTATUS = 0x2C,
-    .IRQSTATUS_SET_0 = 0x34,
-    .SYSCONFIG = 0x10,
-    .TURN_ON_CLK_AND_DB = 0x00040002, 
-    .DBNC_SET_TIME = 0xA0,     
-    .GPIO1_3_SIGNAL = 0x8     //gpio1_3 signal bit 1000'b
-};
-
-const InterruptConfigs_t INTCConfig = {
-    .BASE = 0x48200000,
-    .SYSCONFIG = 0x10,
-    .CONTROL = 0x48,
-    .MIR_CLEAR2 = 0xC8, 
-    .MIR_CLEAR3 = 0xE8,
-    .RESET = 0x2,
-    .UNMASK_TIMER5 = 0x20000000,
-    .UNMASK_GPIO1 = 0x04,
-    .NEW_IRQ = 0x01
-};
-
-const I2CConfig_t I2C1 = {
-    .BASE = 0x4802A000,            
-    .SYSC = 0x10,                  
-    .PSC = 0xB0,                  
-    .SCLL = 0xB4,                  
-    .SCLH = 0xB8,                  
-    .BUF = 0x94,                   
-    .DATA = 0x9C,                 
-    .CON = 0xA4,                  
-    .SA = 0xAC,                    
-    .CNT = 0x98,                   
-    .IRQSTATUS_RAW = 0x24,        
-    // Commands
-    .SYS_CLK = 24,                 
-    .ICLK = 12,                    
-    .FS_MD_FREQUENCE = 400,        
-    .SCL_LOW_TIME = 0x17,                 
-    .SCL_HIGH_TIME = 0x19,
-    .PSC_VALUE = 0x01,
-    .START_TRANSFER = 0x8603,      
-    .ENABLE_MODULE = 0x8000,       
-    .IRQ_RESET = 0x00             
-};
-
 //Setup interrupt stack routine
 void setup_stacks(int stack_size){
     extern volatile unsigned int svc_stack[];
@@ -76,6 +14,11 @@ void setup_stacks(int stack_size){
     volatile unsigned int* svc_stack_top = svc_stack + stack_size;
     volatile unsigned int* irq_stack_top = irq_stack + stack_size;
 
+#ifdef HWREG_SIM
+    //host build runs on the host's own stack
+    (void)svc_stack_top;
+    (void)irq_stack_top;
+#else
     //setup program stacks for SVC and IRQ modes
     __asm(
           "MOV R13, %0\n\t"
@@ -86,87 +29,877 @@ void setup_stacks(int stack_size){
           : "r"(svc_stack_top), "r"(irq_stack_top)
           : "r13"
     );
+#endif
+}
+
+// Per pin edge setup, copies of what is in RISEDETECT/FALLDETECT/DEBOUNCE_ENBL
+static gpio_edge_handler_t gpio1_handlers[GPIO1_PINS];
+static uint32_t gpio1_rising;
+static uint32_t gpio1_falling;
+static uint32_t gpio1_debounced;
+
+// Edge queue, head is written by the GPIO1 ISR only, tail by the consumer only
+static gpio_event_t gpio1_events[GPIO_EVENT_QUEUE_LEN];
+static volatile uint32_t gpio1_event_head;
+static volatile uint32_t gpio1_event_tail;
+volatile uint32_t gpio1_events_dropped;
+
+// The push button on GPIO1_3
+static void gpio1_button_edge(const gpio_event_t *event){
+    (void)event;
+    push_button = 1; //flag for anyone polling, the move itself is queued here
+    //presses stay enabled while a move runs, each one queues another move
+    motor_button_pressed();
 }
 
 // Initializes GPIO1 for handling external interrupts and debouncing
 void gpio1_init(void) {
     // Enable clock and debounce for GPIO1.
-    HWREG(clocks.CM_PER_BASE + clocks.CM_PER_GPIO1_CLKCTRL) = GPIO1.TURN_ON_CLK_AND_DB; 
-    HWREG(GPIO1.BASE + GPIO1.SYSCONFIG) = 0x02; // Soft reset
+    HWREG_WRITE(clocks.CM_PER_BASE + clocks.CM_PER_GPIO1_CLKCTRL, GPIO1.TURN_ON_CLK_AND_DB); 
+    HWREG_WRITE(GPIO1.BASE + GPIO1.SYSCONFIG, 0x02); // Soft reset
+    HWREG_WRITE(GPIO1.BASE + GPIO1.DEBOUNCETIME, GPIO1.DBNC_SET_TIME);
 
-    // Configure GPIO1 to detect falling edge interrupts and debounce.
-    HWREG(GPIO1.BASE + GPIO1.FALLDETECT) = GPIO1.GPIO1_3_SIGNAL;
-    HWREG(GPIO1.BASE + GPIO1.DEBOUNCE_ENBL) = GPIO1.GPIO1_3_SIGNAL;
-    HWREG(GPIO1.BASE + GPIO1.DEBOUNCETIME) = GPIO1.DBNC_SET_TIME;
-    
-    // Enable GPIO1_3 IRQ signal
-    HWREG(GPIO1.BASE + GPIO1.IRQSTATUS_SET_0) = GPIO1.GPIO1_3_SIGNAL;
+    // The reset cleared every detect and enable bit
+    for (uint32_t pin = 0; pin < GPIO1_PINS; pin++) {
+        gpio1_handlers[pin] = 0;
+    }
+    gpio1_rising = gpio1_falling = gpio1_debounced = 0;
+    gpio1_event_head = gpio1_event_tail = 0;
+    gpio1_events_dropped = 0;
+
+    timer4_init();
+    // GPIO1_3 falling edge, debounced
+    gpio1_watch(GPIO1_BUTTON_PIN, GPIO_EDGE_FALLING, 1, gpio1_button_edge);
+}
+
+int gpio1_watch(uint8_t pin, gpio_edge_t edges, _Bool debounce, gpio_edge_handler_t handler){
+    if (pin >= GPIO1_PINS) return -1;
+    uint32_t bit = 1u << pin;
+
+    uint32_t irq = irq_save();
+    gpio1_handlers[pin] = handler;
+    gpio1_rising = (edges & GPIO_EDGE_RISING) ? gpio1_rising | bit : gpio1_rising & ~bit;
+    gpio1_falling = (edges & GPIO_EDGE_FALLING) ? gpio1_falling | bit : gpio1_falling & ~bit;
+    gpio1_debounced = debounce ? gpio1_debounced | bit : gpio1_debounced & ~bit;
+    HWREG_WRITE(GPIO1.BASE + GPIO1.DEBOUNCE_ENBL, gpio1_debounced);
+    HWREG_WRITE(GPIO1.BASE + GPIO1.RISEDETECT, gpio1_rising);
+    HWREG_WRITE(GPIO1.BASE + GPIO1.FALLDETECT, gpio1_falling);
+    // Drop an edge latched under the old setup
+    HWREG_WRITE(GPIO1.BASE + GPIO1.IRQSTATUS, bit);
+    HWREG_WRITE(GPIO1.BASE + (edges ? GPIO1.IRQSTATUS_SET_0 : GPIO1.IRQSTATUS_CLR_0), bit);
+    irq_restore(irq);
+    return 0;
+}
+
+// ISR side of the queue, a full queue keeps the older edges
+static void gpio1_event_push(const gpio_event_t *event){
+    uint32_t head = gpio1_event_head;
+    if (head - gpio1_event_tail >= GPIO_EVENT_QUEUE_LEN) {
+        gpio1_events_dropped++;
+        return;
+    }
+    gpio1_events[head & (GPIO_EVENT_QUEUE_LEN - 1)] = *event;
+    __sync_synchronize(); // the entry lands before the head that publishes it
+    gpio1_event_head = head + 1;
+}
+
+_Bool gpio1_event_pop(gpio_event_t *event){
+    uint32_t tail = gpio1_event_tail;
+    if (tail == gpio1_event_head) return 0;
+    __sync_synchronize();
+    *event = gpio1_events[tail & (GPIO_EVENT_QUEUE_LEN - 1)];
+    __sync_synchronize(); // copied out before the ISR may reuse the slot
+    gpio1_event_tail = tail + 1;
+    return 1;
 }
 
 // Disables IRQ for GPIO1_3 to prevent further interrupts during handling
 void gpio1_disable_irq(void){
-    uint32_t temp = HWREG(GPIO1.BASE + GPIO1.FALLDETECT);
-    temp &= ~GPIO1.GPIO1_3_SIGNAL; // Clear bit 3 to disable IRQ.
-    HWREG(GPIO1.BASE + GPIO1.FALLDETECT) = temp;
+    HWREG_WRITE(GPIO1.BASE + GPIO1.FALLDETECT, gpio1_falling & ~GPIO1.GPIO1_3_SIGNAL);
 }
 
-// Re-enables GPIO falling edge detection IRQ on pin GPIO1_3 after handling
+// Re-enables GPIO falling edge detection IRQ on pin GPIO1_3 after handling, the other pins keep theirs
 void gpio1_enable_irq(void){
-    HWREG(GPIO1.BASE + GPIO1.FALLDETECT) = GPIO1.GPIO1_3_SIGNAL;
+    HWREG_WRITE(GPIO1.BASE + GPIO1.FALLDETECT, gpio1_falling);
     push_button = 0; //push_button is a flag, reset once enabled again
 }
 
-// Initializes the interrupt controller for Timer5 and GPIO1 interrupts.
+static irq_handler_t irq_handlers[INTC_NUM_IRQS];
+volatile uint32_t irq_spurious;
+
+// Resets the interrupt controller and registers the Timer5, I2C1 and GPIO1 handlers.
 void IRQ_init(void){
-    // Reset the interrupt controller.
-    HWREG(INTCConfig.BASE + INTCConfig.SYSCONFIG) = INTCConfig.RESET;
-    // Unmask interrupts for GPIO1
-    HWREG(INTCConfig.BASE + INTCConfig.MIR_CLEAR3) = INTCConfig.UNMASK_GPIO1;
+    // Reset the interrupt controller, every line comes back masked
+    HWREG_WRITE(INTCConfig.BASE + INTCConfig.SYSCONFIG, INTCConfig.RESET);
+    HWREG_WRITE(INTCConfig.BASE + INTCConfig.THRESHOLD, INTCConfig.THRESHOLD_OFF);
+    for (uint32_t irq = 0; irq < INTC_NUM_IRQS; irq++) {
+        irq_handlers[irq] = 0;
+    }
+
+    irq_register(INTCConfig.IRQ_TIMER5, timer5_irq_handler, INTCConfig.PRIORITY_TIMER5);
+    irq_register(INTCConfig.IRQ_I2C1, I2C1_irq_handler, INTCConfig.PRIORITY_I2C1);
+    irq_register(INTCConfig.IRQ_GPIO1A, gpio1_irq_handler, INTCConfig.PRIORITY_GPIO1);
 
     //Clear existing IRQ signals and enable new generation
-    HWREG(INTCConfig.BASE + INTCConfig.CONTROL) = INTCConfig.NEW_IRQ;
+    HWREG_WRITE(INTCConfig.BASE + INTCConfig.CONTROL, INTCConfig.NEW_IRQ);
+}
+
+int irq_register(uint32_t irq, irq_handler_t handler, uint8_t priority){
+    if (irq >= INTC_NUM_IRQS || priority > INTC_MAX_PRIORITY) return -1;
+
+    irq_handlers[irq] = handler;
+    // ILR: priority in bits 7:2, bit 0 clear routes the line to IRQ rather than FIQ
+    HWREG_WRITE(INTCConfig.BASE + INTCConfig.ILR0 + 4 * irq, (uint32_t)priority << 2);
+    HWREG_WRITE(INTCConfig.BASE + INTCConfig.MIR_CLEAR0 + INTCConfig.MIR_STRIDE * (irq >> 5), 1u << (irq & 0x1F));
+    return 0;
+}
+
+void irq_unregister(uint32_t irq){
+    if (irq >= INTC_NUM_IRQS) return;
+    HWREG_WRITE(INTCConfig.BASE + INTCConfig.MIR_SET0 + INTCConfig.MIR_STRIDE * (irq >> 5), 1u << (irq & 0x1F));
+    irq_handlers[irq] = 0;
+}
+
+void irq_set_threshold(uint8_t priority){
+    HWREG_WRITE(INTCConfig.BASE + INTCConfig.THRESHOLD, priority > INTC_MAX_PRIORITY ? INTCConfig.THRESHOLD_OFF : priority);
+}
+
+#ifdef IRQ_NESTING
+// Calls handler in SVC mode with IRQs enabled. SPSR_irq and the interrupted code's LR_svc are
+// saved first, a nested IRQ overwrites both. The SVC stack is realigned to 8 bytes for the call.
+static void irq_call_preemptible(irq_handler_t handler){
+#ifdef HWREG_SIM
+    hwsim_cpu_irq_enable();
+    handler();
+    hwsim_cpu_irq_disable();
+#else
+    uint32_t spsr;
+    asm volatile("MRS %0, SPSR" : "=r" (spsr));
+    asm volatile(
+          "CPS #0x13\n\t"
+          "AND r1, sp, #4\n\t"
+          "SUB sp, sp, r1\n\t"
+          "PUSH {r1, lr}\n\t"
+          "CPSIE i\n\t"
+          "BLX %0\n\t"
+          "CPSID i\n\t"
+          "POP {r1, lr}\n\t"
+          "ADD sp, sp, r1\n\t"
+          "CPS #0x12\n\t"
+          : //no outputs
+          : "r"(handler)
+          : "r0", "r1", "r2", "r3", "r12", "lr", "cc", "memory"
+    );
+    asm volatile("MSR SPSR_cxsf, %0" :: "r" (spsr));
+#endif
+}
+#endif
+
+// Single entry for every IRQ line, dispatches through irq_handlers[]
+void IRQ_ENTRY irq_director(void){
+    PROF_BEGIN(irq_start);
+
+    uint32_t active = HWREG_READ(INTCConfig.BASE + INTCConfig.SIR_IRQ);
+    irq_handler_t handler = irq_handlers[active & INTCConfig.ACTIVE_IRQ_MASK];
+
+    if ((active & INTCConfig.SPURIOUS_IRQ) || !handler) {
+        // Nothing pending anymore, or a line unmasked without a handler, keep it from storming
+        if (!(active & INTCConfig.SPURIOUS_IRQ)) irq_unregister(active & INTCConfig.ACTIVE_IRQ_MASK);
+        irq_spurious++;
+        HWREG_WRITE(INTCConfig.BASE + INTCConfig.CONTROL, INTCConfig.NEW_IRQ);
+    } else {
+#ifdef IRQ_NESTING
+        // Only lines above the active priority may preempt the handler
+        uint32_t threshold = HWREG_READ(INTCConfig.BASE + INTCConfig.THRESHOLD);
+        uint32_t priority = HWREG_READ(INTCConfig.BASE + INTCConfig.IRQ_PRIORITY) & INTCConfig.PRIORITY_MASK;
+        if (priority < threshold) {
+            HWREG_WRITE(INTCConfig.BASE + INTCConfig.THRESHOLD, priority);
+        }
+        HWREG_WRITE(INTCConfig.BASE + INTCConfig.CONTROL, INTCConfig.NEW_IRQ);
+        irq_call_preemptible(handler);
+        HWREG_WRITE(INTCConfig.BASE + INTCConfig.THRESHOLD, threshold);
+#else
+        handler();
+        HWREG_WRITE(INTCConfig.BASE + INTCConfig.CONTROL, INTCConfig.NEW_IRQ);
+#endif
+    }
+
+    PROF_END(PROF_IRQ, irq_start);
+}
+
+// GPIO1 bank A interrupt, every pin set up with gpio1_watch()
+void gpio1_irq_handler(void){
+    uint32_t now = timer4_count(); // first, so the stamp doesn't include the ISR's own reads
+    uint32_t temp = HWREG_READ(GPIO1.BASE + GPIO1.IRQSTATUS);
+    HWREG_WRITE(GPIO1.BASE + GPIO1.IRQSTATUS, temp);
+    // Only pins watched for both edges need the level read back
+    uint32_t levels = (temp & gpio1_rising & gpio1_falling) ? HWREG_READ(GPIO1.BASE + GPIO1.DATAIN) : 0;
+
+    while (temp) {
+        uint8_t pin = __builtin_ctz(temp);
+        uint32_t bit = 1u << pin;
+        temp &= temp - 1;
+
+        gpio_event_t event = {.time = now, .pin = pin};
+        // A pin watched for one edge went to the known level, even if it bounced back since
+        if (!(gpio1_rising & bit)) event.level = 0;
+        else if (!(gpio1_falling & bit)) event.level = 1;
+        else event.level = (levels & bit) != 0;
+
+        // The handler runs first, a limit switch stops the move before anything else
+        if (gpio1_handlers[pin]) gpio1_handlers[pin](&event);
+        gpio1_event_push(&event);
+    }
+}
+
+// Free running 24 MHz count for the edge timestamps, no interrupt
+void timer4_init(void){
+    HWREG_WRITE(clocks.CM_PER_BASE + clocks.CM_PER_TIMER4_CLKCTRL, Timer4.CLK_ENABLE);
+    HWREG_WRITE(Timer4.CLKSEL, Timer4.CLKSEL_M_OSC);
+    HWREG_WRITE(Timer4.BASE + Timer4.TCLR, Timer4.STOP);
+    HWREG_WRITE(Timer4.BASE + Timer4.IRQENABLE_CLR, Timer4.OVF_IT);
+    HWREG_WRITE(Timer4.BASE + Timer4.TLDR, 0);
+    HWREG_WRITE(Timer4.BASE + Timer4.TCRR, 0);
+    HWREG_WRITE(Timer4.BASE + Timer4.TCLR, Timer4.START_AUTO_RELOAD);
+}
+
+uint32_t timer4_count(void){
+    return HWREG_READ(Timer4.BASE + Timer4.TCRR);
+}
+
+// Initializes Timer5 from the 32KHz clock with the overflow interrupt enabled, left stopped
+void timer5_init(void){
+    HWREG_WRITE(clocks.CM_PER_BASE + clocks.CM_PER_TIMER5_CLKCTRL, Timer5.CLK_ENABLE);
+    HWREG_WRITE(Timer5.CLKSEL, Timer5.CLKSEL_32KHZ);
+    HWREG_WRITE(Timer5.BASE + Timer5.TCLR, Timer5.STOP);
+    HWREG_WRITE(Timer5.BASE + Timer5.IRQSTATUS, Timer5.OVF_IT);
+    HWREG_WRITE(Timer5.BASE + Timer5.IRQENABLE_SET, Timer5.OVF_IT);
+}
+
+uint32_t timer5_rate_to_ticks(uint32_t steps_per_sec){
+    if (steps_per_sec == 0) steps_per_sec = 1;
+    uint32_t ticks = Timer5.CLK_FREQ / steps_per_sec;
+    return ticks ? ticks : 1;
+}
+
+// TLDR = 0xFFFFFFFF - ticks + 1
+uint32_t timer5_load_value(uint32_t ticks){
+    return 0xFFFFFFFF - ticks + 1;
+}
+
+void timer5_start(uint32_t first_ticks, uint32_t reload_ticks){
+    per_clocks_ungate();
+    HWREG_WRITE(Timer5.BASE + Timer5.TCLR, Timer5.STOP);
+    HWREG_WRITE(Timer5.BASE + Timer5.TCRR, timer5_load_value(first_ticks));
+    HWREG_WRITE(Timer5.BASE + Timer5.TLDR, timer5_load_value(reload_ticks));
+    HWREG_WRITE(Timer5.BASE + Timer5.IRQSTATUS, Timer5.OVF_IT);
+    HWREG_WRITE(Timer5.BASE + Timer5.TCLR, Timer5.START_AUTO_RELOAD);
+}
+
+void timer5_set_period(uint32_t ticks){
+    HWREG_WRITE(Timer5.BASE + Timer5.TLDR, timer5_load_value(ticks));
+}
+
+void timer5_stop(void){
+    HWREG_WRITE(Timer5.BASE + Timer5.TCLR, Timer5.STOP);
+}
+
+void timer5_irq_handler(void){
+    HWREG_WRITE(Timer5.BASE + Timer5.IRQSTATUS, Timer5.OVF_IT);
+    motor_step_tick();
+    HWREG_WRITE(Timer5.BASE + Timer5.IRQ_EOI, 0x0);
 }
 
-// Handles IRQ signals from GPIO1_3 and Timer5, performing necessary actions.
-void irq_director(void){
-    uint32_t temp; 
+static _Bool per_gated;     // I2C1 and Timer5 module clocks are off
 
-    temp = HWREG(GPIO1.BASE + GPIO1.IRQSTATUS);
-    if(temp & GPIO1.GPIO1_3_SIGNAL){
-        HWREG(GPIO1.BASE + GPIO1.IRQSTATUS) = temp;
-        //disable further interrupts
-        gpio1_disable_irq(); 
-        push_button = 1; //set flag to true, proceed with stepper motor sequence
+// Writes MODULEMODE and waits for IDLEST to follow, a few L4 clocks either way
+static void per_clock_set(uint32_t clkctrl, uint32_t mode, uint32_t idlest){
+    HWREG_WRITE(clocks.CM_PER_BASE + clkctrl, mode);
+    for (uint32_t n = 0; n < clocks.POLL_TIMEOUT; n++) {
+        if ((HWREG_READ(clocks.CM_PER_BASE + clkctrl) & clocks.IDLEST_MASK) == idlest) return;
     }
+}
+
+int per_clocks_gate(void){
+    if (per_gated) return 1;
+    // The last frame's STOP lands after its ARDY, BB stays set until SCL and SDA are released
+    if (!I2C_tx_idle() || (HWREG_READ(I2C1.BASE + I2C1.IRQSTATUS_RAW) & I2C1.STATUS_BB)) return 0;
+    per_clock_set(clocks.CM_PER_I2C1_CLKCTRL, clocks.MODULEMODE_DISABLE, clocks.IDLEST_DISABLED);
+    per_clock_set(clocks.CM_PER_TIMER5_CLKCTRL, clocks.MODULEMODE_DISABLE, clocks.IDLEST_DISABLED);
+    per_gated = 1;
+    return 1;
+}
 
-   clear_interrupt_mask_bit(); 
+void per_clocks_ungate(void){
+    if (!per_gated) return;
+    per_clock_set(clocks.CM_PER_I2C1_CLKCTRL, clocks.MODULEMODE_ENABLE, clocks.IDLEST_FUNC);
+    per_clock_set(clocks.CM_PER_TIMER5_CLKCTRL, clocks.MODULEMODE_ENABLE, clocks.IDLEST_FUNC);
+    per_gated = 0;
+}
+
+_Bool per_clocks_gated(void){
+    return per_gated;
+}
+
+//SCL modes: top rate, the ICLK the TRM suggests, and the I2C spec minimum low and high times
+typedef struct {
+    uint32_t max_khz;
+    uint32_t iclk_khz;
+    uint32_t low_min_ns;
+    uint32_t high_min_ns;
+} i2c_mode_t;
+
+static const i2c_mode_t i2c_modes[] = {
+    {100, 4000, 4700, 4000},        // standard mode
+    {400, 12000, 1300, 600},        // fast mode
+    {1000, 24000, 500, 260},        // fast-mode plus
+};
+
+int I2C_plan_timing(uint32_t fclk_khz, uint32_t bus_khz, i2c_timing_t *timing){
+    const i2c_mode_t *mode = 0;
+
+    for (uint32_t i = 0; i < sizeof(i2c_modes) / sizeof(i2c_modes[0]); i++) {
+        if (bus_khz && bus_khz <= i2c_modes[i].max_khz) {
+            mode = &i2c_modes[i];
+            break;
+        }
+    }
+    if (!mode || fclk_khz < mode->iclk_khz) return I2C_ERR_BAD_SPEED;
+
+    uint32_t psc = fclk_khz / mode->iclk_khz - 1;       // ICLK at or above the suggested rate
+    if (psc > 0xFF) return I2C_ERR_BAD_SPEED;
+    uint32_t iclk_khz = fclk_khz / (psc + 1);
+    uint32_t period = (iclk_khz + bus_khz - 1) / bus_khz;  // rounded up, never faster than asked
+
+    // ICLK cycles the spec minimums need, rounded up
+    uint32_t low_min = (mode->low_min_ns * iclk_khz + 999999) / 1000000;
+    uint32_t high_min = (mode->high_min_ns * iclk_khz + 999999) / 1000000;
+    uint32_t low = (period * mode->low_min_ns + mode->low_min_ns + mode->high_min_ns - 1) / (mode->low_min_ns + mode->high_min_ns);
+    if (low < low_min) low = low_min;
+    if (period < low + high_min) return I2C_ERR_BAD_SPEED;
+    uint32_t high = period - low;
+
+    if (low < 7 || high < 5 || low - 7 > 0xFF || high - 5 > 0xFF) return I2C_ERR_BAD_SPEED;
+    timing->psc = psc;
+    timing->scll = low - 7;
+    timing->sclh = high - 5;
+    timing->bus_khz = iclk_khz / period;
+    return I2C_OK;
 }
 
 // Initializes I2C1 module, configuring clock, speed, and module reset.
 void I2C_init(void) {
+    I2C_init_speed(I2C1.FS_MD_FREQUENCE);
+}
+
+//Timing of the last I2C_init_speed(), I2C_restart() programs it again
+static i2c_timing_t i2c_timing;
+static uint32_t i2c_scl_ticks;    // Timer4 ticks per SCL period at i2c_timing, for frame deadlines
+
+// Clears the FIFO, loads the SCL timing and enables the module
+static void I2C_configure(void){
+    HWREG_WRITE(I2C1.BASE + I2C1.BUF, I2C1.IRQ_RESET); // Clear FIFO
+    HWREG_WRITE(I2C1.BASE + I2C1.PSC, i2c_timing.psc);
+    HWREG_WRITE(I2C1.BASE + I2C1.SCLL, i2c_timing.scll);
+    HWREG_WRITE(I2C1.BASE + I2C1.SCLH, i2c_timing.sclh);
+    
+    //Enable and wake up I2C Module
+    HWREG_WRITE(I2C1.BASE + I2C1.CON, I2C1.ENABLE_MODULE);
+}
+
+int I2C_init_speed(uint32_t bus_khz) {
+    i2c_timing_t timing;
+    if (I2C_plan_timing(I2C1.SYS_CLK * 1000, bus_khz, &timing) < 0) return I2C_ERR_BAD_SPEED;
+    i2c_timing = timing;
+    i2c_scl_ticks = (Timer4.CLK_FREQ / 1000 + timing.bus_khz - 1) / timing.bus_khz;
+
     // Configure I2C1 pins on P9 header.
-    HWREG(P9HeaderConfig.BASE + P9HeaderConfig.CONF_SPI0_CS0) = P9HeaderConfig.MODE2_SELECT;
-    HWREG(P9HeaderConfig.BASE + P9HeaderConfig.CONF_SPI0_D1) = P9HeaderConfig.MODE2_SELECT;
+    HWREG_WRITE(P9HeaderConfig.BASE + P9HeaderConfig.CONF_SPI0_CS0, P9HeaderConfig.MODE2_SELECT);
+    HWREG_WRITE(P9HeaderConfig.BASE + P9HeaderConfig.CONF_SPI0_D1, P9HeaderConfig.MODE2_SELECT);
     
     // Enable clock for I2C1 module and perform a soft reset.
-    HWREG(clocks.CM_PER_BASE + clocks.CM_PER_I2C1) = 0x2;
-    HWREG(I2C1.BASE + I2C1.SYSC) = I2C1.ENABLE_MODULE;
+    HWREG_WRITE(clocks.CM_PER_BASE + clocks.CM_PER_I2C1_CLKCTRL, clocks.MODULEMODE_ENABLE);
+    HWREG_WRITE(I2C1.BASE + I2C1.SYSC, I2C1.ENABLE_MODULE);
     
     // Clear FIFO buffer and configure I2C speed.
-    HWREG(I2C1.BASE + I2C1.BUF) = I2C1.IRQ_RESET; // Clear FIFO
-    HWREG(I2C1.BASE + I2C1.PSC) = I2C1.PSC_VALUE;
-    HWREG(I2C1.BASE + I2C1.SCLL) = I2C1.SCL_LOW_TIME;
-    HWREG(I2C1.BASE + I2C1. SCLH) = I2C1.SCL_HIGH_TIME;
-    
-    //Enable and wake up I2C Module
-    HWREG(I2C1.BASE + I2C1.CON) = I2C1.ENABLE_MODULE;
-    
+    I2C_configure();
+    return I2C_OK;
+}
+
+// Waits for a status flag, bounded by POLL_TIMEOUT reads
+int I2C_wait(uint32_t flags){
+    for (uint32_t n = 0; n < I2C1.POLL_TIMEOUT; n++) {
+        uint32_t status = HWREG_READ(I2C1.BASE + I2C1.IRQSTATUS_RAW);
+        if (status & I2C1.STATUS_NACK) return I2C_ERR_NACK;
+        if (status & I2C1.STATUS_AL) return I2C_ERR_ARB_LOST;
+        if (status & flags) return I2C_OK;
+    }
+    return I2C_ERR_TIMEOUT;
+}
+
+// Previous frame must have released the bus
+static int I2C_wait_bus_free(void){
+    for (uint32_t n = 0; n < I2C1.POLL_TIMEOUT; n++) {
+        if (!(HWREG_READ(I2C1.BASE + I2C1.IRQSTATUS_RAW) & I2C1.STATUS_BB)) return I2C_OK;
+    }
+    return I2C_ERR_BUS_BUSY;
+}
+
+// One polled transmit frame started with con, returns once ARDY is up
+static int I2C_transmit(uint8_t address, const uint8_t *data, uint32_t len, uint32_t con){
+    int err = I2C_OK;
+
+    HWREG_WRITE(I2C1.BASE + I2C1.IRQSTATUS, I2C1.CLEAR_ALL_IRQ);
+    HWREG_WRITE(I2C1.BASE + I2C1.SA, address);
+    HWREG_WRITE(I2C1.BASE + I2C1.CNT, len);
+    HWREG_WRITE(I2C1.BASE + I2C1.CON, con);
+
+    for (uint32_t i = 0; i < len; i++) {
+        err = I2C_wait(I2C1.STATUS_XRDY);
+        if (err) break;
+        HWREG_WRITE(I2C1.BASE + I2C1.DATA, data[i]);
+        HWREG_WRITE(I2C1.BASE + I2C1.IRQSTATUS, I2C1.STATUS_XRDY);
+    }
+    if (!err) {
+        err = I2C_wait(I2C1.STATUS_ARDY);
+    }
+    return err;
+}
+
+// Polled master transmit, one frame per call
+int I2C_write(uint8_t address, const uint8_t *data, uint32_t len){
+    int err;
+
+    per_clocks_ungate();
+
+    if ((err = I2C_wait_bus_free())) return err;
+    err = I2C_transmit(address, data, len, I2C1.START_TRANSFER);
+
+    if (err == I2C_ERR_NACK) {
+        // Slave did not answer, STOP releases the bus for the next frame
+        HWREG_WRITE(I2C1.BASE + I2C1.CON, I2C1.ENABLE_MODULE | I2C1.STOP_CONDITION);
+    }
+    HWREG_WRITE(I2C1.BASE + I2C1.IRQSTATUS, I2C1.CLEAR_ALL_IRQ);
+    return err;
+}
+
+i2c_recovery_stats_t i2c_recovery;
+
+// Runs the tier before attempt failed + 1 of a frame: retries, then a bus clear, then a module
+// reset. Returns 0 once every tier has been tried and the frame should be given up
+static _Bool I2C_recovery_step(uint32_t failed){
+    if (failed <= I2C_RETRY_MAX) {
+        i2c_recovery.retries++;
+    } else if (failed == I2C_RETRY_MAX + 1) {
+        I2C_bus_clear();
+    } else if (failed == I2C_RETRY_MAX + 2) {
+        I2C_restart();
+    } else {
+        i2c_recovery.failures++;
+        return 0;
+    }
+    return 1;
+}
+
+int I2C_write_recover(uint8_t address, const uint8_t *data, uint32_t len){
+    uint32_t failed = 0;
+    int err;
+
+    while ((err = I2C_write(address, data, len)) != I2C_OK && I2C_recovery_step(++failed)) {
+    }
+    return err;
+}
+
+// Half a period of the 100 KHz recovery clock, slow enough for any slave
+static void I2C_half_clock(void){
+    for (uint32_t n = 0; n < I2C1.RECOVERY_HALF_CLOCK; n++) {
+        CPU_NOP();
+    }
+}
+
+int I2C_bus_clear(void){
+    uint32_t sda = I2C1.SYSTEST_SDA_O;
+    uint32_t scl = I2C1.SYSTEST_SCL_O;
+    int err = I2C_ERR_BUS_BUSY;
+
+    i2c_recovery.bus_clears++;
+    // Take the pins over with both released
+    HWREG_WRITE(I2C1.BASE + I2C1.SYSTEST, I2C1.SYSTEST_IO_MODE | scl | sda);
+    I2C_half_clock();
+    for (uint32_t n = 0; n <= I2C1.RECOVERY_PULSES; n++) {
+        if (HWREG_READ(I2C1.BASE + I2C1.SYSTEST) & I2C1.SYSTEST_SDA_I) {
+            err = I2C_OK;
+            break;
+        }
+        if (n == I2C1.RECOVERY_PULSES) break;
+        HWREG_WRITE(I2C1.BASE + I2C1.SYSTEST, I2C1.SYSTEST_IO_MODE | sda);
+        I2C_half_clock();
+        HWREG_WRITE(I2C1.BASE + I2C1.SYSTEST, I2C1.SYSTEST_IO_MODE | scl | sda);
+        I2C_half_clock();
+    }
+    if (!err) {
+        // STOP: SDA low while SCL is low, then SCL high and SDA rising
+        HWREG_WRITE(I2C1.BASE + I2C1.SYSTEST, I2C1.SYSTEST_IO_MODE);
+        I2C_half_clock();
+        HWREG_WRITE(I2C1.BASE + I2C1.SYSTEST, I2C1.SYSTEST_IO_MODE | scl);
+        I2C_half_clock();
+        HWREG_WRITE(I2C1.BASE + I2C1.SYSTEST, I2C1.SYSTEST_IO_MODE | scl | sda);
+        I2C_half_clock();
+    }
+    // Back to functional mode
+    HWREG_WRITE(I2C1.BASE + I2C1.SYSTEST, 0);
+    return err;
+}
+
+//Transmit ring, head is only written by the producer and tail only by the ISR
+static i2c_frame_t i2c_tx_queue[I2C_TX_QUEUE_LEN];
+static volatile uint32_t i2c_tx_head;
+static volatile uint32_t i2c_tx_tail;
+static volatile uint32_t i2c_tx_pos;      // next byte of the frame at tail
+static volatile _Bool i2c_tx_active;      // frame at tail is on the bus
+_Bool i2c_tx_running;                    // engine owns I2C1, see I2C_tx_engine_running()
+static _Bool i2c_tx_dma;                  // EDMA feeds the FIFO, XRDY stays masked
+static uint32_t i2c_tx_irqs;              // I2C1 interrupts the engine runs on
+static uint32_t i2c_tx_failed;            // failed attempts of the frame at tail
+static volatile _Bool i2c_tx_fault;       // a frame was dropped, see I2C_tx_take_fault()
+static volatile _Bool i2c_tx_stalled;     // frame at tail failed, waits for I2C_tx_service()
+static volatile _Bool i2c_tx_stopping;    // frame retired at ARDY, the next START waits for BF
+static volatile _Bool i2c_tx_claimed;     // a polled transfer owns I2C1, enqueue must not kick
+static uint32_t i2c_tx_started;           // Timer4 count at the START of the frame at tail
+static uint32_t i2c_tx_budget;            // Timer4 ticks it may stay on the bus, see I2C_tx_service()
+volatile uint32_t i2c_tx_errors;
+
+#define I2C_TX_IRQS (I2C1.STATUS_XRDY | I2C1.STATUS_ARDY | I2C1.STATUS_BF | I2C1.STATUS_NACK | I2C1.STATUS_AL)
+#define I2C_TX_DMA_IRQS (I2C1.STATUS_ARDY | I2C1.STATUS_BF | I2C1.STATUS_NACK | I2C1.STATUS_AL)
+
+// PaRAM set the I2C1 TX event is mapped to
+#define EDMA_I2C1_TX_PARAM (EDMA.BASE + EDMA.PARAM0 + EDMA.PARAM_SIZE * EDMA.EVT_I2C1_TX)
+
+void EDMA_init(void){
+    uint32_t bit = 1u << EDMA.EVT_I2C1_TX;
+
+    HWREG_WRITE(clocks.CM_PER_BASE + clocks.CM_PER_TPCC_CLKCTRL, EDMA.CLK_ENABLE);
+    HWREG_WRITE(clocks.CM_PER_BASE + clocks.CM_PER_TPTC0_CLKCTRL, EDMA.CLK_ENABLE);
+
+    // Event 26 uses PaRAM set 26, DMAQNUM resets to queue 0 (TPTC0) for every channel
+    HWREG_WRITE(EDMA.BASE + EDMA.DCHMAP0 + 4 * EDMA.EVT_I2C1_TX, EDMA.EVT_I2C1_TX << EDMA.DCHMAP_SHIFT);
+    HWREG_WRITE(EDMA.BASE + EDMA.EECR, bit);
+    HWREG_WRITE(EDMA.BASE + EDMA.ECR, bit);
+    HWREG_WRITE(EDMA.BASE + EDMA.SECR, bit);
+    HWREG_WRITE(EDMA.BASE + EDMA.EMCR, bit);
+
+    // ACNT = 1 byte arrays, one per FIFO slot, all written to DATA: SRCBIDX 1, DSTBIDX 0.
+    // AB-sync so a request moves BCNT bytes, SRC and A_B_CNT are set per frame.
+    // Static, the set is rewritten before every frame instead of being linked
+    HWREG_WRITE(EDMA_I2C1_TX_PARAM + EDMA.OPT, EDMA.OPT_STATIC | EDMA.OPT_AB_SYNC | (EDMA.EVT_I2C1_TX << EDMA.OPT_TCC_SHIFT));
+    HWREG_WRITE(EDMA_I2C1_TX_PARAM + EDMA.DST, I2C1.BASE + I2C1.DATA);
+    HWREG_WRITE(EDMA_I2C1_TX_PARAM + EDMA.SRC_DST_BIDX, 1);
+    HWREG_WRITE(EDMA_I2C1_TX_PARAM + EDMA.LINK_BCNTRLD, EDMA.LINK_NULL);
+    HWREG_WRITE(EDMA_I2C1_TX_PARAM + EDMA.SRC_DST_CIDX, 0);
+    HWREG_WRITE(EDMA_I2C1_TX_PARAM + EDMA.CCNT, 1);
+
+    HWREG_WRITE(EDMA.BASE + EDMA.EESR, bit);
+}
+
+// Puts the frame at tail on the bus, called from the ISR or with I2C1 interrupts disabled
+static void I2C_tx_start_next(void){
+    if (i2c_tx_tail == i2c_tx_head) {
+        i2c_tx_active = 0;
+        return;
+    }
+    i2c_frame_t *frame = &i2c_tx_queue[i2c_tx_tail & (I2C_TX_QUEUE_LEN - 1)];
+    i2c_tx_pos = 0;
+    i2c_tx_active = 1;
+    if (i2c_tx_dma && frame->len) {
+        // The FIFO is as deep as the largest frame, with the threshold at the frame length the
+        // first request after START moves all of it. Clearing the FIFO drops bytes a NACKed
+        // frame left behind
+        HWREG_WRITE(EDMA_I2C1_TX_PARAM + EDMA.SRC, DMA_ADDR(frame->data));
+        HWREG_WRITE(EDMA_I2C1_TX_PARAM + EDMA.A_B_CNT, ((uint32_t)frame->len << 16) | 1);
+        HWREG_WRITE(I2C1.BASE + I2C1.BUF, I2C1.BUF_XDMA_EN | I2C1.BUF_TXFIFO_CLR | (frame->len - 1));
+        CPU_DSB(); // the frame the enqueue copied is in RAM before START lets the EDMA read it
+    }
+    HWREG_WRITE(I2C1.BASE + I2C1.SA, frame->address);
+    HWREG_WRITE(I2C1.BASE + I2C1.CNT, frame->len);
+    HWREG_WRITE(I2C1.BASE + I2C1.CON, I2C1.START_TRANSFER);
+    // START, address, data and STOP clocks twice over, the slack covers the ISRs that retire it
+    i2c_tx_budget = 2 * ((frame->len + 1u) * 9 + 2) * i2c_scl_ticks + I2C_TX_SLACK_US * (Timer4.CLK_FREQ / 1000000);
+    i2c_tx_started = timer4_count();
+}
+
+static void I2C_tx_engine_setup(_Bool dma){
+    i2c_tx_head = 0;
+    i2c_tx_tail = 0;
+    i2c_tx_active = 0;
+    i2c_tx_failed = 0;
+    i2c_tx_fault = 0;
+    i2c_tx_stalled = 0;
+    i2c_tx_stopping = 0;
+    i2c_tx_dma = dma;
+    i2c_tx_irqs = dma ? I2C_TX_DMA_IRQS : I2C_TX_IRQS;
+    HWREG_WRITE(I2C1.BASE + I2C1.IRQENABLE_CLR, I2C_TX_IRQS);
+    HWREG_WRITE(I2C1.BASE + (dma ? I2C1.DMATXENABLE_SET : I2C1.DMATXENABLE_CLR), I2C1.DMA_REQ_ENABLE);
+    if (!dma) HWREG_WRITE(I2C1.BASE + I2C1.BUF, I2C1.IRQ_RESET);
+    HWREG_WRITE(I2C1.BASE + I2C1.IRQSTATUS, I2C1.CLEAR_ALL_IRQ);
+    HWREG_WRITE(I2C1.BASE + I2C1.IRQENABLE_SET, i2c_tx_irqs);
+    i2c_tx_running = 1;
+}
+
+void I2C_tx_engine_start(void){
+    I2C_tx_engine_setup(0);
+}
+
+void I2C_tx_engine_start_dma(void){
+    EDMA_init();
+    I2C_tx_engine_setup(1);
+}
+
+// Copies a frame into the ring, never waits on the bus
+int I2C_tx_enqueue(uint8_t address, const uint8_t *data, uint32_t len){
+    uint32_t head = i2c_tx_head;
+
+    if (head - i2c_tx_tail >= I2C_TX_QUEUE_LEN) return I2C_ERR_QUEUE_FULL;
+    if (len > I2C_FRAME_MAX) len = I2C_FRAME_MAX;
+
+    i2c_frame_t *frame = &i2c_tx_queue[head & (I2C_TX_QUEUE_LEN - 1)];
+    frame->address = address;
+    frame->len = len;
+    for (uint32_t i = 0; i < len; i++) {
+        frame->data[i] = data[i];
+    }
+    __sync_synchronize(); // the frame lands before the head that publishes it
+    i2c_tx_head = head + 1;
+
+    // Engine idle, start it with the I2C1 interrupt masked so the ISR cannot race the kick.
+    // A stalled engine restarts from I2C_tx_service() once the failed frame's tier has run
+    if (!i2c_tx_active && !i2c_tx_claimed && !i2c_tx_stalled) {
+        per_clocks_ungate();
+        HWREG_WRITE(I2C1.BASE + I2C1.IRQENABLE_CLR, i2c_tx_irqs);
+        if (!i2c_tx_active && !i2c_tx_claimed && !i2c_tx_stalled) I2C_tx_start_next();
+        HWREG_WRITE(I2C1.BASE + I2C1.IRQENABLE_SET, i2c_tx_irqs);
+    }
+    return I2C_OK;
+}
+
+_Bool I2C_tx_idle(void){
+    return !i2c_tx_active && i2c_tx_head == i2c_tx_tail;
+}
+
+_Bool I2C_tx_take_fault(void){
+    if (!i2c_tx_fault) return 0;
+    i2c_tx_fault = 0;
+    return 1;
+}
+
+_Bool I2C_tx_stalled(void){
+    return i2c_tx_stalled;
+}
+
+// A slave holding SCL low wedges the frame with no NACK, AL or ARDY to stall it, so a frame still
+// on the bus past its budget is stalled here instead, as the ISR would have
+static void I2C_tx_check_deadline(void){
+    if (!i2c_tx_active || timer4_count() - i2c_tx_started < i2c_tx_budget) return;
+
+    uint32_t irq = irq_save();
+    // The ISR may have finished it since
+    if (i2c_tx_active && timer4_count() - i2c_tx_started >= i2c_tx_budget) {
+        i2c_recovery.timeouts++;
+        i2c_tx_failed++;
+        i2c_tx_active = 0;
+        i2c_tx_stopping = 0;
+        i2c_tx_stalled = 1;
+    }
+    irq_restore(irq);
+}
+
+// The ladder for the frame the ISR or the deadline stalled on. The bus clear bit-bangs for about
+// 100 us and the reset polls SYSS, so this runs from the idle loop, never from an ISR
+void I2C_tx_service(void){
+    I2C_tx_check_deadline();
+    if (!i2c_tx_stalled) return;
+
+    // Retries only count, the bus tiers run here. 0 once they are used up, the frame is dropped
+    _Bool again = I2C_recovery_step(i2c_tx_failed);
+    // The STOP after a NACK, or the bus clear's, must be out before the next START
+    I2C_wait_bus_free();
+
+    uint32_t irq = irq_save();
+    HWREG_WRITE(I2C1.BASE + I2C1.IRQENABLE_CLR, i2c_tx_irqs);
+    if (!again) {
+        i2c_tx_errors++;
+        i2c_tx_fault = 1;
+        i2c_tx_failed = 0;
+        // A STOP that timed out after ARDY had already retired its frame
+        if (i2c_tx_tail != i2c_tx_head) i2c_tx_tail++;
+    }
+    i2c_tx_stalled = 0;
+    HWREG_WRITE(I2C1.BASE + I2C1.IRQSTATUS, I2C1.CLEAR_ALL_IRQ);
+    I2C_tx_start_next();
+    HWREG_WRITE(I2C1.BASE + I2C1.IRQENABLE_SET, i2c_tx_irqs);
+    irq_restore(irq);
+}
+
+// Takes I2C1 from an idle engine for a polled transfer. Masked, so a step ISR can't enqueue
+// between the check and the claim; anything it queues later waits in the ring
+static _Bool I2C_tx_claim(void){
+    uint32_t irq = irq_save();
+    _Bool idle = !i2c_tx_active && i2c_tx_head == i2c_tx_tail;
+    if (idle) i2c_tx_claimed = 1;
+    irq_restore(irq);
+    if (!idle) return 0;
+
+    HWREG_WRITE(I2C1.BASE + I2C1.IRQENABLE_CLR, i2c_tx_irqs);
+    if (i2c_tx_dma) {
+        // XRDY per byte again, I2C_tx_start_next() sets the threshold of the next frame
+        HWREG_WRITE(I2C1.BASE + I2C1.DMATXENABLE_CLR, I2C1.DMA_REQ_ENABLE);
+        HWREG_WRITE(I2C1.BASE + I2C1.BUF, I2C1.BUF_TXFIFO_CLR);
+    }
+    return 1;
+}
+
+// Hands I2C1 back and starts whatever was queued while it was claimed
+static void I2C_tx_release(void){
+    uint32_t irq = irq_save();
+    if (i2c_tx_dma) HWREG_WRITE(I2C1.BASE + I2C1.DMATXENABLE_SET, I2C1.DMA_REQ_ENABLE);
+    // The read's STOP must be out before the next START
+    I2C_wait_bus_free();
+    HWREG_WRITE(I2C1.BASE + I2C1.IRQSTATUS, I2C1.CLEAR_ALL_IRQ);
+    i2c_tx_claimed = 0;
+    I2C_tx_start_next();
+    HWREG_WRITE(I2C1.BASE + I2C1.IRQENABLE_SET, i2c_tx_irqs);
+    irq_restore(irq);
+}
+
+int I2C_write_read(uint8_t address, const uint8_t *wdata, uint32_t wlen, uint8_t *rdata, uint32_t rlen){
+    _Bool engine = i2c_tx_running;
+    int err;
+
+    if (engine && !I2C_tx_claim()) return I2C_ERR_BUS_BUSY;
+    per_clocks_ungate();
+
+    err = I2C_wait_bus_free();
+    if (!err) {
+        // No STP, ARDY leaves the bus held for the repeated START
+        err = I2C_transmit(address, wdata, wlen, I2C1.START_NO_STOP);
+    }
+    if (!err) {
+        HWREG_WRITE(I2C1.BASE + I2C1.IRQSTATUS, I2C1.STATUS_ARDY);
+        HWREG_WRITE(I2C1.BASE + I2C1.CNT, rlen);
+        HWREG_WRITE(I2C1.BASE + I2C1.CON, I2C1.START_RECEIVE);
+        for (uint32_t i = 0; i < rlen; i++) {
+            err = I2C_wait(I2C1.STATUS_RRDY);
+            if (err) break;
+            rdata[i] = HWREG_READ(I2C1.BASE + I2C1.DATA);
+            HWREG_WRITE(I2C1.BASE + I2C1.IRQSTATUS, I2C1.STATUS_RRDY);
+        }
+        if (!err) {
+            err = I2C_wait(I2C1.STATUS_ARDY);
+        }
+    }
+
+    if (err == I2C_ERR_NACK || err == I2C_ERR_TIMEOUT) {
+        // The pointer frame queues no STOP of its own, release the bus whichever phase stopped
+        HWREG_WRITE(I2C1.BASE + I2C1.CON, I2C1.ENABLE_MODULE | I2C1.STOP_CONDITION);
+    }
+    HWREG_WRITE(I2C1.BASE + I2C1.IRQSTATUS, I2C1.CLEAR_ALL_IRQ);
+    if (engine) I2C_tx_release();
+    return err;
+}
+
+// I2C1 interrupt, one FIFO byte per XRDY and one frame per ARDY. ARDY comes before the STOP is
+// on the bus, a START then would turn it into a repeated START and the board would only latch
+// the frame at the next STOP, so the next frame starts on BF. With the EDMA feeding the FIFO
+// only ARDY, BF, NACK and AL are enabled
+void I2C1_irq_handler(void){
+    uint32_t status = HWREG_READ(I2C1.BASE + I2C1.IRQSTATUS);
+    i2c_frame_t *frame = &i2c_tx_queue[i2c_tx_tail & (I2C_TX_QUEUE_LEN - 1)];
+
+    if (status & (I2C1.STATUS_NACK | I2C1.STATUS_AL)) {
+        if (status & I2C1.STATUS_NACK) {
+            HWREG_WRITE(I2C1.BASE + I2C1.CON, I2C1.ENABLE_MODULE | I2C1.STOP_CONDITION);
+        }
+        HWREG_WRITE(I2C1.BASE + I2C1.IRQSTATUS, status);
+        // The frame stays at tail, I2C_tx_service() runs its tier and starts it again
+        i2c_tx_failed++;
+        i2c_tx_active = 0;
+        i2c_tx_stalled = 1;
+        return;
+    }
+    if (status & I2C1.STATUS_XRDY) {
+        if (i2c_tx_active && i2c_tx_pos < frame->len) {
+            HWREG_WRITE(I2C1.BASE + I2C1.DATA, frame->data[i2c_tx_pos++]);
+        }
+        HWREG_WRITE(I2C1.BASE + I2C1.IRQSTATUS, I2C1.STATUS_XRDY);
+    }
+    if (status & I2C1.STATUS_BF) {
+        // Only the STOP of a retired frame starts the next one, any other BF is stale
+        HWREG_WRITE(I2C1.BASE + I2C1.IRQSTATUS, I2C1.STATUS_BF);
+        if (i2c_tx_stopping) {
+            i2c_tx_stopping = 0;
+            I2C_tx_start_next();
+        }
+    }
+    if (status & I2C1.STATUS_ARDY) {
+        HWREG_WRITE(I2C1.BASE + I2C1.IRQSTATUS, I2C1.STATUS_ARDY);
+        if (i2c_tx_active) {
+            // The engine keeps the bus, and stays busy for I2C_tx_idle(), until BF
+            i2c_tx_failed = 0;
+            i2c_tx_tail++;
+            i2c_tx_stopping = 1;
+        }
+    }
+}
+
+void I2C_restart(void){
+    i2c_recovery.restarts++;
+    HWREG_WRITE(I2C1.BASE + I2C1.CON, 0);
+    HWREG_WRITE(I2C1.BASE + I2C1.SYSC, I2C1.SOFT_RESET);
+    // RDONE only comes up once the module is enabled again
+    HWREG_WRITE(I2C1.BASE + I2C1.CON, I2C1.ENABLE_MODULE);
+    for (uint32_t n = 0; n < I2C1.POLL_TIMEOUT; n++) {
+        if (HWREG_READ(I2C1.BASE + I2C1.SYSS) & I2C1.RESET_DONE) break;
+    }
+    HWREG_WRITE(I2C1.BASE + I2C1.CON, 0);
+    I2C_configure();
+
+    if (i2c_tx_running) {
+        if (i2c_tx_dma) HWREG_WRITE(I2C1.BASE + I2C1.DMATXENABLE_SET, I2C1.DMA_REQ_ENABLE);
+        HWREG_WRITE(I2C1.BASE + I2C1.IRQSTATUS, I2C1.CLEAR_ALL_IRQ);
+        HWREG_WRITE(I2C1.BASE + I2C1.IRQENABLE_SET, i2c_tx_irqs);
+    }
 }
 
 // Clears the interrupt mask bit, enabling IRQ handling. Represented here for future implementations
 void clear_interrupt_mask_bit(void){
+#ifdef HWREG_SIM
+    hwsim_cpu_irq_enable();
+#else
     uint32_t cpsr;
     asm("MRS %0, CPSR" : "=r" (cpsr));
     cpsr &= ~(1 << 7);
     asm("MSR CPSR_c, %0" :: "r" (cpsr));
+#endif
+}
+
+uint32_t irq_save(void){
+#ifdef HWREG_SIM
+    uint32_t state = hwsim_cpu_irq_masked();
+    hwsim_cpu_irq_disable();
+    return state;
+#else
+    uint32_t cpsr;
+    asm volatile("MRS %0, CPSR" : "=r" (cpsr));
+    asm volatile("CPSID i" ::: "memory");
+    return cpsr & (1 << 7);
+#endif
+}
+
+void irq_restore(uint32_t state){
+    if (!state) {
+#ifdef HWREG_SIM
+        hwsim_cpu_irq_enable();
+#else
+        asm volatile("CPSIE i" ::: "memory");
+#endif
+    }
 }
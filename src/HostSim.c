@@ -0,0 +1,1285 @@
+#ifdef HWREG_SIM
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "../include/BeagleBoneMaster.h"
+#include "../include/HostSim.h"
+#include "../include/MotorControllerLib.h"
+
+// Register offsets below are taken from the AM335x TRM and the PCA9685 datasheet, not from the
+// driver's config tables, so a wrong offset in the driver shows up as a wrong result here.
+
+// Peripheral blocks
+#define SIM_I2C1_BASE       0x4802A000
+#define SIM_TIMER4_BASE     0x48044000
+#define SIM_TIMER5_BASE     0x48046000
+#define SIM_GPIO1_BASE      0x4804C000
+#define SIM_INTC_BASE       0x48200000
+#define SIM_EDMA_BASE       0x49000000
+#define SIM_EDMA_SIZE       0x8000      // global registers, shadow regions and PaRAM
+#define SIM_BLOCK_SIZE      0x1000
+#define SIM_CM_PER_BASE     0x44E00000  // CM_PER, CM_WKUP and CM_DPLL share this block
+#define SIM_CLKSEL_TIMER4   0x44E00510
+#define SIM_CLKSEL_TIMER5   0x44E00518
+
+// CM_PER
+#define CM_I2C1_CLKCTRL     0x48
+#define CM_TIMER4_CLKCTRL   0x88
+#define CM_TIMER5_CLKCTRL   0xEC
+#define CM_MODULEMODE       0x3
+#define CM_MODULEMODE_EN    0x2
+#define CM_IDLEST_DISABLED  0x30000
+
+// I2C
+#define I2C_SYSC            0x10
+#define I2C_IRQSTATUS_RAW   0x24
+#define I2C_IRQSTATUS       0x28
+#define I2C_IRQENABLE_SET   0x2C
+#define I2C_IRQENABLE_CLR   0x30
+#define I2C_DMATXENABLE_SET 0x38
+#define I2C_DMATXENABLE_CLR 0x40
+#define I2C_SYSS            0x90
+#define I2C_BUF             0x94
+#define I2C_CNT             0x98
+#define I2C_DATA            0x9C
+#define I2C_CON             0xA4
+#define I2C_SA              0xAC
+#define I2C_PSC             0xB0
+#define I2C_SCLL            0xB4
+#define I2C_SCLH            0xB8
+#define I2C_SYSTEST         0xBC
+#define I2C_SYSC_SRST       0x0002
+#define I2C_ST_IO_MODE      0xB000      // ST_EN | TMODE = 3
+#define I2C_ST_SCL_I_FUNC   0x0100
+#define I2C_ST_SDA_I_FUNC   0x0040
+#define I2C_ST_SCL_O        0x0004
+#define I2C_ST_SDA_O        0x0001
+#define I2C_AL              0x0001
+#define I2C_NACK            0x0002
+#define I2C_ARDY            0x0004
+#define I2C_RRDY            0x0008
+#define I2C_XRDY            0x0010
+#define I2C_BF              0x0100
+#define I2C_BB              0x1000
+#define I2C_BUF_TXTRSH      0x3F
+#define I2C_BUF_TXFIFO_CLR  0x40
+#define I2C_BUF_XDMA_EN     0x80
+#define I2C_CON_STT         0x0001
+#define I2C_CON_STP         0x0002
+#define I2C_CON_TRX         0x0200
+#define I2C_CON_EN          0x8000
+#define I2C_FCLK_HZ         48000000
+#define I2C_FIFO_DEPTH      32
+
+// DMTimer
+#define TMR_IRQ_EOI         0x20
+#define TMR_IRQSTATUS_RAW   0x24
+#define TMR_IRQSTATUS       0x28
+#define TMR_IRQENABLE_SET   0x2C
+#define TMR_IRQENABLE_CLR   0x30
+#define TMR_TCLR            0x38
+#define TMR_TCRR            0x3C
+#define TMR_TLDR            0x40
+#define TMR_ST              0x1
+#define TMR_AR              0x2
+#define TMR_OVF             0x2
+#define TMR_CLK_M_OSC_HZ    24000000
+#define TMR_CLK_32K_HZ      32768
+
+// GPIO
+#define GPIO_SYSCONFIG      0x10
+#define GPIO_IRQSTATUS_RAW  0x24
+#define GPIO_IRQSTATUS      0x2C
+#define GPIO_IRQSTATUS_SET  0x34
+#define GPIO_IRQSTATUS_CLR  0x3C
+#define GPIO_DATAIN         0x138
+#define GPIO_RISINGDETECT   0x148
+#define GPIO_FALLINGDETECT  0x14C
+
+// EDMA3CC, channels 0..31 only
+#define EDMA_DCHMAP(n)      (0x100 + 4 * (n))
+#define EDMA_EMR            0x300
+#define EDMA_EMCR           0x308
+#define EDMA_ER             0x1000
+#define EDMA_ECR            0x1008
+#define EDMA_ESR            0x1010
+#define EDMA_EER            0x1020
+#define EDMA_EECR           0x1028
+#define EDMA_EESR           0x1030
+#define EDMA_SER            0x1038
+#define EDMA_SECR           0x1040
+#define EDMA_IER            0x1050
+#define EDMA_IECR           0x1058
+#define EDMA_IESR           0x1060
+#define EDMA_IPR            0x1068
+#define EDMA_ICR            0x1070
+#define EDMA_PARAM          0x4000
+#define EDMA_PARAM_SETS     256
+#define EDMA_CHANNELS       64
+#define EDMA_OPT_SYNCDIM    0x4
+#define EDMA_OPT_STATIC     0x8
+#define EDMA_OPT_TCINTEN    (1u << 20)
+#define EDMA_EVT_I2C1_TX    26
+#define EDMA_LINK_NULL      0xFFFF
+#define SIM_DMA_HANDLE      0x80000000u // hwsim_dma_addr() handles, one 4 KB window per region
+#define SIM_DMA_REGIONS     64
+
+// INTC
+#define INTC_SYSCONFIG      0x10
+#define INTC_SIR_IRQ        0x40
+#define INTC_CONTROL        0x48
+#define INTC_IRQ_PRIORITY   0x60
+#define INTC_THRESHOLD      0x68
+#define INTC_MIR(n)         (0x84u + 0x20u * (n))
+#define INTC_MIR_CLEAR(n)   (0x88u + 0x20u * (n))
+#define INTC_MIR_SET(n)     (0x8Cu + 0x20u * (n))
+#define INTC_ILR(m)         (0x100 + 4 * (m))
+#define INTC_LINES          128
+#define INTC_SPURIOUS       0xFFFFFF80
+#define IRQ_EDMACOMP        12
+#define IRQ_I2C1            71
+#define IRQ_TIMER5          93
+#define IRQ_GPIO1A          98
+
+// PCA9685
+#define PCA_MODE1           0x00
+#define PCA_MODE2           0x01
+#define PCA_SUBADR1         0x02
+#define PCA_ALLCALLADR      0x05
+#define PCA_LED0            0x06
+#define PCA_ALL_LED         0xFA
+#define PCA_PRE_SCALE       0xFE
+#define PCA_MODE1_ALLCALL   0x01
+#define PCA_MODE1_SLEEP     0x10
+#define PCA_MODE1_AI        0x20
+#define PCA_MODE2_OCH       0x08
+#define PCA_SWRST           0x06
+
+// CPU costs, a Cortex-A8 load/store to an L4 peripheral and one iteration of delay()
+#define SIM_READ_NS         100
+#define SIM_WRITE_NS        20
+#define SIM_NOP_NS          2
+#define SIM_IDLE_MAX_NS     1000000
+#define SIM_IRQ_STORM       10000
+
+void irq_director(void);
+
+hwsim_stats_t hwsim_stats;
+
+static uint64_t now_ns;
+static _Bool cpu_irq_enabled;
+static int irq_depth;
+static void (*output_hook)(const hwsim_pca_t *pca);
+static uint32_t forced_bus_khz;
+
+//Plain storage for every register without a model (clock and pad control, DEBOUNCE, ...)
+#define SIM_STORE_LEN 256
+static struct { uint32_t addr; uint32_t value; } store[SIM_STORE_LEN];
+static int store_len;
+
+static uint32_t *store_slot(uint32_t addr){
+    for (int i = 0; i < store_len; i++) {
+        if (store[i].addr == addr) return &store[i].value;
+    }
+    if (store_len == SIM_STORE_LEN) {
+        fprintf(stderr, "hwsim: register store full at 0x%08X\n", addr);
+        return &store[SIM_STORE_LEN - 1].value;
+    }
+    store[store_len].addr = addr;
+    store[store_len].value = 0;
+    return &store[store_len++].value;
+}
+
+/* ---------------------------------------------------------------- PCA9685 */
+
+static hwsim_pca_t pcas[HWSIM_PCA_MAX];
+static int pca_count;
+static _Bool pca_selected[HWSIM_PCA_MAX];
+static _Bool pca_expect_pointer;
+static _Bool general_call;
+
+static void pca_power_on(hwsim_pca_t *p){
+    memset(p->regs, 0, sizeof(p->regs));
+    p->regs[PCA_MODE1] = 0x11;      // SLEEP | ALLCALL
+    p->regs[PCA_MODE2] = 0x04;      // OUTDRV
+    p->regs[PCA_SUBADR1] = 0xE2;
+    p->regs[PCA_SUBADR1 + 1] = 0xE4;
+    p->regs[PCA_SUBADR1 + 2] = 0xE8;
+    p->regs[PCA_ALLCALLADR] = 0xE0;
+    for (int ch = 0; ch < 16; ch++) {
+        p->regs[PCA_LED0 + 4 * ch + 3] = 0x10;  // full off
+    }
+    p->regs[PCA_PRE_SCALE] = 0x1E;
+    p->pointer = 0;
+    memset(p->outputs, 0, sizeof(p->outputs));
+}
+
+// Channel level as the pin would show it
+static uint16_t pca_channel_level(const hwsim_pca_t *p, int ch){
+    const uint8_t *r = &p->regs[PCA_LED0 + 4 * ch];
+    uint16_t on = r[0] | (r[1] << 8);
+    uint16_t off = r[2] | (r[3] << 8);
+
+    if (p->regs[PCA_MODE1] & PCA_MODE1_SLEEP) return 0;
+    if (off & 0x1000) return 0;
+    if (on & 0x1000) return 4096;
+    return (uint16_t)((off - on) & 0x0FFF);
+}
+
+static void pca_latch_outputs(hwsim_pca_t *p){
+    _Bool changed = 0;
+    for (int ch = 0; ch < 16; ch++) {
+        uint16_t level = pca_channel_level(p, ch);
+        if (level != p->outputs[ch]) {
+            p->outputs[ch] = level;
+            changed = 1;
+        }
+    }
+    if (changed) {
+        p->output_updates++;
+        if (output_hook) output_hook(p);
+    }
+}
+
+static void pca_store(hwsim_pca_t *p, uint8_t reg, uint8_t value){
+    if (reg >= PCA_ALL_LED && reg < PCA_ALL_LED + 4) {
+        // ALL_LED writes land in every channel and read back as zero
+        for (int ch = 0; ch < 16; ch++) {
+            p->regs[PCA_LED0 + 4 * ch + (reg - PCA_ALL_LED)] = value;
+        }
+    } else if (reg == PCA_PRE_SCALE) {
+        // only writable while the oscillator is off
+        if (p->regs[PCA_MODE1] & PCA_MODE1_SLEEP) p->regs[reg] = value;
+    } else if (reg <= PCA_LED0 + 63 || reg == 0xFF) {
+        p->regs[reg] = value;
+    }
+}
+
+// Next register after an auto-increment access
+static uint8_t pca_next_pointer(uint8_t reg){
+    if (reg == PCA_LED0 + 63) return 0x00;
+    if (reg == 0xFF) return 0x00;
+    return reg + 1;
+}
+
+static _Bool pca_matches(const hwsim_pca_t *p, uint8_t address, _Bool read){
+    if (address == p->address) return 1;
+    if (read) return 0; // group addresses are write only
+    if ((p->regs[PCA_MODE1] & PCA_MODE1_ALLCALL) && address == (p->regs[PCA_ALLCALLADR] >> 1)) return 1;
+    for (int n = 0; n < 3; n++) {
+        if ((p->regs[PCA_MODE1] & (0x08 >> n)) && address == (p->regs[PCA_SUBADR1 + n] >> 1)) return 1;
+    }
+    return 0;
+}
+
+// Address phase, returns the number of devices that acknowledged
+static int pca_bus_start(uint8_t address, _Bool read){
+    int acks = 0;
+    general_call = (address == 0x00 && !read);
+    pca_expect_pointer = !read;
+    for (int i = 0; i < pca_count; i++) {
+        pca_selected[i] = general_call || pca_matches(&pcas[i], address, read);
+        acks += pca_selected[i];
+    }
+    return acks;
+}
+
+static void pca_bus_write(uint8_t byte){
+    for (int i = 0; i < pca_count; i++) {
+        hwsim_pca_t *p = &pcas[i];
+        if (!pca_selected[i]) continue;
+        if (general_call) {
+            if (byte == PCA_SWRST) pca_power_on(p);
+            continue;
+        }
+        if (pca_expect_pointer) {
+            p->pointer = byte;
+            continue;
+        }
+        pca_store(p, p->pointer, byte);
+        if (p->regs[PCA_MODE1] & PCA_MODE1_AI) p->pointer = pca_next_pointer(p->pointer);
+        if (p->regs[PCA_MODE2] & PCA_MODE2_OCH) pca_latch_outputs(p); // outputs change on ACK
+    }
+    pca_expect_pointer = 0;
+}
+
+static uint8_t pca_bus_read(void){
+    for (int i = 0; i < pca_count; i++) {
+        hwsim_pca_t *p = &pcas[i];
+        if (!pca_selected[i]) continue;
+        uint8_t byte = (p->pointer >= PCA_ALL_LED && p->pointer < PCA_ALL_LED + 4) ? 0 : p->regs[p->pointer];
+        if (p->regs[PCA_MODE1] & PCA_MODE1_AI) p->pointer = pca_next_pointer(p->pointer);
+        return byte;
+    }
+    return 0xFF;
+}
+
+static void pca_bus_stop(void){
+    for (int i = 0; i < pca_count; i++) {
+        if (pca_selected[i]) pca_latch_outputs(&pcas[i]); // outputs change on STOP
+        pca_selected[i] = 0;
+    }
+    general_call = 0;
+}
+
+/* ---------------------------------------------------------------- I2C1 */
+
+static struct {
+    uint32_t con, sa, cnt, psc, scll, sclh, buf;
+    uint32_t raw, enable;
+    uint32_t dma_tx;        // DMATXENABLE
+    _Bool busy;             // START issued, STOP not yet on the bus
+    _Bool transmit;
+    _Bool nacked;
+    uint32_t queued;        // bytes loaded into DATA, or clocked in when receiving
+    uint32_t done;          // data bytes finished on the bus
+    uint8_t fifo[I2C_FIFO_DEPTH];
+    uint32_t fifo_head, fifo_len;
+    uint64_t free_ns;       // end of the last scheduled bus activity
+    uint64_t next_ns;       // completion time of the byte at the FIFO head, or of the address
+    _Bool address_phase;
+    _Bool stop_due;
+    uint64_t stop_ns;
+    uint32_t systest;
+    _Bool scl_held;         // a slave stretches SCL and never lets go, STT is lost until SRST
+} i2c;
+
+// Injected faults, they belong to the bus and survive a module reset
+static uint32_t fault_nacks;        // frames left to NACK
+static uint32_t fault_sda_hold;     // SCL pulses until the stuck slave lets SDA go
+static uint32_t fault_scl_hold;     // frames left to wedge with SCL held low
+
+uint32_t hwsim_bus_khz(void){
+    if (forced_bus_khz) return forced_bus_khz;
+    // TRM: tLOW = (SCLL + 7) ICLK, tHIGH = (SCLH + 5) ICLK, ICLK = FCLK / (PSC + 1)
+    uint32_t cycles = (i2c.psc + 1) * (i2c.scll + 7 + i2c.sclh + 5);
+    return I2C_FCLK_HZ / cycles / 1000;
+}
+
+void hwsim_force_bus_khz(uint32_t khz){
+    forced_bus_khz = khz;
+}
+
+static uint64_t scl_ns(void){
+    uint32_t khz = hwsim_bus_khz();
+    return 1000000 / (khz ? khz : 1);
+}
+
+// Books 'clocks' SCL periods of bus time after whatever is already scheduled
+static uint64_t i2c_schedule(uint32_t clocks){
+    uint64_t start = i2c.free_ns > now_ns ? i2c.free_ns : now_ns;
+    uint64_t len = clocks * scl_ns();
+    i2c.free_ns = start + len;
+    hwsim_stats.bus_busy_ns += len;
+    return i2c.free_ns;
+}
+
+static void i2c_schedule_stop(void){
+    i2c.stop_due = 1;
+    i2c.stop_ns = i2c_schedule(1);
+}
+
+static void i2c_start(void){
+    uint8_t address = i2c.sa & 0x7F;
+    if (i2c.scl_held) return;       // waits for a bus that never goes free
+    if (fault_sda_hold) {
+        // SDA is already low, the START is lost and the module drops back to slave mode
+        i2c.raw |= I2C_AL;
+        i2c.busy = 0;
+        return;
+    }
+    i2c.transmit = (i2c.con & I2C_CON_TRX) != 0;
+    i2c.busy = 1;
+    i2c.nacked = 0;
+    i2c.queued = 0;
+    i2c.done = 0;
+    i2c.fifo_head = 0;
+    i2c.fifo_len = 0;
+    i2c.stop_due = 0;
+    i2c.raw &= ~(I2C_ARDY | I2C_NACK);
+    i2c.address_phase = 1;
+    i2c.next_ns = i2c_schedule(1 + 9);          // START + address byte
+    hwsim_stats.frames++;
+    hwsim_stats.bytes++;
+
+    if (fault_scl_hold) {
+        // The slave stretches the address byte's ACK clock, no ARDY, NACK or AL ever comes
+        fault_scl_hold--;
+        i2c.scl_held = 1;
+        return;
+    }
+    if (!pca_bus_start(address, !i2c.transmit)) {
+        i2c.nacked = 1;
+    }
+    if (fault_nacks) {
+        fault_nacks--;
+        pca_bus_stop();
+        i2c.nacked = 1;
+    }
+}
+
+static void i2c_finish_frame(void){
+    i2c.raw |= I2C_ARDY;
+    if (i2c.con & I2C_CON_STP) {
+        i2c_schedule_stop();
+    } else {
+        pca_expect_pointer = 0;   // repeated START keeps the pointer
+    }
+}
+
+// TX FIFO has room for TXTRSH + 1 bytes and the frame needs more, XRDY or the DMA request
+static _Bool i2c_tx_wants_data(void){
+    uint32_t threshold = (i2c.buf & I2C_BUF_TXTRSH) + 1;
+    return i2c.busy && i2c.transmit && !i2c.nacked && i2c.queued < i2c.cnt
+        && I2C_FIFO_DEPTH - i2c.fifo_len >= threshold;
+}
+
+// I2CTXEVT1 line to the EDMA
+static _Bool i2c_dma_tx_request(void){
+    return (i2c.buf & I2C_BUF_XDMA_EN) && (i2c.dma_tx & 0x1) && i2c_tx_wants_data();
+}
+
+// Brings the I2C1 model up to now_ns
+static void i2c_update(void){
+    for (;;) {
+        if (i2c.scl_held) break;
+        if (i2c.stop_due && now_ns >= i2c.stop_ns) {
+            i2c.stop_due = 0;
+            i2c.busy = 0;
+            i2c.raw |= I2C_BF;
+            pca_bus_stop();
+            continue;
+        }
+        if (!i2c.busy || i2c.stop_due) break;
+
+        if (i2c.address_phase) {
+            if (now_ns < i2c.next_ns) break;
+            i2c.address_phase = 0;
+            if (i2c.nacked) {
+                // master holds the bus until software writes STP
+                i2c.raw |= I2C_NACK;
+                hwsim_stats.nacks++;
+                break;
+            }
+            if (i2c.cnt == 0) {
+                i2c_finish_frame();
+                continue;
+            }
+            if (!i2c.transmit) {
+                i2c.next_ns = i2c_schedule(9);
+            } else if (i2c.fifo_len) {
+                i2c.next_ns = i2c_schedule(9);
+            }
+            continue;
+        }
+        if (i2c.nacked) break;
+
+        if (i2c.transmit) {
+            if (!i2c.fifo_len || now_ns < i2c.next_ns) break;
+            pca_bus_write(i2c.fifo[i2c.fifo_head]);
+            i2c.fifo_head = (i2c.fifo_head + 1) % I2C_FIFO_DEPTH;
+            i2c.fifo_len--;
+            i2c.done++;
+            hwsim_stats.bytes++;
+            if (i2c.done == i2c.cnt) {
+                i2c_finish_frame();
+            } else if (i2c.fifo_len) {
+                i2c.next_ns = i2c_schedule(9);
+            }
+        } else {
+            if (i2c.queued == i2c.cnt || i2c.fifo_len == I2C_FIFO_DEPTH || now_ns < i2c.next_ns) break;
+            i2c.fifo[(i2c.fifo_head + i2c.fifo_len) % I2C_FIFO_DEPTH] = pca_bus_read();
+            i2c.fifo_len++;
+            i2c.queued++;
+            hwsim_stats.bytes++;
+            if (i2c.queued == i2c.cnt) {
+                i2c_finish_frame();
+            } else {
+                i2c.next_ns = i2c_schedule(9);
+            }
+        }
+    }
+
+    // XRDY and RRDY are FIFO levels, they come back after a clear while the condition holds
+    if (i2c_tx_wants_data()) {
+        i2c.raw |= I2C_XRDY;
+    }
+    if (!i2c.transmit && i2c.fifo_len) {
+        i2c.raw |= I2C_RRDY;
+    }
+    i2c.raw = (i2c.raw & ~I2C_BB) | (i2c.busy ? I2C_BB : 0);
+}
+
+static uint64_t i2c_next_event(void){
+    if (i2c.scl_held) return UINT64_MAX;
+    if (i2c.stop_due) return i2c.stop_ns;
+    if (!i2c.busy || (i2c.nacked && !i2c.address_phase)) return UINT64_MAX;
+    if (i2c.address_phase) return i2c.next_ns;
+    if (i2c.transmit && !i2c.fifo_len) return UINT64_MAX;
+    if (!i2c.transmit && i2c.queued == i2c.cnt) return UINT64_MAX;
+    return i2c.next_ns;
+}
+
+static void i2c_data_write(uint8_t byte){
+    if (!i2c.busy || !i2c.transmit || i2c.fifo_len == I2C_FIFO_DEPTH || i2c.queued >= i2c.cnt) return;
+    i2c.fifo[(i2c.fifo_head + i2c.fifo_len) % I2C_FIFO_DEPTH] = byte;
+    // an idle shift register starts on this byte
+    if (!i2c.fifo_len && !i2c.address_phase) i2c.next_ns = i2c_schedule(9);
+    i2c.fifo_len++;
+    i2c.queued++;
+    i2c.raw &= ~I2C_XRDY;
+}
+
+static uint8_t i2c_data_read(void){
+    if (!i2c.fifo_len) return 0;
+    uint8_t byte = i2c.fifo[i2c.fifo_head];
+    i2c.fifo_head = (i2c.fifo_head + 1) % I2C_FIFO_DEPTH;
+    i2c.fifo_len--;
+    if (!i2c.fifo_len) i2c.raw &= ~I2C_RRDY;
+    return byte;
+}
+
+static void i2c_con_write(uint32_t value){
+    i2c.con = value;
+    if (!(value & I2C_CON_EN)) {
+        i2c.busy = 0;
+        i2c.stop_due = 0;
+        i2c.raw = 0;
+        return;
+    }
+    if (value & I2C_CON_STT) {
+        i2c_start();
+        i2c.con &= ~I2C_CON_STT;
+    } else if ((value & I2C_CON_STP) && i2c.busy && !i2c.stop_due) {
+        // software STOP, after a NACK or to end a frame early
+        i2c.fifo_len = 0;
+        i2c.address_phase = 0;
+        i2c_schedule_stop();
+    }
+}
+
+// SYSTEST with the pin levels, SCL follows SCL_O in IO mode, both are wired-AND with the stuck slave
+static uint32_t i2c_systest_read(void){
+    _Bool io = (i2c.systest & I2C_ST_IO_MODE) == I2C_ST_IO_MODE;
+    _Bool scl = (!io || (i2c.systest & I2C_ST_SCL_O)) && !i2c.scl_held;
+    _Bool sda = (!io || (i2c.systest & I2C_ST_SDA_O)) && !fault_sda_hold;
+    return i2c.systest | (scl ? I2C_ST_SCL_I_FUNC : 0) | (sda ? I2C_ST_SDA_I_FUNC : 0);
+}
+
+static void i2c_systest_write(uint32_t value){
+    _Bool io = (value & I2C_ST_IO_MODE) == I2C_ST_IO_MODE;
+    _Bool rising = io && (value & I2C_ST_SCL_O) && !(i2c.systest & I2C_ST_SCL_O);
+    if (rising && fault_sda_hold) fault_sda_hold--;
+    i2c.systest = value & ~(I2C_ST_SCL_I_FUNC | I2C_ST_SDA_I_FUNC);
+}
+
+// SYSC SRST, every register back to its reset value mid frame or not. Slaves never see a STOP
+static void i2c_soft_reset(void){
+    uint64_t free_ns = i2c.free_ns;
+    memset(&i2c, 0, sizeof(i2c));
+    i2c.free_ns = free_ns;
+    memset(pca_selected, 0, sizeof(pca_selected));
+    pca_expect_pointer = 0;
+}
+
+static uint32_t i2c_read(uint32_t offset){
+    switch (offset) {
+    case I2C_IRQSTATUS_RAW: return i2c.raw;
+    case I2C_IRQSTATUS: return i2c.raw & i2c.enable;
+    case I2C_IRQENABLE_SET:
+    case I2C_IRQENABLE_CLR: return i2c.enable;
+    case I2C_SYSS: return 0x1;   // reset done
+    case I2C_BUF: return i2c.buf;
+    case I2C_DMATXENABLE_SET:
+    case I2C_DMATXENABLE_CLR: return i2c.dma_tx;
+    case I2C_CNT: return i2c.cnt;
+    case I2C_DATA: return i2c_data_read();
+    case I2C_CON: return i2c.con;
+    case I2C_SA: return i2c.sa;
+    case I2C_PSC: return i2c.psc;
+    case I2C_SCLL: return i2c.scll;
+    case I2C_SCLH: return i2c.sclh;
+    case I2C_SYSTEST: return i2c_systest_read();
+    default: return *store_slot(SIM_I2C1_BASE + offset);
+    }
+}
+
+static void i2c_write(uint32_t offset, uint32_t value){
+    switch (offset) {
+    case I2C_IRQSTATUS_RAW: i2c.raw |= value & ~I2C_BB; break;
+    case I2C_IRQSTATUS: i2c.raw &= ~value | I2C_BB; break;
+    case I2C_IRQENABLE_SET: i2c.enable |= value; break;
+    case I2C_IRQENABLE_CLR: i2c.enable &= ~value; break;
+    case I2C_BUF:
+        if ((value & I2C_BUF_TXFIFO_CLR) && i2c.transmit) {
+            i2c.queued -= i2c.fifo_len;
+            i2c.fifo_len = 0;
+        }
+        i2c.buf = value & ~I2C_BUF_TXFIFO_CLR;  // self clearing
+        break;
+    case I2C_DMATXENABLE_SET: i2c.dma_tx |= value & 0x1; break;
+    case I2C_DMATXENABLE_CLR: i2c.dma_tx &= ~value; break;
+    case I2C_CNT: i2c.cnt = value & 0xFFFF; break;
+    case I2C_DATA: i2c_data_write((uint8_t)value); break;
+    case I2C_CON: i2c_con_write(value); break;
+    case I2C_SA: i2c.sa = value; break;
+    case I2C_PSC: i2c.psc = value & 0xFF; break;
+    case I2C_SCLL: i2c.scll = value & 0xFF; break;
+    case I2C_SCLH: i2c.sclh = value & 0xFF; break;
+    case I2C_SYSTEST: i2c_systest_write(value); break;
+    case I2C_SYSC:
+        if (value & I2C_SYSC_SRST) i2c_soft_reset();
+        *store_slot(SIM_I2C1_BASE + offset) = value & ~I2C_SYSC_SRST;
+        break;
+    default: *store_slot(SIM_I2C1_BASE + offset) = value; break;
+    }
+}
+
+/* ---------------------------------------------------------------- EDMA3 */
+
+static struct {
+    uint32_t er, eer, emr, ier, ipr;
+    uint32_t dchmap[EDMA_CHANNELS];
+    uint32_t param[EDMA_PARAM_SETS][8];     // OPT, SRC, A_B_CNT, DST, BIDX, LINK_BCNTRLD, CIDX, CCNT
+    _Bool i2c_tx_req;                       // I2C1 TX request seen and not yet served
+} edma;
+
+// Host memory the driver handed to DMA_ADDR()
+static const uint8_t *dma_regions[SIM_DMA_REGIONS];
+static int dma_region_count;
+
+uint32_t hwsim_dma_addr(const void *ptr){
+    const uint8_t *p = ptr;
+    for (int i = 0; i < dma_region_count; i++) {
+        if (p >= dma_regions[i] && p < dma_regions[i] + 0x1000) {
+            return SIM_DMA_HANDLE + 0x1000 * i + (uint32_t)(p - dma_regions[i]);
+        }
+    }
+    if (dma_region_count == SIM_DMA_REGIONS) {
+        fprintf(stderr, "hwsim: DMA address map full\n");
+        return 0;
+    }
+    dma_regions[dma_region_count] = p;
+    return SIM_DMA_HANDLE + 0x1000 * dma_region_count++;
+}
+
+static const uint8_t *dma_host_ptr(uint32_t addr){
+    uint32_t region = (addr - SIM_DMA_HANDLE) / 0x1000;
+    if (addr < SIM_DMA_HANDLE || region >= (uint32_t)dma_region_count) return NULL;
+    return dma_regions[region] + (addr & 0xFFF);
+}
+
+// One transfer request for channel ch: an ACNT array, or BCNT of them with SYNCDIM (AB-sync).
+// Bytes go through the register model so a destination of I2C1 DATA fills the FIFO
+static void edma_transfer(int ch){
+    uint32_t *set = edma.param[(edma.dchmap[ch] >> 5) & (EDMA_PARAM_SETS - 1)];
+    uint32_t opt = set[0];
+    uint32_t acnt = set[2] & 0xFFFF, bcnt = set[2] >> 16;
+    int16_t sbidx = (int16_t)(set[4] & 0xFFFF), dbidx = (int16_t)(set[4] >> 16);
+    int16_t scidx = (int16_t)(set[6] & 0xFFFF), dcidx = (int16_t)(set[6] >> 16);
+    uint32_t arrays = (opt & EDMA_OPT_SYNCDIM) ? bcnt : 1;
+
+    if (!acnt || !bcnt || !(set[7] & 0xFFFF)) {
+        edma.emr |= 1u << ch;       // null or spent set
+        return;
+    }
+    uint32_t src = set[1], dst = set[3];
+    for (uint32_t b = 0; b < arrays; b++) {
+        for (uint32_t a = 0; a < acnt; a++) {
+            const uint8_t *p = dma_host_ptr(src + b * sbidx + a);
+            uint32_t to = dst + b * dbidx + a;
+            if (to == SIM_I2C1_BASE + I2C_DATA) {
+                i2c_data_write(p ? *p : 0);
+            } else {
+                fprintf(stderr, "hwsim: EDMA write to unmodelled 0x%08X\n", to);
+            }
+            hwsim_stats.dma_bytes++;
+        }
+    }
+    hwsim_stats.dma_events++;
+
+    // Count and address updates, then the link once the set is used up
+    _Bool last = 1;
+    if (!(opt & EDMA_OPT_STATIC)) {
+        if (!(opt & EDMA_OPT_SYNCDIM) && bcnt > 1) {
+            set[1] = src + sbidx;
+            set[3] = dst + dbidx;
+            set[2] = (set[2] & 0xFFFF) | ((bcnt - 1) << 16);
+            last = 0;
+        } else if ((set[7] & 0xFFFF) > 1) {
+            set[1] = src + scidx;
+            set[3] = dst + dcidx;
+            set[2] = (set[2] & 0xFFFF) | (set[5] & 0xFFFF0000);     // BCNTRLD
+            set[7]--;
+            last = 0;
+        } else {
+            uint32_t link = set[5] & 0xFFFF;
+            if (link == EDMA_LINK_NULL) {
+                memset(set, 0, 8 * sizeof(uint32_t));
+                set[5] = EDMA_LINK_NULL;
+            } else {
+                memcpy(set, edma.param[((link - EDMA_PARAM) / 32) & (EDMA_PARAM_SETS - 1)], 8 * sizeof(uint32_t));
+            }
+        }
+    }
+    if (last && (opt & EDMA_OPT_TCINTEN)) edma.ipr |= 1u << ((opt >> 12) & 0x1F);
+}
+
+// Event from a peripheral or ESR, served at once when enabled, latched in ER otherwise
+static void edma_event(int ch){
+    uint32_t bit = 1u << ch;
+    if (edma.er & bit) {
+        edma.emr |= bit;
+        return;
+    }
+    if (edma.eer & bit) {
+        edma_transfer(ch);
+    } else {
+        edma.er |= bit;
+    }
+}
+
+// The request drops after each serviced burst and rises again while the FIFO has room
+static void edma_update(void){
+    for (int n = 0; n < I2C_FIFO_DEPTH && i2c_dma_tx_request() && !edma.i2c_tx_req; n++) {
+        uint32_t queued = i2c.queued;
+        edma.i2c_tx_req = 1;
+        edma_event(EDMA_EVT_I2C1_TX);
+        if (i2c.queued != queued) edma.i2c_tx_req = 0;
+    }
+    if (!i2c_dma_tx_request()) edma.i2c_tx_req = 0;
+}
+
+static uint32_t edma_read(uint32_t offset){
+    switch (offset) {
+    case EDMA_ER: return edma.er;
+    case EDMA_EER: return edma.eer;
+    case EDMA_EMR: return edma.emr;
+    case EDMA_IER: return edma.ier;
+    case EDMA_IPR: return edma.ipr;
+    default: break;
+    }
+    if (offset >= EDMA_DCHMAP(0) && offset < EDMA_DCHMAP(EDMA_CHANNELS)) {
+        return edma.dchmap[(offset - EDMA_DCHMAP(0)) / 4];
+    }
+    if (offset >= EDMA_PARAM && offset < EDMA_PARAM + 32 * EDMA_PARAM_SETS) {
+        return edma.param[(offset - EDMA_PARAM) / 32][(offset & 31) / 4];
+    }
+    return *store_slot(SIM_EDMA_BASE + offset);
+}
+
+static void edma_write(uint32_t offset, uint32_t value){
+    switch (offset) {
+    case EDMA_EMCR: edma.emr &= ~value; return;
+    case EDMA_ECR: edma.er &= ~value; return;
+    case EDMA_EECR: edma.eer &= ~value; return;
+    case EDMA_SECR: return;
+    case EDMA_IECR: edma.ier &= ~value; return;
+    case EDMA_IESR: edma.ier |= value; return;
+    case EDMA_ICR: edma.ipr &= ~value; return;
+    case EDMA_EESR:
+        edma.eer |= value;
+        // events latched while disabled are served now
+        for (int ch = 0; ch < 32; ch++) {
+            if (edma.er & edma.eer & (1u << ch)) {
+                edma.er &= ~(1u << ch);
+                edma_transfer(ch);
+            }
+        }
+        return;
+    case EDMA_ESR:
+        for (int ch = 0; ch < 32; ch++) {
+            if (value & (1u << ch)) edma_transfer(ch);    // manual trigger ignores EER
+        }
+        return;
+    default: break;
+    }
+    if (offset >= EDMA_DCHMAP(0) && offset < EDMA_DCHMAP(EDMA_CHANNELS)) {
+        edma.dchmap[(offset - EDMA_DCHMAP(0)) / 4] = value;
+        return;
+    }
+    if (offset >= EDMA_PARAM && offset < EDMA_PARAM + 32 * EDMA_PARAM_SETS) {
+        edma.param[(offset - EDMA_PARAM) / 32][(offset & 31) / 4] = value;
+        return;
+    }
+    *store_slot(SIM_EDMA_BASE + offset) = value;
+}
+
+/* ---------------------------------------------------------------- DMTimer5 */
+
+static struct {
+    uint32_t tclr, tldr, raw, enable;
+    uint32_t count0;        // TCRR at base_ns
+    uint64_t base_ns;
+} tmr;
+
+static uint64_t tmr_hz(void){
+    return (*store_slot(SIM_CLKSEL_TIMER5) & 0x3) == 0x2 ? TMR_CLK_32K_HZ : TMR_CLK_M_OSC_HZ;
+}
+
+static uint32_t tmr_count(void){
+    if (!(tmr.tclr & TMR_ST)) return tmr.count0;
+    return tmr.count0 + (uint32_t)((now_ns - tmr.base_ns) * tmr_hz() / 1000000000ull);
+}
+
+static uint64_t tmr_overflow_ns(void){
+    if (!(tmr.tclr & TMR_ST)) return UINT64_MAX;
+    uint64_t ticks = 0x100000000ull - tmr.count0;
+    return tmr.base_ns + (ticks * 1000000000ull + tmr_hz() - 1) / tmr_hz();
+}
+
+static void tmr_update(void){
+    uint64_t ovf;
+    while ((ovf = tmr_overflow_ns()) <= now_ns) {
+        tmr.raw |= TMR_OVF;
+        tmr.base_ns = ovf;
+        hwsim_stats.timer_overflows++;
+        hwsim_stats.last_overflow_ns = ovf;
+        if (tmr.tclr & TMR_AR) {
+            tmr.count0 = tmr.tldr;
+        } else {
+            tmr.count0 = 0;
+            tmr.tclr &= ~TMR_ST;
+        }
+    }
+}
+
+static uint32_t tmr_read(uint32_t offset){
+    switch (offset) {
+    case TMR_IRQSTATUS_RAW: return tmr.raw;
+    case TMR_IRQSTATUS: return tmr.raw & tmr.enable;
+    case TMR_IRQENABLE_SET:
+    case TMR_IRQENABLE_CLR: return tmr.enable;
+    case TMR_TCLR: return tmr.tclr;
+    case TMR_TCRR: return tmr_count();
+    case TMR_TLDR: return tmr.tldr;
+    default: return *store_slot(SIM_TIMER5_BASE + offset);
+    }
+}
+
+static void tmr_write(uint32_t offset, uint32_t value){
+    switch (offset) {
+    case TMR_IRQ_EOI: break;
+    case TMR_IRQSTATUS_RAW: tmr.raw |= value; break;
+    case TMR_IRQSTATUS: tmr.raw &= ~value; break;
+    case TMR_IRQENABLE_SET: tmr.enable |= value; break;
+    case TMR_IRQENABLE_CLR: tmr.enable &= ~value; break;
+    case TMR_TCLR:
+        tmr.count0 = tmr_count();
+        tmr.base_ns = now_ns;
+        tmr.tclr = value;
+        break;
+    case TMR_TCRR:
+        tmr.count0 = value;
+        tmr.base_ns = now_ns;
+        break;
+    case TMR_TLDR: tmr.tldr = value; break;
+    default: *store_slot(SIM_TIMER5_BASE + offset) = value; break;
+    }
+}
+
+/* ---------------------------------------------------------------- DMTimer4 */
+
+// Timestamp counter. Nothing waits on its overflow, so the count is worked out when it is read
+static struct {
+    uint32_t tclr, tldr;
+    uint32_t count0;        // TCRR at base_ns
+    uint64_t base_ns;
+} tmr4;
+
+static uint32_t tmr4_count(void){
+    if (!(tmr4.tclr & TMR_ST)) return tmr4.count0;
+    uint64_t hz = (*store_slot(SIM_CLKSEL_TIMER4) & 0x3) == 0x2 ? TMR_CLK_32K_HZ : TMR_CLK_M_OSC_HZ;
+    uint64_t ns = now_ns - tmr4.base_ns;
+    uint64_t ticks = ns / 1000000000ull * hz + ns % 1000000000ull * hz / 1000000000ull;
+    uint64_t to_overflow = 0x100000000ull - tmr4.count0;
+
+    if (ticks < to_overflow) return tmr4.count0 + (uint32_t)ticks;
+    if (!(tmr4.tclr & TMR_AR)) return 0;   // one shot, stopped at the overflow
+    return tmr4.tldr + (uint32_t)((ticks - to_overflow) % (0x100000000ull - tmr4.tldr));
+}
+
+static uint32_t tmr4_read(uint32_t offset){
+    switch (offset) {
+    case TMR_TCLR: return tmr4.tclr;
+    case TMR_TCRR: return tmr4_count();
+    case TMR_TLDR: return tmr4.tldr;
+    default: return *store_slot(SIM_TIMER4_BASE + offset);
+    }
+}
+
+static void tmr4_write(uint32_t offset, uint32_t value){
+    switch (offset) {
+    case TMR_TCLR:
+        tmr4.count0 = tmr4_count();
+        tmr4.base_ns = now_ns;
+        tmr4.tclr = value;
+        break;
+    case TMR_TCRR:
+        tmr4.count0 = value;
+        tmr4.base_ns = now_ns;
+        break;
+    case TMR_TLDR: tmr4.tldr = value; break;
+    default: *store_slot(SIM_TIMER4_BASE + offset) = value; break;
+    }
+}
+
+/* ---------------------------------------------------------------- GPIO1 */
+
+static struct {
+    uint32_t raw, enable, rising, falling, datain;
+} gpio;
+
+static uint32_t gpio_read(uint32_t offset){
+    switch (offset) {
+    case GPIO_IRQSTATUS_RAW: return gpio.raw;
+    case GPIO_IRQSTATUS: return gpio.raw & gpio.enable;
+    case GPIO_IRQSTATUS_SET:
+    case GPIO_IRQSTATUS_CLR: return gpio.enable;
+    case GPIO_DATAIN: return gpio.datain;
+    case GPIO_RISINGDETECT: return gpio.rising;
+    case GPIO_FALLINGDETECT: return gpio.falling;
+    default: return *store_slot(SIM_GPIO1_BASE + offset);
+    }
+}
+
+static void gpio_write(uint32_t offset, uint32_t value){
+    switch (offset) {
+    case GPIO_SYSCONFIG:
+        if (value & 0x2) {
+            uint32_t datain = gpio.datain;
+            memset(&gpio, 0, sizeof(gpio));
+            gpio.datain = datain;
+        }
+        break;
+    case GPIO_IRQSTATUS_RAW: gpio.raw |= value; break;
+    case GPIO_IRQSTATUS: gpio.raw &= ~value; break;
+    case GPIO_IRQSTATUS_SET: gpio.enable |= value; break;
+    case GPIO_IRQSTATUS_CLR: gpio.enable &= ~value; break;
+    case GPIO_DATAIN: break;
+    case GPIO_RISINGDETECT: gpio.rising = value; break;
+    case GPIO_FALLINGDETECT: gpio.falling = value; break;
+    default: *store_slot(SIM_GPIO1_BASE + offset) = value; break;
+    }
+}
+
+/* ---------------------------------------------------------------- INTC */
+
+static struct {
+    uint32_t mir[4];
+    uint32_t threshold;
+    uint8_t priority[INTC_LINES];
+    int active;             // line latched by the SIR_IRQ read, held until NEWIRQAGR
+} intc;
+
+static void intc_reset(void){
+    for (int n = 0; n < 4; n++) intc.mir[n] = 0xFFFFFFFF;
+    intc.threshold = 0xFF;
+    intc.active = -1;
+    memset(intc.priority, 0, sizeof(intc.priority));
+}
+
+static _Bool intc_line_raw(int line){
+    switch (line) {
+    case IRQ_EDMACOMP: return (edma.ipr & edma.ier) != 0;
+    case IRQ_I2C1: return (i2c.raw & i2c.enable) != 0;
+    case IRQ_TIMER5: return (tmr.raw & tmr.enable) != 0;
+    case IRQ_GPIO1A: return (gpio.raw & gpio.enable) != 0;
+    default: return 0;
+    }
+}
+
+// Highest priority pending, unmasked line that passes THRESHOLD, -1 for none
+static int intc_active(void){
+    int best = -1;
+    for (int line = 0; line < INTC_LINES; line++) {
+        if (intc.mir[line >> 5] & (1u << (line & 31))) continue;
+        if (!intc_line_raw(line)) continue;
+        if (intc.threshold != 0xFF && intc.priority[line] >= intc.threshold) continue;
+        if (best < 0 || intc.priority[line] < intc.priority[best]) best = line;
+    }
+    return best;
+}
+
+static uint32_t intc_read(uint32_t offset){
+    if (offset == INTC_SIR_IRQ) {
+        if (intc.active < 0) intc.active = intc_active();
+        return intc.active < 0 ? INTC_SPURIOUS : (uint32_t)intc.active;
+    }
+    if (offset == INTC_IRQ_PRIORITY) {
+        return intc.active < 0 ? INTC_SPURIOUS : intc.priority[intc.active];
+    }
+    if (offset == INTC_THRESHOLD) return intc.threshold;
+    for (int n = 0; n < 4; n++) {
+        if (offset == INTC_MIR(n)) return intc.mir[n];
+    }
+    if (offset >= INTC_ILR(0) && offset < INTC_ILR(INTC_LINES)) {
+        return intc.priority[(offset - INTC_ILR(0)) / 4] << 2;
+    }
+    return *store_slot(SIM_INTC_BASE + offset);
+}
+
+static void intc_write(uint32_t offset, uint32_t value){
+    if (offset == INTC_SYSCONFIG) {
+        if (value & 0x2) intc_reset();
+        return;
+    }
+    if (offset == INTC_THRESHOLD) {
+        intc.threshold = value & 0xFF;
+        return;
+    }
+    if (offset == INTC_CONTROL) {
+        if (value & 0x1) intc.active = -1; // NEWIRQAGR
+        return;
+    }
+    for (int n = 0; n < 4; n++) {
+        if (offset == INTC_MIR(n)) { intc.mir[n] = value; return; }
+        if (offset == INTC_MIR_CLEAR(n)) { intc.mir[n] &= ~value; return; }
+        if (offset == INTC_MIR_SET(n)) { intc.mir[n] |= value; return; }
+    }
+    if (offset >= INTC_ILR(0) && offset < INTC_ILR(INTC_LINES)) {
+        intc.priority[(offset - INTC_ILR(0)) / 4] = (value >> 2) & 0x3F;
+        return;
+    }
+    *store_slot(SIM_INTC_BASE + offset) = value;
+}
+
+/* ---------------------------------------------------------------- CM_PER */
+
+// MODULEMODE of the modules the driver gates, both off after reset as on the board
+static struct {
+    _Bool i2c1_on;
+    _Bool timer5_on;
+    _Bool timer4_on;
+} cm;
+
+static uint32_t cm_read(uint32_t offset){
+    switch (offset) {
+    case CM_I2C1_CLKCTRL: return *store_slot(SIM_CM_PER_BASE + offset) | (cm.i2c1_on ? 0 : CM_IDLEST_DISABLED);
+    case CM_TIMER5_CLKCTRL: return *store_slot(SIM_CM_PER_BASE + offset) | (cm.timer5_on ? 0 : CM_IDLEST_DISABLED);
+    case CM_TIMER4_CLKCTRL: return *store_slot(SIM_CM_PER_BASE + offset) | (cm.timer4_on ? 0 : CM_IDLEST_DISABLED);
+    default: return *store_slot(SIM_CM_PER_BASE + offset);
+    }
+}
+
+static void cm_write(uint32_t offset, uint32_t value){
+    *store_slot(SIM_CM_PER_BASE + offset) = value & CM_MODULEMODE;
+    if (offset == CM_I2C1_CLKCTRL) cm.i2c1_on = (value & CM_MODULEMODE) == CM_MODULEMODE_EN;
+    if (offset == CM_TIMER5_CLKCTRL) cm.timer5_on = (value & CM_MODULEMODE) == CM_MODULEMODE_EN;
+    if (offset == CM_TIMER4_CLKCTRL) cm.timer4_on = (value & CM_MODULEMODE) == CM_MODULEMODE_EN;
+}
+
+// An access to a module with its clock gated is a bus error on the board. It is counted and
+// dropped here, reads return 0
+static _Bool cm_gated(uint32_t block, uint32_t offset){
+    _Bool gated = (block == SIM_I2C1_BASE && !cm.i2c1_on) || (block == SIM_TIMER5_BASE && !cm.timer5_on)
+            || (block == SIM_TIMER4_BASE && !cm.timer4_on);
+    if (gated && hwsim_stats.gated_accesses++ == 0) {
+        fprintf(stderr, "hwsim: access to 0x%08X with its module clock gated\n", block + offset);
+    }
+    return gated;
+}
+
+/* ---------------------------------------------------------------- time and IRQs */
+
+static void update_models(void){
+    tmr_update();
+    i2c_update();
+    edma_update();
+}
+
+// IRQ output to the CPU, held low from the SIR_IRQ read until software writes NEWIRQAGR
+static _Bool intc_irq_asserted(void){
+    return intc.active < 0 && intc_active() >= 0;
+}
+
+// Takes pending interrupts the way the IRQ vector would. A handler that enables IRQs
+// (IRQ_NESTING) can be preempted here by a line the INTC still lets through
+static void dispatch_irqs(void){
+    int storm = 0;
+    while (cpu_irq_enabled && intc_irq_asserted()) {
+        if (++storm > SIM_IRQ_STORM) {
+            fprintf(stderr, "hwsim: IRQ %d never cleared, masking the CPU\n", intc_active());
+            cpu_irq_enabled = 0;
+            break;
+        }
+        cpu_irq_enabled = 0;    // IRQ mode entry sets the I bit
+        hwsim_stats.irqs++;
+        if (++irq_depth > (int)hwsim_stats.irq_depth_max) hwsim_stats.irq_depth_max = irq_depth;
+        irq_director();
+        irq_depth--;
+        cpu_irq_enabled = 1;    // SPSR restore on return
+        update_models();
+    }
+}
+
+static uint64_t next_event_ns(void){
+    uint64_t t = tmr_overflow_ns();
+    uint64_t e = i2c_next_event();
+    return e < t ? e : t;
+}
+
+void hwsim_advance_ns(uint64_t ns){
+    uint64_t target = now_ns + ns;
+    if (!cm.i2c1_on && !cm.timer5_on) hwsim_stats.clock_gated_ns += ns;
+    for (;;) {
+        uint64_t e = next_event_ns();
+        now_ns = e < target ? e : target;
+        update_models();
+        dispatch_irqs();
+        if (now_ns >= target) break;
+    }
+}
+
+uint64_t hwsim_time_ns(void){
+    return now_ns;
+}
+
+uint32_t hwreg_read(uint32_t addr){
+    uint32_t block = addr - SIM_EDMA_BASE < SIM_EDMA_SIZE ? SIM_EDMA_BASE : addr & ~(SIM_BLOCK_SIZE - 1);
+    uint32_t offset = addr & (SIM_BLOCK_SIZE - 1);
+
+    hwsim_advance_ns(SIM_READ_NS);
+    if (cm_gated(block, offset)) return 0;
+    switch (block) {
+    case SIM_CM_PER_BASE: return cm_read(offset);
+    case SIM_EDMA_BASE: return edma_read(addr - SIM_EDMA_BASE);
+    case SIM_I2C1_BASE: return i2c_read(offset);
+    case SIM_TIMER5_BASE: return tmr_read(offset);
+    case SIM_TIMER4_BASE: return tmr4_read(offset);
+    case SIM_GPIO1_BASE: return gpio_read(offset);
+    case SIM_INTC_BASE: return intc_read(offset);
+    default: return *store_slot(addr);
+    }
+}
+
+void hwreg_write(uint32_t addr, uint32_t value){
+    uint32_t block = addr - SIM_EDMA_BASE < SIM_EDMA_SIZE ? SIM_EDMA_BASE : addr & ~(SIM_BLOCK_SIZE - 1);
+    uint32_t offset = addr & (SIM_BLOCK_SIZE - 1);
+
+    hwsim_advance_ns(SIM_WRITE_NS);
+    if (cm_gated(block, offset)) return;
+    switch (block) {
+    case SIM_CM_PER_BASE: cm_write(offset, value); break;
+    case SIM_EDMA_BASE: edma_write(addr - SIM_EDMA_BASE, value); break;
+    case SIM_I2C1_BASE: i2c_write(offset, value); break;
+    case SIM_TIMER5_BASE: tmr_write(offset, value); break;
+    case SIM_TIMER4_BASE: tmr4_write(offset, value); break;
+    case SIM_GPIO1_BASE: gpio_write(offset, value); break;
+    case SIM_INTC_BASE: intc_write(offset, value); break;
+    default: *store_slot(addr) = value; break;
+    }
+    // a write can complete an event or raise a line, e.g. a STOP or an enable
+    update_models();
+    dispatch_irqs();
+}
+
+void hwsim_nop(void){
+    hwsim_stats.delay_cycles++;
+    now_ns += SIM_NOP_NS;
+    if (next_event_ns() <= now_ns) {
+        update_models();
+        dispatch_irqs();
+    }
+}
+
+void hwsim_idle(void){
+    uint64_t e = next_event_ns();
+    uint64_t step = SIM_IDLE_MAX_NS;
+    if (e > now_ns && e - now_ns < step) step = e - now_ns;
+    if (!step) step = 1;
+    hwsim_stats.sleep_ns += step;
+    hwsim_advance_ns(step);
+}
+
+void hwsim_cpu_irq_enable(void){
+    cpu_irq_enabled = 1;
+    dispatch_irqs();
+}
+
+void hwsim_cpu_irq_disable(void){
+    cpu_irq_enabled = 0;
+}
+
+int hwsim_cpu_irq_masked(void){
+    return !cpu_irq_enabled;
+}
+
+/* ---------------------------------------------------------------- harness */
+
+void hwsim_reset(void){
+    now_ns = 0;
+    cpu_irq_enabled = 0;
+    irq_depth = 0;
+    forced_bus_khz = 0;
+    store_len = 0;
+    pca_count = 0;
+    memset(&hwsim_stats, 0, sizeof(hwsim_stats));
+    memset(&i2c, 0, sizeof(i2c));
+    memset(&tmr, 0, sizeof(tmr));
+    memset(&tmr4, 0, sizeof(tmr4));
+    memset(&gpio, 0, sizeof(gpio));
+    memset(&edma, 0, sizeof(edma));
+    memset(&cm, 0, sizeof(cm));
+    fault_nacks = 0;
+    fault_sda_hold = 0;
+    fault_scl_hold = 0;
+    dma_region_count = 0;
+    memset(pca_selected, 0, sizeof(pca_selected));
+    intc_reset();
+}
+
+hwsim_pca_t *hwsim_add_pca(uint8_t address){
+    if (pca_count == HWSIM_PCA_MAX) return NULL;
+    hwsim_pca_t *p = &pcas[pca_count++];
+    memset(p, 0, sizeof(*p));
+    p->address = address & 0x7F;
+    pca_power_on(p);
+    return p;
+}
+
+hwsim_pca_t *hwsim_pca(int index){
+    return (index >= 0 && index < pca_count) ? &pcas[index] : NULL;
+}
+
+void hwsim_pca_power_cycle(hwsim_pca_t *pca){
+    pca_power_on(pca);
+    pca_latch_outputs(pca);
+}
+
+void hwsim_i2c_nack_frames(uint32_t frames){
+    fault_nacks = frames;
+}
+
+void hwsim_i2c_hold_sda(uint32_t pulses){
+    fault_sda_hold = pulses;
+}
+
+void hwsim_i2c_hold_scl(uint32_t frames){
+    fault_scl_hold = frames;
+}
+
+void hwsim_gpio1_set_input(uint32_t pin_mask, int level){
+    uint32_t old = gpio.datain;
+    gpio.datain = level ? (old | pin_mask) : (old & ~pin_mask);
+    uint32_t rose = ~old & gpio.datain;
+    uint32_t fell = old & ~gpio.datain;
+    gpio.raw |= (rose & gpio.rising) | (fell & gpio.falling);
+    dispatch_irqs();
+}
+
+uint8_t hwsim_coil_pattern(const hwsim_pca_t *pca){
+    // The MOTOR_PORT channels of the driver's register map, AIN1 = LED4 .. BIN2 = LED6 on M3/M4,
+    // high when fully on
+    return (pca->outputs[PCA_CHANNEL(PCA_Controller.AIN1_ON)] == 4096) << AIN1
+         | (pca->outputs[PCA_CHANNEL(PCA_Controller.AIN2_ON)] == 4096) << AIN2
+         | (pca->outputs[PCA_CHANNEL(PCA_Controller.BIN1_ON)] == 4096) << BIN1
+         | (pca->outputs[PCA_CHANNEL(PCA_Controller.BIN2_ON)] == 4096) << BIN2;
+}
+
+void hwsim_set_output_hook(void (*hook)(const hwsim_pca_t *pca)){
+    output_hook = hook;
+}
+
+#endif
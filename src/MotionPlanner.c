@@ -0,0 +1,107 @@
+/*
+ * Acceleration planner for the stepper motor.
+ *
+ * The ramp is found by integrating jerk -> acceleration -> velocity -> position once per
+ * Timer5 tick in fixed point, and recording the tick at which each whole step is crossed:
+ *
+ *   a: steps/s^2, Q16     v: steps/s, Q16     x: steps, Q32
+ *
+ * With a jerk limit the acceleration rises at `jerk` until it reaches `accel`, and starts to
+ * fall again once the velocity still to gain equals a^2 / (2 * jerk), so it reaches zero as the
+ * velocity reaches max_velocity. Without a jerk limit the acceleration is constant (trapezoid).
+ * This runs when a profile is built, never from the step ISR.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "../include/BeagleBoneMaster.h"
+#include "../include/MotionPlanner.h"
+
+static uint16_t clamp_ticks(uint64_t ticks){
+    if (ticks == 0) return 1;
+    return ticks > 0xFFFF ? 0xFFFF : (uint16_t)ticks;
+}
+
+int planner_build_profile(motion_profile_t *profile, uint32_t max_velocity, uint32_t accel, uint32_t jerk){
+    const uint64_t freq = Timer5.CLK_FREQ;
+    const uint64_t tick_limit = freq * 16; // a ramp longer than 16 s is not a useful profile
+
+    if (max_velocity == 0 || accel == 0) return -1;
+
+    uint64_t vmax = (uint64_t)max_velocity << 16;
+    uint64_t amax = (uint64_t)accel << 16;
+    uint64_t jstep = ((uint64_t)jerk << 16) / freq; // acceleration change per tick
+    uint64_t a = jerk ? 0 : amax;
+    uint64_t v = 0;
+    uint64_t x = 0;
+    uint64_t next_step = 1ULL << 32;
+    uint64_t last_tick = 0;
+    _Bool easing = false;
+    uint16_t n = 0;
+
+    if (jerk && jstep == 0) jstep = 1;
+    profile->cruise = clamp_ticks(freq / max_velocity);
+
+    for (uint64_t tick = 1; tick < tick_limit && n < PLANNER_RAMP_MAX; tick++) {
+        if (jerk) {
+            uint64_t ease = ((a >> 8) * (a >> 8)) / (2 * (uint64_t)jerk);
+            if (vmax - v <= ease) {
+                easing = true;
+                a = (a > jstep) ? a - jstep : 0;
+            } else if (a < amax) {
+                a = (a + jstep > amax) ? amax : a + jstep;
+            }
+        }
+        v += a / freq;
+        if (v > vmax) v = vmax;
+        x += (v << 16) / freq;
+
+        while (x >= next_step && n < PLANNER_RAMP_MAX) {
+            profile->ramp[n++] = clamp_ticks(tick - last_tick);
+            last_tick = tick;
+            next_step += 1ULL << 32;
+        }
+        if (v >= vmax || (easing && a == 0)) break;
+    }
+    profile->ramp_len = n;
+
+    // Ran out of table before reaching max velocity, cruise at the last ramp speed
+    if (n && profile->ramp[n - 1] > profile->cruise) {
+        profile->cruise = profile->ramp[n - 1];
+    }
+    return 0;
+}
+
+void planner_constant_profile(motion_profile_t *profile, uint32_t steps_per_sec){
+    profile->ramp_len = 0;
+    profile->cruise = clamp_ticks(timer5_rate_to_ticks(steps_per_sec));
+}
+
+void planner_begin_move(motion_move_t *move, const motion_profile_t *profile, uint32_t steps){
+    move->profile = profile;
+    move->steps = steps;
+    move->ramp = profile->ramp_len < steps / 2 ? profile->ramp_len : steps / 2;
+    // Short moves never reach cruise, the middle steps run at the fastest ramp speed reached
+    move->peak = move->ramp < profile->ramp_len ? profile->ramp[move->ramp] : profile->cruise;
+}
+
+uint32_t planner_interval(const motion_move_t *move, uint32_t step){
+    uint32_t from_end = move->steps - 1 - step;
+
+    if (step < move->ramp) return move->profile->ramp[step];
+    if (from_end < move->ramp) return move->profile->ramp[from_end];
+    return move->peak;
+}
+
+uint32_t planner_move_ticks(const motion_profile_t *profile, uint32_t steps){
+    motion_move_t move;
+    uint32_t total = 0;
+
+    planner_begin_move(&move, profile, steps);
+    for (uint32_t i = 0; i < steps; i++) {
+        total += planner_interval(&move, i);
+    }
+    return total;
+}
@@ -32,118 +32,1218 @@
 #include <stdbool.h>
 #include "../include/BeagleBoneMaster.h"
 #include "../include/MotorControllerLib.h"
+#include "../include/Profiler.h"
+#include "../include/Trace.h"
 
 
-const PCAConfig_t PCA_Controller = {
-    .ADDRESS = 0x70, // Adjusted for 7-bit addressing
-    .PRE_SCALE = 0xFE,
-    .ALL_LED_OFF_H = 0xFD,
-    .RESET = 0x06,
-    //Motor H-Bridge Signal Line Addresses
-    .AIN1_ON = 0x17,
-    .AIN1_OFF = 0x19,
-    .AIN2_ON = 0x13,
-    .AIN2_OFF = 0x15,
-    .BIN1_ON = 0x1B,
-    .BIN1_OFF = 0x1D,
-    .BIN2_ON = 0x1F,
-    .BIN2_OFF = 0x21,
-    //LED2 and LED7 need to be turned on for H-Bridge to be enabled
-    .LED2_ON_H = 0x0F,
-    .LED7_ON_H = 0x23,
-    //Mode control regs
-    .MODE1_REG = 0x00,
-    .MODE2_REG = 0x01,
-    //Internal Oscillator, turns on
-    .MODE1_OSC_BIT_CLEAR = 0x01,
-    //Turn off PWM functionality
-    .DISABLE_PWM = 0x10,
-    //Stepper Motor Step Sequence
-    .STEP1 = 0x05,
-    .STEP2 = 0x09,
-    .STEP3 = 0x0A,
-    .STEP4 = 0x06,
-    //Turns on signal line
-    .PWM_OUTPUT_ENABLE = 0x10,
-    //Turns off signal line
-    .PWM_OUTPUT_DISABLE = 0x00
-};
+pca_bus_stats_t pca_stats;
+pca_verify_stats_t pca_verify_stats;
+
+static _Bool pca_atomic;
+
+//Two-phase full step sequence, STEP1..STEP4 of the truth table above
+static const uint8_t full_sequence[4] = {0x05, 0x09, 0x0A, 0x06};
+
+//The board the motor functions drive. Its shadow is the in-RAM copy of the PCA9685 register file
+pca_dev_t pca_default = {.address = PCA_ADDRESS};
+
+//Every board with a shadow, so a general call reset can reload them all
+static pca_dev_t *pca_devices[PCA_DEVICES_MAX] = {&pca_default};
+static uint8_t pca_device_count = 1;
+
+#define PCA_SUBADR1 0x02
+#define PCA_ALLCALLADR 0x05
+#define PCA_MODE1_SUB1 0x08     // SUB2 and SUB3 are the next bits down
+#define PCA_MODE1_ALLCALL 0x01
+#define PCA_ALL_LED_ON_L 0xFA
+
+//Stepper ports of the Motor FeatherWing, PWMA/AIN2/AIN1/BIN1/BIN2/PWMB
+const motor_channels_t MotorPortM3M4 = MOTOR_CHANNELS(MOTOR_PORT_M3M4);
+const motor_channels_t MotorPortM1M2 = MOTOR_CHANNELS(MOTOR_PORT_M1M2);
+
+static _Bool pca_shadow_is_valid(const pca_dev_t *dev, uint8_t reg){
+    return dev->shadow_valid[reg >> 3] & (1 << (reg & 0x7));
+}
+
+static _Bool pca_shadow_differs(const pca_dev_t *dev, uint8_t reg, uint8_t value){
+    return !pca_shadow_is_valid(dev, reg) || dev->shadow[reg] != value;
+}
+
+//Records a register write. ALL_LED_* writes land in the matching register of all 16 channels and
+//are never cached themselves since they read back as zero
+static void pca_shadow_update(pca_dev_t *dev, uint8_t reg, uint8_t value){
+    if (reg >= PCA_ALL_LED_ON_L && reg < PCA_ALL_LED_ON_L + 4) {
+        for (uint8_t led = 0; led < 16; led++) {
+            uint8_t target = PCA_LED0_ON_L + (led * 4) + (reg - PCA_ALL_LED_ON_L);
+            dev->shadow[target] = value;
+            dev->shadow_valid[target >> 3] |= (1 << (target & 0x7));
+        }
+        return;
+    }
+    dev->shadow[reg] = value;
+    dev->shadow_valid[reg >> 3] |= (1 << (reg & 0x7));
+    if (reg == PCA_Controller.MODE1_REG) dev->auto_inc = (value & PCA_Controller.MODE1_AUTO_INC) != 0;
+}
+
+static const uint8_t pca_subadr_defaults[3] = {0xE2, 0xE4, 0xE8};
+
+//PCA9685 power-on value of a register
+static uint8_t pca_power_on_value(uint8_t reg){
+    if (reg == PCA_Controller.MODE1_REG) return 0x11;         // SLEEP | ALLCALL
+    if (reg == PCA_Controller.MODE2_REG) return 0x04;         // OUTDRV
+    if (reg >= PCA_SUBADR1 && reg < PCA_SUBADR1 + 3) return pca_subadr_defaults[reg - PCA_SUBADR1];
+    if (reg == PCA_ALLCALLADR) return 0xE0;
+    if (reg == PCA_Controller.PRE_SCALE) return 0x1E;
+    if (reg >= PCA_LED0_ON_L && reg < PCA_LED_ON_L(16) && (reg & 0x3) == 0x1) return 0x10; // LEDn_OFF_H, full off
+    return 0x00;
+}
+
+//Loads the PCA9685 power-on register values, used after a software reset
+static void pca_shadow_load_defaults(pca_dev_t *dev){
+    for (int reg = 0; reg < PCA_REG_COUNT; reg++) {
+        dev->shadow_valid[reg >> 3] = 0x00;
+    }
+    for (uint8_t reg = 0; reg < PCA_ALL_LED_ON_L; reg++) {
+        pca_shadow_update(dev, reg, pca_power_on_value(reg));
+    }
+    pca_shadow_update(dev, PCA_Controller.PRE_SCALE, pca_power_on_value(PCA_Controller.PRE_SCALE));
+}
 
-void motor_init(void){
-    // Prescale value for PWM frequency
-    uint8_t prescl = 0x5;
-    pca_write_byte(PCA_Controller.PRE_SCALE, prescl);
-    delay(5000);
-    pca_write_byte(PCA_Controller.MODE1_REG, PCA_Controller.MODE1_OSC_BIT_CLEAR);
-    delay(5000);
+//Writes already present in the shadow are skipped, call pca_shadow_invalidate() first to force a resync
+int motor_init(void){
+    int err;
+    // Prescale value for PWM frequency, written while the oscillator still sleeps after reset
+    uint8_t prescl = calc_prescale(PCA_Controller.OSC_CLK_MHZ, PCA_Controller.PWM_RATE_KHZ);
+    if ((err = pca_write_byte_cached(PCA_Controller.PRE_SCALE, prescl)) < 0) return err;
+    if ((err = pca_write_byte_cached(PCA_Controller.MODE1_REG, PCA_Controller.MODE1_OSC_BIT_CLEAR | PCA_Controller.MODE1_AUTO_INC)) < 0) return err;
     // Disable all PWM outputs
-    pca_write_byte(PCA_Controller.ALL_LED_OFF_H, 0x00);
-    delay(5000);
+    if ((err = pca_write_byte(PCA_Controller.ALL_LED_OFF_H, 0x00)) < 0) return err;
     //LED2 is at address 0x0F
-    pca_write_byte(PCA_Controller.LED2_ON_H, PCA_Controller.PWM_OUTPUT_ENABLE); 
-    delay(5000);
+    if ((err = pca_write_byte_cached(PCA_Controller.LED2_ON_H, PCA_Controller.PWM_OUTPUT_ENABLE)) < 0) return err;
     //LED7 is at address 0x23
-    pca_write_byte(PCA_Controller.LED7_ON_H, PCA_Controller.PWM_OUTPUT_ENABLE); 
-    delay(5000);
+    if ((err = pca_write_byte_cached(PCA_Controller.LED7_ON_H, PCA_Controller.PWM_OUTPUT_ENABLE)) < 0) return err;
+    //Coil patterns switch at STOP, never one register at a time
+    if ((err = motor_set_atomic(1)) < 0) return err;
+    //Step frames and coil pattern for full step mode
+    return motor_set_drive_mode(DRIVE_FULL);
+}
+
+//Sets up a board at a 7 bit address with nothing in its shadow. Returns -1 if PCA_DEVICES_MAX are in use
+int pca_dev_init(pca_dev_t *dev, uint8_t address){
+    uint8_t i = 0;
+
+    while (i < pca_device_count && pca_devices[i] != dev) i++;
+    if (i == pca_device_count) {
+        if (pca_device_count == PCA_DEVICES_MAX) return -1;
+        pca_devices[pca_device_count++] = dev;
+    }
+    dev->address = address;
+    dev->auto_inc = 0;
+    pca_dev_shadow_invalidate(dev);
+    return I2C_OK;
+}
+
+//Forgets everything the shadow knows, the next cached writes all go out on the bus
+void pca_dev_shadow_invalidate(pca_dev_t *dev){
+    for (int i = 0; i < PCA_REG_COUNT / 8; i++) {
+        dev->shadow_valid[i] = 0x00;
+    }
+}
+
+void pca_shadow_invalidate(void){
+    pca_dev_shadow_invalidate(&pca_default);
+}
+
+//Returns 1 if the write was sent, 0 if the shadow already held the value, or an i2c_status_t error
+int pca_dev_write_byte_cached(pca_dev_t *dev, uint8_t ctrl_reg, uint8_t value){
+    if (!pca_shadow_differs(dev, ctrl_reg, value)) {
+        return 0;
+    }
+    int err = pca_dev_write_byte(dev, ctrl_reg, value);
+    return err ? err : 1;
+}
+
+int pca_write_byte_cached(uint8_t ctrl_reg, uint8_t value){
+    return pca_dev_write_byte_cached(&pca_default, ctrl_reg, value);
+}
+
+//Sends the smallest contiguous range of block that differs from the shadow. Returns data bytes sent or an error
+int pca_dev_write_block(pca_dev_t *dev, uint8_t start_reg, const uint8_t *block, uint8_t len){
+    int first = -1;
+    int last = -1;
+
+    for (int i = 0; i < len; i++) {
+        if (pca_shadow_differs(dev, start_reg + i, block[i])) {
+            if (first < 0) first = i;
+            last = i;
+        }
+    }
+    if (first < 0) {
+        return 0;
+    }
+
+    int err = pca_dev_write_burst(dev, start_reg + first, &block[first], last - first + 1);
+    return err ? err : last - first + 1;
+}
+
+int pca_write_block(uint8_t start_reg, const uint8_t *block, uint8_t len){
+    return pca_dev_write_block(&pca_default, start_reg, block, len);
+}
+
+//Sends every register of block that differs from the shadow. Dirty runs up to PCA_MERGE_GAP clean
+//registers apart share a burst: a resent byte costs 9 SCL clocks, a new frame about 20 for
+//START, address, register byte and STOP. Returns data bytes sent or an error
+int pca_write_sparse(uint8_t start_reg, const uint8_t *block, uint8_t len){
+    int sent = 0;
+    int i = 0;
+
+    while (i < len) {
+        if (!pca_shadow_differs(&pca_default, start_reg + i, block[i])) {
+            i++;
+            continue;
+        }
+        int first = i;
+        int last = i;
+        // Atomic mode keeps everything that fits one frame together, it all latches on one STOP
+        int gap = pca_atomic ? PCA_BURST_MAX : PCA_MERGE_GAP;
+        for (int j = i + 1; j < len && j - first < PCA_BURST_MAX && j - last - 1 <= gap; j++) {
+            if (pca_shadow_differs(&pca_default, start_reg + j, block[j])) last = j;
+        }
+        int err = pca_write_burst(start_reg + first, &block[first], last - first + 1);
+        if (err) return err;
+        sent += last - first + 1;
+        i = last + 1;
+    }
+    return sent;
+}
+
+static _Bool pca_recovering;
+
+//Every PCA frame goes out here: queued when the interrupt driven engine runs, polled otherwise.
+//A queued frame counts as written, bus errors then only show up in i2c_tx_errors. A polled
+//frame the bus tiers can't get through rebuilds the boards from their shadows and goes once more.
+//The trace records a frame with the status it ended on, after any frames a rebuild sent
+static int pca_transmit(uint8_t address, const uint8_t *frame, uint32_t len){
+    int err;
+
+    if (I2C_tx_engine_running()) {
+        err = I2C_tx_enqueue(address, frame, len);
+    } else {
+        err = I2C_write_recover(address, frame, len);
+        if (err && !pca_recovering && motor_recover() == I2C_OK) {
+            err = I2C_write(address, frame, len);
+        }
+    }
+    TRACE_FRAME(address, frame, len, err);
+    return err;
+}
+
+int pca_dev_write_byte(pca_dev_t *dev, uint8_t ctrl_reg, uint8_t value){
+    uint8_t frame[2] = {ctrl_reg, value};
+
+    PROF_BEGIN(write_start);
+    int err = pca_transmit(dev->address, frame, 2);
+    if (!err) {
+        pca_shadow_update(dev, ctrl_reg, value);
+    }
+    pca_stats.transactions++;
+    pca_stats.bytes += 3; // address, register, value
+    PROF_END(PROF_PCA_WRITE_BYTE, write_start);
+    return err;
+}
+
+
+static _Bool pca_auto_inc(pca_dev_t *const *devs, uint8_t count){
+    for (uint8_t d = 0; d < count; d++) {
+        if (!devs[d]->auto_inc) return 0;
+    }
+    return 1;
+}
+
+//Sends a ready frame (register byte then data) to address and records it in the shadow of
+//every board that answers it. Without MODE1 AI on every one of them all data bytes would land in
+//the first register, the frame then goes out one register at a time
+static int pca_send(uint8_t address, pca_dev_t *const *devs, uint8_t count, const uint8_t *frame, uint8_t len){
+    if (len > 2 && !pca_auto_inc(devs, count)) {
+        for (uint8_t i = 1; i < len; i++) {
+            uint8_t single[2] = {frame[0] + i - 1, frame[i]};
+            int err = pca_send(address, devs, count, single, 2);
+            if (err) return err;
+        }
+        return I2C_OK;
+    }
+    int err = pca_transmit(address, frame, len);
+    if (!err) {
+        for (uint8_t d = 0; d < count; d++) {
+            for (uint8_t i = 1; i < len; i++) {
+                pca_shadow_update(devs[d], frame[0] + i - 1, frame[i]);
+            }
+        }
+    }
+    pca_stats.transactions++;
+    pca_stats.bytes += len + 1;
+    return err;
+}
+
+//Register byte followed by up to PCA_BURST_MAX data bytes, returns the frame length
+static uint8_t pca_build_burst(uint8_t *frame, uint8_t start_reg, const uint8_t *data, uint8_t len){
+    if (len > PCA_BURST_MAX) len = PCA_BURST_MAX;
+    frame[0] = start_reg;
+    for (uint8_t i = 0; i < len; i++) {
+        frame[i + 1] = data[i];
+    }
+    return len + 1;
+}
+
+//Writes len bytes starting at start_reg in a single START/address/data.../STOP frame, one frame
+//per register while the board doesn't have MODE1 auto-increment on
+int pca_dev_write_burst(pca_dev_t *dev, uint8_t start_reg, const uint8_t *data, uint8_t len){
+    uint8_t frame[PCA_BURST_MAX + 1];
+    uint8_t frame_len = pca_build_burst(frame, start_reg, data, len);
+    return pca_send(dev->address, &dev, 1, frame, frame_len);
+}
+
+int pca_write_burst(uint8_t start_reg, const uint8_t *data, uint8_t len){
+    return pca_dev_write_burst(&pca_default, start_reg, data, len);
+}
+
+int pca_write_frame(const pca_frame_t *frame){
+    pca_dev_t *dev = &pca_default;
+    return pca_send(dev->address, &dev, 1, frame->data, frame->len);
+}
+
+static int pca_dev_read(pca_dev_t *dev, uint8_t start_reg, uint8_t *buf, uint8_t len){
+    int err = I2C_write_read(dev->address, &start_reg, 1, buf, len);
+    pca_stats.transactions++;
+    pca_stats.bytes += len + 3; // address, register, address again, data
+    return err;
+}
+
+//Reads len registers from start_reg in one combined frame: register byte, repeated START, data.
+//That needs MODE1 auto-increment, MODE1 is read first if the shadow doesn't know it. A board
+//without it, e.g. one that was just reset, is read one register per frame
+int pca_dev_read_block(pca_dev_t *dev, uint8_t start_reg, uint8_t *buf, uint8_t len){
+    uint8_t mode1 = dev->shadow[PCA_Controller.MODE1_REG];
+    int err;
+
+    if (len > 1 && !pca_shadow_is_valid(dev, PCA_Controller.MODE1_REG)) {
+        if ((err = pca_dev_read(dev, PCA_Controller.MODE1_REG, &mode1, 1)) < 0) return err;
+    }
+    if (len <= 1 || (mode1 & PCA_Controller.MODE1_AUTO_INC)) {
+        return pca_dev_read(dev, start_reg, buf, len);
+    }
+    for (uint8_t i = 0; i < len; i++) {
+        if ((err = pca_dev_read(dev, start_reg + i, &buf[i], 1)) < 0) return err;
+    }
+    return I2C_OK;
+}
+
+//Registers the shadow knows that read back different, counted in pca_verify_stats
+static int pca_dev_compare(pca_dev_t *dev, uint8_t start_reg, const uint8_t *regs, uint8_t len){
+    int mismatches = 0;
+
+    for (uint8_t i = 0; i < len; i++) {
+        uint8_t reg = start_reg + i;
+        uint8_t value = regs[i];
+        if (!pca_shadow_is_valid(dev, reg)) continue;
+        if (reg == PCA_Controller.MODE1_REG) {
+            // RESTART reads 1 after a sleep with PWM running, whatever was written
+            value = (value & ~PCA_Controller.MODE1_RESTART) | (dev->shadow[reg] & PCA_Controller.MODE1_RESTART);
+        }
+        if (dev->shadow[reg] == value) continue;
+        mismatches++;
+        pca_verify_stats.last_reg = reg;
+    }
+    pca_verify_stats.mismatches += mismatches;
+    return mismatches;
+}
+
+//Wakes a board with MODE1 auto-increment on, reading MODE1 first if the shadow doesn't know it.
+//The other MODE1 bits stay as they are. A board that was asleep gets 500 us for its oscillator
+int pca_dev_start(pca_dev_t *dev){
+    uint8_t mode1 = dev->shadow[PCA_Controller.MODE1_REG];
+    int err;
+
+    if (!pca_shadow_is_valid(dev, PCA_Controller.MODE1_REG)) {
+        if ((err = pca_dev_read(dev, PCA_Controller.MODE1_REG, &mode1, 1)) < 0) return err;
+    }
+    uint8_t awake = (mode1 & ~(PCA_Controller.MODE1_RESTART | PCA_Controller.MODE1_SLEEP)) | PCA_Controller.MODE1_AUTO_INC;
+    if ((err = pca_dev_write_byte(dev, PCA_Controller.MODE1_REG, awake)) < 0) return err;
+    if (mode1 & PCA_Controller.MODE1_SLEEP) delay(500000);
+    return I2C_OK;
+}
+
+//MODE1..LED15_OFF_H in one read, PRE_SCALE in a second one since auto-increment wraps at LED15
+int pca_dev_verify(pca_dev_t *dev){
+    uint8_t regs[PCA_LED_ON_L(16)];
+    uint8_t prescale;
+    int err;
+
+    if ((err = pca_dev_read_block(dev, PCA_Controller.MODE1_REG, regs, sizeof(regs))) < 0) return err;
+    if ((err = pca_dev_read_block(dev, PCA_Controller.PRE_SCALE, &prescale, 1)) < 0) return err;
+    pca_verify_stats.checks++;
+    return pca_dev_compare(dev, PCA_Controller.MODE1_REG, regs, sizeof(regs))
+        + pca_dev_compare(dev, PCA_Controller.PRE_SCALE, &prescale, 1);
+}
+
+int pca_verify(void){
+    return pca_dev_verify(&pca_default);
+}
+
+//Points one of the group addresses of every member at group->address. slot 0 is ALLCALLADR,
+//1..3 are SUBADR1..SUBADR3. Costs a few frames per member, once
+int pca_group_init(const pca_group_t *group, uint8_t slot){
+    uint8_t addr_reg = slot ? PCA_SUBADR1 + slot - 1 : PCA_ALLCALLADR;
+    uint8_t enable = slot ? PCA_MODE1_SUB1 >> (slot - 1) : PCA_MODE1_ALLCALL;
+    int err;
+
+    if (slot > 3) return -1;
+    for (uint8_t d = 0; d < group->count; d++) {
+        pca_dev_t *dev = group->members[d];
+        // MODE1 must be known before it is modified, a reset or an earlier write provides it
+        if (!pca_shadow_is_valid(dev, PCA_Controller.MODE1_REG)) return -1;
+        if ((err = pca_dev_write_byte_cached(dev, addr_reg, group->address << 1)) < 0) return err;
+        if ((err = pca_dev_write_byte_cached(dev, PCA_Controller.MODE1_REG, dev->shadow[PCA_Controller.MODE1_REG] | enable)) < 0) return err;
+    }
+    return I2C_OK;
+}
+
+//One frame for every member, each shadow records it
+int pca_group_write_byte(const pca_group_t *group, uint8_t ctrl_reg, uint8_t value){
+    uint8_t frame[2] = {ctrl_reg, value};
+    return pca_send(group->address, group->members, group->count, frame, 2);
 }
 
-void pca_write_byte(volatile uint8_t ctrl_reg, volatile uint8_t value){
-    HWREG(I2C1.BASE + I2C1.IRQSTATUS_RAW) = I2C1.IRQ_RESET; 
-    HWREG(I2C1.BASE + I2C1.SA) = PCA_Controller.ADDRESS;
-    HWREG(I2C1.BASE + I2C1.CNT) = 0x2; // Number of bytes to transfer
-    HWREG(I2C1.BASE + I2C1.CON) = I2C1.START_TRANSFER;
-    HWREG(I2C1.BASE + I2C1.DATA) = ctrl_reg;
-    HWREG(I2C1.BASE + I2C1.DATA) = value;
+//Sends the smallest contiguous range of block that differs from any member's shadow, returns
+//data bytes sent or an error
+int pca_group_write_block(const pca_group_t *group, uint8_t start_reg, const uint8_t *block, uint8_t len){
+    uint8_t frame[PCA_BURST_MAX + 1];
+    int first = -1;
+    int last = -1;
 
+    for (int i = 0; i < len; i++) {
+        for (uint8_t d = 0; d < group->count; d++) {
+            if (pca_shadow_differs(group->members[d], start_reg + i, block[i])) {
+                if (first < 0) first = i;
+                last = i;
+                break;
+            }
+        }
+    }
+    if (first < 0) {
+        return 0;
+    }
+
+    uint8_t frame_len = pca_build_burst(frame, start_reg + first, &block[first], last - first + 1);
+    int err = pca_send(group->address, group->members, group->count, frame, frame_len);
+    return err ? err : frame_len - 1;
+}
+
+//Wakes every member with auto-increment on and restarts their PWM counters on the same STOP, so
+//the channels of all boards run in phase. A broadcast MODE1 write can't differ per board, so the
+//members must agree on MODE1 apart from SLEEP, RESTART and AI, otherwise -1
+int pca_group_sync_start(const pca_group_t *group){
+    uint8_t keep = ~(PCA_Controller.MODE1_RESTART | PCA_Controller.MODE1_SLEEP | PCA_Controller.MODE1_AUTO_INC);
+    int err;
+
+    if (group->count == 0) return I2C_OK;
+    uint8_t mode1 = (group->members[0]->shadow[PCA_Controller.MODE1_REG] & keep) | PCA_Controller.MODE1_AUTO_INC;
+    for (uint8_t d = 0; d < group->count; d++) {
+        pca_dev_t *dev = group->members[d];
+        if (!pca_shadow_is_valid(dev, PCA_Controller.MODE1_REG) || (dev->shadow[PCA_Controller.MODE1_REG] & keep) != (mode1 & keep)) return -1;
+    }
+
+    if ((err = pca_group_write_byte(group, PCA_Controller.MODE1_REG, mode1)) < 0) return err;
+    delay(500000); // at least 500 us for the oscillators to settle before RESTART
+    return pca_group_write_byte(group, PCA_Controller.MODE1_REG, mode1 | PCA_Controller.MODE1_RESTART);
+}
+
+int motor_set_atomic(_Bool on){
+    uint8_t mode2 = pca_shadow_is_valid(&pca_default, PCA_Controller.MODE2_REG) ? pca_default.shadow[PCA_Controller.MODE2_REG] : PCA_Controller.MODE2_OUTDRV;
+    mode2 = on ? mode2 & ~PCA_Controller.MODE2_OCH : mode2 | PCA_Controller.MODE2_OCH;
+
+    int err = pca_write_byte_cached(PCA_Controller.MODE2_REG, mode2);
+    if (err < 0) return err;
+    pca_atomic = on;
+    return I2C_OK;
+}
+
+//Fills one channel of a register block starting at base, full ON or full OFF. L registers stay zero
+static void pca_fill_motor_pin(uint8_t *block, uint8_t base, uint8_t on_register, uint8_t off_register, _Bool state) {
+    block[on_register - base] = state ? PCA_Controller.PWM_OUTPUT_ENABLE : PCA_Controller.PWM_OUTPUT_DISABLE;
+    block[off_register - base] = state ? PCA_Controller.PWM_OUTPUT_DISABLE : PCA_Controller.PWM_OUTPUT_ENABLE;
 }
 
 //function to set the state of a motor pin, note that OFF PWM signal takes precedent over ON PWM signal
-void pca_set_motor_pin_state(uint8_t on_register, uint8_t off_register, _Bool state) {
+int pca_set_motor_pin_state(uint8_t on_register, uint8_t off_register, _Bool state) {
+    int err;
+    if (pca_atomic) {
+        // ON_H, OFF_L and OFF_H in one frame, the pin goes straight to its new level
+        uint8_t block[3] = {0};
+        pca_fill_motor_pin(block, on_register, on_register, off_register, state);
+        int sent = pca_write_block(on_register, block, off_register - on_register + 1);
+        return sent < 0 ? sent : I2C_OK;
+    }
     if (state) {
-        pca_write_byte(off_register, PCA_Controller.PWM_OUTPUT_DISABLE); // Fully disable OFF PWM output first
-        delay(5000);
-        pca_write_byte(on_register, PCA_Controller.PWM_OUTPUT_ENABLE);   // Then fully enable ON PWM output
+        err = pca_write_byte(off_register, PCA_Controller.PWM_OUTPUT_DISABLE); // Fully disable OFF PWM output first
+        if (!err) err = pca_write_byte(on_register, PCA_Controller.PWM_OUTPUT_ENABLE);   // Then fully enable ON PWM output
     } else {
-        pca_write_byte(on_register, PCA_Controller.PWM_OUTPUT_DISABLE);  // Fully disable ON PWM output first
-        delay(5000);
-        pca_write_byte(off_register, PCA_Controller.PWM_OUTPUT_ENABLE);  // Then fully enable OFF PWM output
+        err = pca_write_byte(on_register, PCA_Controller.PWM_OUTPUT_DISABLE);  // Fully disable ON PWM output first
+        if (!err) err = pca_write_byte(off_register, PCA_Controller.PWM_OUTPUT_ENABLE);  // Then fully enable OFF PWM output
     }
+    return err;
+}
+
+//Fills the four registers of a PWM channel, output goes high at count 0 and low at duty
+static void pca_fill_duty(uint8_t *block, uint8_t base, uint8_t on_l_register, uint16_t duty) {
+    uint8_t *led = &block[on_l_register - base];
+    led[0] = 0x00;
+    led[1] = duty >= PCA_PWM_FULL ? PCA_Controller.PWM_OUTPUT_ENABLE : 0x00;
+    led[2] = duty < PCA_PWM_FULL ? (duty & 0xFF) : 0x00;
+    led[3] = duty == 0 ? PCA_Controller.PWM_OUTPUT_ENABLE : (duty < PCA_PWM_FULL ? (duty >> 8) : 0x00);
+}
+
+//Fills the LED3..LED6 block for a 4 bit AIN1/AIN2/BIN1/BIN2 pattern
+static void pca_fill_motor_block(uint8_t *block, uint8_t pattern) {
+    pca_fill_motor_pin(block, PCA_Controller.LED3_ON_L, PCA_Controller.AIN1_ON, PCA_Controller.AIN1_OFF, pattern & (1 << AIN1));
+    pca_fill_motor_pin(block, PCA_Controller.LED3_ON_L, PCA_Controller.AIN2_ON, PCA_Controller.AIN2_OFF, pattern & (1 << AIN2));
+    pca_fill_motor_pin(block, PCA_Controller.LED3_ON_L, PCA_Controller.BIN1_ON, PCA_Controller.BIN1_OFF, pattern & (1 << BIN1));
+    pca_fill_motor_pin(block, PCA_Controller.LED3_ON_L, PCA_Controller.BIN2_ON, PCA_Controller.BIN2_OFF, pattern & (1 << BIN2));
 }
 
-// Function to write to motor pins based on the step number
-void pca_write_motor_pins(uint8_t stepnum) {
-    pca_set_motor_pin_state(PCA_Controller.AIN1_ON, PCA_Controller.AIN1_OFF, stepnum & (1 << AIN1));
-    delay(5000);
-    pca_set_motor_pin_state(PCA_Controller.AIN2_ON, PCA_Controller.AIN2_OFF, stepnum & (1 << AIN2));
-    delay(5000);
-    pca_set_motor_pin_state(PCA_Controller.BIN1_ON, PCA_Controller.BIN1_OFF, stepnum & (1 << BIN1));
-    delay(5000);
-    pca_set_motor_pin_state(PCA_Controller.BIN2_ON, PCA_Controller.BIN2_OFF, stepnum & (1 << BIN2));
+// Function to write to motor pins based on the step number, the changed inputs go out in one burst
+int pca_write_motor_pins(uint8_t stepnum) {
+    uint8_t block[PCA_MOTOR_BLOCK_LEN] = {0};
+
+    PROF_BEGIN(pins_start);
+    pca_fill_motor_block(block, stepnum);
+    int sent = pca_write_block(PCA_Controller.LED3_ON_L, block, PCA_MOTOR_BLOCK_LEN);
+    PROF_END(PROF_MOTOR_PINS, pins_start);
+    return sent < 0 ? sent : I2C_OK;
+}
+
+// Step is 1..4 as in the truth table above
+int full_step_motor(int step){
+    return pca_write_motor_pins(full_sequence[(step - 1) & 0x3]);
+}
+
+uint8_t calc_prescale(int osc_clk_mhz, int update_rate_khz){
+    uint32_t osc = (uint32_t)osc_clk_mhz * 1000000;
+    uint32_t div = 4096 * (uint32_t)update_rate_khz * 1000;
+    uint32_t prescale = (osc + div / 2) / div; // rounded
+
+    prescale = prescale ? prescale - 1 : 0;
+    if (prescale < 3) prescale = 3;            // hardware minimum, about 1.5 KHz
+    if (prescale > 255) prescale = 255;
+    return prescale;
 }
 
+//PRE_SCALE is only writable in sleep: sleep, load, wake, then restart the PWM channels
+int pca_set_prescale(uint8_t prescale){
+    int err;
+    uint8_t mode1 = pca_default.shadow[PCA_Controller.MODE1_REG] & ~PCA_Controller.MODE1_RESTART;
 
-void full_step_motor(int step){
-    switch (step){
-        case 1: pca_write_motor_pins(PCA_Controller.STEP1); break;
-        case 2: pca_write_motor_pins(PCA_Controller.STEP2); break;
-        case 3: pca_write_motor_pins(PCA_Controller.STEP3); break;
-        case 4: pca_write_motor_pins(PCA_Controller.STEP4); break;
+    if ((err = pca_write_byte(PCA_Controller.MODE1_REG, mode1 | PCA_Controller.MODE1_SLEEP)) < 0) return err;
+    if ((err = pca_write_byte(PCA_Controller.PRE_SCALE, prescale)) < 0) return err;
+    if ((err = pca_write_byte(PCA_Controller.MODE1_REG, mode1 & ~PCA_Controller.MODE1_SLEEP)) < 0) return err;
+    delay(500000); // at least 500 us for the oscillator to settle before RESTART
+    return pca_write_byte(PCA_Controller.MODE1_REG, (mode1 & ~PCA_Controller.MODE1_SLEEP) | PCA_Controller.MODE1_RESTART);
+}
+
+//Quarter sine wave, sin(k * 90 / 16 degrees) scaled to the 12 bit PWM range
+static const uint16_t microstep_sine[17] = {
+    0, 401, 799, 1189, 1567, 1931, 2276, 2598, 2896,
+    3166, 3406, 3612, 3784, 3920, 4017, 4076, 4096
+};
+
+//Signed sine of an electrical position, 64 positions per cycle
+static int16_t microstep_sin(uint8_t position){
+    uint8_t r = position & 0x0F;
+    switch ((position >> 4) & 0x3) {
+        case 0: return microstep_sine[r];
+        case 1: return microstep_sine[16 - r];
+        case 2: return -microstep_sine[r];
+        default: return -microstep_sine[16 - r];
     }
 }
 
+//Coil A follows cos, coil B follows sin. The sign selects the H-bridge direction, the
+//magnitude is the PWM duty of the coil enable. The full step patterns sit at 45 + 90n degrees
+int pca_write_microstep(uint8_t position){
+    uint8_t block[PCA_COIL_BLOCK_LEN] = {0};
+    uint8_t base = PCA_Controller.LED2_ON_L;
+    int16_t coil_a = microstep_sin(position + 16);
+    int16_t coil_b = microstep_sin(position);
+
+    pca_fill_duty(block, base, PCA_Controller.LED2_ON_L, coil_a < 0 ? -coil_a : coil_a);
+    pca_fill_duty(block, base, PCA_Controller.LED7_ON_L, coil_b < 0 ? -coil_b : coil_b);
+    pca_fill_motor_pin(block, base, PCA_Controller.AIN1_ON, PCA_Controller.AIN1_OFF, coil_a >= 0);
+    pca_fill_motor_pin(block, base, PCA_Controller.AIN2_ON, PCA_Controller.AIN2_OFF, coil_a < 0);
+    pca_fill_motor_pin(block, base, PCA_Controller.BIN1_ON, PCA_Controller.BIN1_OFF, coil_b >= 0);
+    pca_fill_motor_pin(block, base, PCA_Controller.BIN2_ON, PCA_Controller.BIN2_OFF, coil_b < 0);
+
+    int sent = pca_write_block(base, block, PCA_COIL_BLOCK_LEN);
+    return sent < 0 ? sent : I2C_OK;
+}
+
+//Drive sequences as AIN1/AIN2/BIN1/BIN2 patterns, ordered by increasing electrical angle.
+//Position is in 64ths of an electrical cycle, the same scale as pca_write_microstep()
+typedef struct {
+    const uint8_t *sequence;
+    uint8_t length;     // power of two
+    uint8_t offset;     // position of entry 0
+    uint8_t spacing;    // positions between entries
+} drive_table_t;
+
+static const uint8_t wave_sequence[4] = {0x04, 0x01, 0x08, 0x02};
+static const uint8_t half_sequence[8] = {0x05, 0x01, 0x09, 0x08, 0x0A, 0x02, 0x06, 0x04};
+
+static const drive_table_t drive_tables[] = {
+    [DRIVE_WAVE] = {wave_sequence, 4, 32, 16},
+    [DRIVE_FULL] = {full_sequence, 4, 40, 16},
+    [DRIVE_HALF] = {half_sequence, 8, 40, 8},
+};
+
+//Step generator state, owned by the Timer5 ISR while a move runs
+static volatile uint32_t steps_remaining;
+static uint32_t step_index;
+static motion_move_t active_move;
+
+//Move queue, written under irq_save() by motor_queue_move() and drained by the Timer5 ISR
+static motion_cmd_t motion_queue[MOTION_QUEUE_LEN];
+static volatile uint32_t motion_head;
+static volatile uint32_t motion_tail;
+volatile uint32_t motion_queue_dropped;
+static motion_cmd_t button_move;
+
+//Stream the Timer5 ISR is sending, the queue waits while one runs
+static move_stream_t *volatile active_stream;
+volatile uint32_t motor_stream_underruns;
+volatile uint32_t motor_limit_stops;
+
+//drive_frames[direction][i] moves the coils into entry i from the entry before it in that direction
+static pca_frame_t drive_frames[2][8];
+static const drive_table_t *drive_table = &drive_tables[DRIVE_FULL];
+static const pca_frame_t *drive_active;  // drive_frames row of the running move
+static uint8_t drive_phase;
+static uint8_t drive_delta;              // added to the phase or position each tick, wraps by mask
+static uint8_t microstep_increment;      // positions per tick in microstep mode
+static uint8_t microstep_position;
+static _Bool drive_resync;               // a diff frame was refused, the next step sends its whole entry
+volatile uint32_t motor_step_misses;
+
+//The frames are diffs against the entry before, so the phase only moves once the frame is in the
+//ring. A refused frame leaves the shadow unsure of the coils, the whole entry goes out instead
+static int drive_table_step(void){
+    uint8_t phase = (drive_phase + drive_delta) & (drive_table->length - 1);
+    int err;
+
+    if (!drive_resync) {
+        if ((err = pca_write_frame(&drive_active[phase])) >= 0) {
+            drive_phase = phase;
+            return I2C_OK;
+        }
+        motor_step_misses++;
+        pca_shadow_invalidate();
+        drive_resync = 1;
+    }
+    if ((err = pca_write_motor_pins(drive_table->sequence[phase])) < 0) return err;
+    drive_resync = 0;
+    drive_phase = phase;
+    return I2C_OK;
+}
+
+static int drive_microstep_step(void){
+    uint8_t position = (microstep_position + drive_delta) & 0x3F;
+    int err = pca_write_microstep(position);
+
+    if (err < 0) {
+        motor_step_misses++;
+        return err;
+    }
+    microstep_position = position;
+    return I2C_OK;
+}
+
+//Multi-axis mode, both axes step through drive_table. The window is the register range covering
+//every channel of both ports, kept as the image the outputs should show
+typedef struct {
+    const motor_channels_t *map;
+    uint8_t phase;
+    uint8_t delta;
+    uint32_t steps;     // steps of this axis in the running move
+    uint32_t error;     // Bresenham accumulator, the axis steps when it reaches the move's ticks
+} motor_axis_t;
+
+static motor_axis_t motor_axes[MOTOR_AXES];
+static uint8_t axis_window[16 * 4];
+static uint8_t axis_window_base;
+static uint8_t axis_window_len;
+
+//Fills the H-bridge inputs of one port for a 4 bit AIN1/AIN2/BIN1/BIN2 pattern
+static void pca_fill_axis(uint8_t *block, uint8_t base, const motor_channels_t *map, uint8_t pattern){
+    pca_fill_motor_pin(block, base, PCA_LED_ON_L(map->AIN1) + 1, PCA_LED_ON_L(map->AIN1) + 3, pattern & (1 << AIN1));
+    pca_fill_motor_pin(block, base, PCA_LED_ON_L(map->AIN2) + 1, PCA_LED_ON_L(map->AIN2) + 3, pattern & (1 << AIN2));
+    pca_fill_motor_pin(block, base, PCA_LED_ON_L(map->BIN1) + 1, PCA_LED_ON_L(map->BIN1) + 3, pattern & (1 << BIN1));
+    pca_fill_motor_pin(block, base, PCA_LED_ON_L(map->BIN2) + 1, PCA_LED_ON_L(map->BIN2) + 3, pattern & (1 << BIN2));
+}
+
+//Steps every axis whose Bresenham error crosses the tick count, then sends what changed. A
+//refused write puts the axes back, the tick is taken again on the next overflow
+static int drive_multiaxis_step(void){
+    uint8_t mask = drive_table->length - 1;
+    motor_axis_t before[MOTOR_AXES];
+
+    for (int a = 0; a < MOTOR_AXES; a++) {
+        motor_axis_t *axis = &motor_axes[a];
+        before[a] = *axis;
+        axis->error += axis->steps;
+        if (axis->error < active_move.steps) continue;
+        axis->error -= active_move.steps;
+        axis->phase = (axis->phase + axis->delta) & mask;
+        pca_fill_axis(axis_window, axis_window_base, axis->map, drive_table->sequence[axis->phase]);
+    }
+    int sent = pca_write_sparse(axis_window_base, axis_window, axis_window_len);
+    if (sent < 0) {
+        motor_step_misses++;
+        for (int a = 0; a < MOTOR_AXES; a++) {
+            motor_axes[a] = before[a];
+            pca_fill_axis(axis_window, axis_window_base, motor_axes[a].map, drive_table->sequence[motor_axes[a].phase]);
+        }
+        return sent;
+    }
+    return I2C_OK;
+}
+
+static int (*drive_step)(void) = drive_table_step;
+
+//Queues a frame without touching the shadow, for streams. The shadow catches up at the end
+static int pca_send_untracked(const pca_frame_t *frame){
+    pca_stats.transactions++;
+    pca_stats.bytes += frame->len + 1;
+    return pca_transmit(pca_default.address, frame->data, frame->len);
+}
+
+//Smallest frame that turns pattern from into pattern to
+static void drive_compile_frame(pca_frame_t *frame, uint8_t from, uint8_t to){
+    uint8_t before[PCA_MOTOR_BLOCK_LEN] = {0};
+    uint8_t after[PCA_MOTOR_BLOCK_LEN] = {0};
+    int first = 0;
+    int last = PCA_MOTOR_BLOCK_LEN - 1;
+
+    pca_fill_motor_block(before, from);
+    pca_fill_motor_block(after, to);
+    while (first < last && before[first] == after[first]) first++;
+    while (last > first && before[last] == after[last]) last--;
+
+    frame->data[0] = PCA_Controller.LED3_ON_L + first;
+    for (int i = first; i <= last; i++) {
+        frame->data[i - first + 1] = after[i];
+    }
+    frame->len = last - first + 2;
+}
+
+static uint8_t motor_electrical_position(void){
+    if (drive_step == drive_microstep_step) return microstep_position;
+    if (drive_step == drive_multiaxis_step) return (drive_table->offset + motor_axes[0].phase * drive_table->spacing) & 0x3F;
+    return (drive_table->offset + drive_phase * drive_table->spacing) & 0x3F;
+}
+
+static uint8_t motor_nearest_phase(const drive_table_t *table, uint8_t position){
+    return ((uint8_t)(position - table->offset + table->spacing / 2) & 0x3F) / table->spacing;
+}
+
+//Restores both coil enables to fully on after microstepping
+static int motor_enable_coils(void){
+    int err;
+    if ((err = pca_write_byte_cached(PCA_Controller.LED2_ON_H, PCA_Controller.PWM_OUTPUT_ENABLE)) < 0) return err;
+    if ((err = pca_write_byte_cached(PCA_Controller.LED2_ON_L + 3, PCA_Controller.PWM_OUTPUT_DISABLE)) < 0) return err;
+    if ((err = pca_write_byte_cached(PCA_Controller.LED7_ON_H, PCA_Controller.PWM_OUTPUT_ENABLE)) < 0) return err;
+    if ((err = pca_write_byte_cached(PCA_Controller.LED7_ON_L + 3, PCA_Controller.PWM_OUTPUT_DISABLE)) < 0) return err;
+    return I2C_OK;
+}
+
+//Selects wave, full or half step. Precompiles the transition frame of every entry for both
+//directions and moves the coils to the entry nearest the current rotor position
+int motor_set_drive_mode(drive_mode_t mode){
+    int err;
+    const drive_table_t *table = &drive_tables[mode];
+    uint8_t mask = table->length - 1;
+    uint8_t position = motor_electrical_position();
+
+    if (motor_busy()) return I2C_ERR_BUS_BUSY;
+
+    for (uint8_t i = 0; i < table->length; i++) {
+        drive_compile_frame(&drive_frames[MOTOR_FORWARD][i], table->sequence[(i - 1) & mask], table->sequence[i]);
+        drive_compile_frame(&drive_frames[MOTOR_REVERSE][i], table->sequence[(i + 1) & mask], table->sequence[i]);
+    }
+    drive_table = table;
+    drive_phase = motor_nearest_phase(table, position);
+    drive_step = drive_table_step;
+
+    if ((err = motor_enable_coils()) < 0) return err;
+    if ((err = pca_write_motor_pins(table->sequence[drive_phase])) < 0) return err;
+    drive_resync = 0;   // the whole entry just went out
+    return I2C_OK;
+}
+
+//Selects 1, 2, 4, 8 or 16 microsteps per full step, 0 returns to full step patterns with
+//the coil enables fully on. Profiles then count microsteps. Only valid between moves
+int motor_set_microstep(uint8_t resolution){
+    if (motor_busy()) return I2C_ERR_BUS_BUSY;
+    if (resolution == 0) return motor_set_drive_mode(DRIVE_FULL);
+    if (resolution > MICROSTEP_MAX || (MICROSTEP_MAX % resolution)) return -1;
+
+    uint8_t position = motor_electrical_position();
+    microstep_increment = MICROSTEP_MAX / resolution;
+    // Snap to the new grid, whole steps of a 1/1 grid sit on the full step positions 8 + 16n
+    microstep_position = (position & ~(microstep_increment - 1)) | (microstep_increment > 8 ? 8 : 0);
+    drive_step = drive_microstep_step;
+    return pca_write_microstep(microstep_position);
+}
+
+//Pops the next queued move into the step generator, returns 0 when the queue is empty
+static _Bool motor_begin_next(void){
+    if (motion_tail == motion_head) return 0;
+    const motion_cmd_t *cmd = &motion_queue[motion_tail & (MOTION_QUEUE_LEN - 1)];
+
+    // Reverse adds the modulus minus one step, so the ISR never branches on direction
+    if (drive_step == drive_microstep_step) {
+        drive_delta = cmd->direction[0] == MOTOR_FORWARD ? microstep_increment : 64 - microstep_increment;
+    } else if (drive_step == drive_multiaxis_step) {
+        for (int a = 0; a < MOTOR_AXES; a++) {
+            motor_axes[a].delta = cmd->direction[a] == MOTOR_FORWARD ? 1 : drive_table->length - 1;
+            motor_axes[a].steps = cmd->axis_steps[a];
+            motor_axes[a].error = 0;      // a slower axis takes its last step on the final tick
+        }
+    } else {
+        drive_delta = cmd->direction[0] == MOTOR_FORWARD ? 1 : drive_table->length - 1;
+        drive_active = drive_frames[cmd->direction[0]];
+    }
+
+    planner_begin_move(&active_move, cmd->profile, cmd->steps);
+    step_index = 0;
+    steps_remaining = cmd->steps;
+    motion_tail++;
+    return 1;
+}
+
+//Ticks before step index of the running move. Past its end this is the first step of the next
+//queued move, or the final decelerating interval if nothing is queued yet
+//First interval of the move at the head of the queue, the queue must not be empty
+static uint32_t motor_queued_period(void){
+    const motion_cmd_t *next = &motion_queue[motion_tail & (MOTION_QUEUE_LEN - 1)];
+    motion_move_t move;
+    planner_begin_move(&move, next->profile, next->steps);
+    return planner_interval(&move, 0);
+}
+
+static uint32_t motor_period(uint32_t index){
+    if (index < active_move.steps) return planner_interval(&active_move, index);
+    if (motion_tail != motion_head) return motor_queued_period();
+    return planner_interval(&active_move, active_move.steps - 1);
+}
+
+static int motor_queue_push(const motion_cmd_t *cmd){
+    int err = I2C_OK;
+
+    if (cmd->steps == 0) return I2C_OK;
+
+    // The step ISR and any ISR producing moves both touch head and the idle check
+    uint32_t irq = irq_save();
+    if (motion_head - motion_tail >= MOTION_QUEUE_LEN) {
+        motion_queue_dropped++;
+        err = I2C_ERR_QUEUE_FULL;
+    } else {
+        motion_queue[motion_head & (MOTION_QUEUE_LEN - 1)] = *cmd;
+        motion_head++;
+        // Generator idle, start the timer. Otherwise the ISR takes it after the current move
+        if (!steps_remaining && !active_stream && motor_begin_next()) {
+            // TLDR always holds the period after the one counting, the ISR keeps it one step ahead
+            timer5_start(motor_period(0), motor_period(1));
+        }
+    }
+    irq_restore(irq);
+    return err;
+}
+
+int motor_queue_move(uint32_t steps, motor_dir_t direction, const motion_profile_t *profile){
+    motion_cmd_t cmd = {
+        .steps = steps,
+        .profile = profile,
+        .axis_steps = {steps, 0},
+        .direction = {direction, MOTOR_FORWARD},
+    };
+    return motor_queue_push(&cmd);
+}
+
+//Both axes start and stop together, the one with more steps sets the tick count and the profile
+int motor_queue_move_xy(int32_t steps0, int32_t steps1, const motion_profile_t *profile){
+    motion_cmd_t cmd = {
+        .profile = profile,
+        .axis_steps = {steps0 < 0 ? -steps0 : steps0, steps1 < 0 ? -steps1 : steps1},
+        .direction = {steps0 < 0 ? MOTOR_REVERSE : MOTOR_FORWARD, steps1 < 0 ? MOTOR_REVERSE : MOTOR_FORWARD},
+    };
+
+    if (drive_step != drive_multiaxis_step) return -1;
+    cmd.steps = cmd.axis_steps[0] > cmd.axis_steps[1] ? cmd.axis_steps[0] : cmd.axis_steps[1];
+    return motor_queue_push(&cmd);
+}
+
+//Builds the window image with both enables fully on and the inputs at their current entries.
+//Channels inside the window that belong to neither port are driven fully off
+int motor_multiaxis_init(const motor_channels_t *axis0, const motor_channels_t *axis1){
+    const motor_channels_t *maps[MOTOR_AXES] = {axis0, axis1};
+    uint8_t low = 15;
+    uint8_t high = 0;
+
+    if (motor_busy()) return I2C_ERR_BUS_BUSY;
+    if (drive_step == drive_microstep_step) drive_table = &drive_tables[DRIVE_FULL];
+
+    for (int a = 0; a < MOTOR_AXES; a++) {
+        const motor_channels_t *map = maps[a];
+        const uint8_t ch[] = {map->PWMA, map->AIN2, map->AIN1, map->BIN1, map->BIN2, map->PWMB};
+        for (int i = 0; i < (int)sizeof(ch); i++) {
+            if (ch[i] < low) low = ch[i];
+            if (ch[i] > high) high = ch[i];
+        }
+    }
+    axis_window_base = PCA_LED_ON_L(low);
+    axis_window_len = (high - low + 1) * 4;
+    for (uint8_t ch = low; ch <= high; ch++) {
+        pca_fill_duty(axis_window, axis_window_base, PCA_LED_ON_L(ch), 0);
+    }
+
+    motor_axes[0].phase = motor_nearest_phase(drive_table, motor_electrical_position());
+    motor_axes[1].phase = 0;
+    for (int a = 0; a < MOTOR_AXES; a++) {
+        motor_axes[a].map = maps[a];
+        pca_fill_duty(axis_window, axis_window_base, PCA_LED_ON_L(maps[a]->PWMA), PCA_PWM_FULL);
+        pca_fill_duty(axis_window, axis_window_base, PCA_LED_ON_L(maps[a]->PWMB), PCA_PWM_FULL);
+        pca_fill_axis(axis_window, axis_window_base, maps[a], drive_table->sequence[motor_axes[a].phase]);
+    }
+    drive_step = drive_multiaxis_step;
+
+    int sent = pca_write_sparse(axis_window_base, axis_window, axis_window_len);
+    return sent < 0 ? sent : I2C_OK;
+}
+
+//Compiles until the buffer is full or the move is done, returns the steps compiled
+uint32_t motor_stream_fill(move_stream_t *stream){
+    const drive_table_t *table = stream->table;
+    const pca_frame_t *frames = drive_frames[stream->direction];
+    uint8_t delta = stream->direction == MOTOR_FORWARD ? 1 : table->length - 1;
+    uint32_t compiled = 0;
+
+    while (stream->head < stream->total && stream->head - stream->tail < MOVE_STREAM_LEN) {
+        uint32_t i = stream->head;
+        move_step_t *step = &stream->steps[i & (MOVE_STREAM_LEN - 1)];
+        uint32_t next = i + 2 < stream->total ? i + 2 : stream->total - 1;
+
+        stream->phase = (stream->phase + delta) & (table->length - 1);
+        step->frame = frames[stream->phase];
+        step->reload = planner_interval(&stream->move, next);
+        __sync_synchronize();   // the frame and reload land before the head that publishes them
+        stream->head = i + 1;   // the ISR may take the step from here on
+        compiled++;
+    }
+    return compiled;
+}
+
+int motor_compile_move(move_stream_t *stream, uint32_t steps, motor_dir_t direction, const motion_profile_t *profile){
+    if (drive_step != drive_table_step || steps == 0) return -1;
+    if (stream == active_stream) return I2C_ERR_BUS_BUSY;
+
+    uint8_t delta = direction == MOTOR_FORWARD ? 1 : drive_table->length - 1;
+    planner_begin_move(&stream->move, profile, steps);
+    stream->direction = direction;
+    stream->table = drive_table;
+    stream->total = steps;
+    stream->head = 0;
+    stream->tail = 0;
+    stream->start_phase = drive_phase;
+    stream->phase = drive_phase;
+    stream->end_phase = (drive_phase + steps * delta) & (drive_table->length - 1);
+    motor_stream_fill(stream);
+    return I2C_OK;
+}
+
+int motor_start_stream(move_stream_t *stream){
+    int err;
+
+    if (motor_busy()) return I2C_ERR_BUS_BUSY;
+    if (stream->total == 0 || drive_step != drive_table_step) return -1;
+    // Raw pattern writes like full_step_motor() bypass the phase, put the coils back on it first
+    if ((err = pca_write_motor_pins(drive_table->sequence[drive_phase])) < 0) return err;
+    // The frames are diffs from the pattern the move started on, a replay needs the coils back
+    // there and every step still in the buffer. Otherwise compile again for the coils as they are
+    if (stream->table == drive_table && stream->start_phase == drive_phase
+            && stream->head == stream->total && stream->total <= MOVE_STREAM_LEN) {
+        stream->tail = 0;
+    } else if ((err = motor_compile_move(stream, stream->total, stream->direction, stream->move.profile)) < 0) {
+        return err;
+    }
+
+    uint32_t irq = irq_save();
+    active_stream = stream;
+    timer5_start(planner_interval(&stream->move, 0), planner_interval(&stream->move, stream->total > 1 ? 1 : 0));
+    irq_restore(irq);
+    return I2C_OK;
+}
+
+//The stream's frames went out untracked, bring the phase and the shadow up to the last one sent
+static void motor_stream_end(uint8_t phase){
+    drive_phase = phase;
+    uint8_t block[PCA_MOTOR_BLOCK_LEN] = {0};
+    pca_fill_motor_block(block, drive_table->sequence[drive_phase]);
+    for (uint8_t r = 0; r < PCA_MOTOR_BLOCK_LEN; r++) {
+        pca_shadow_update(&pca_default, PCA_Controller.LED3_ON_L + r, block[r]);
+    }
+    active_stream = 0;
+}
+
+//Timer5 work for a stream: one queued frame and one TLDR write per step
+static void motor_stream_tick(void){
+    move_stream_t *stream = active_stream;
+    uint32_t i = stream->tail;
+
+    if (i == stream->head) {
+        // The compiler fell behind, try again one period later
+        motor_stream_underruns++;
+        return;
+    }
+    const move_step_t *step = &stream->steps[i & (MOVE_STREAM_LEN - 1)];
+    pca_send_untracked(&step->frame);
+    PROF_END_ARMED(PROF_EDGE_TO_STEP);
+    stream->tail = i + 1;
+    if (stream->tail + 1 == stream->total && motion_tail != motion_head) {
+        // The reload after the last step is the period the queued move starts on. The stream
+        // repeats its last interval there, so look past its end as motor_period() does
+        timer5_set_period(motor_queued_period());
+        return;
+    }
+    if (stream->tail != stream->total) {
+        timer5_set_period(step->reload);
+        return;
+    }
+
+    motor_stream_end(stream->end_phase);
+    // Moves queued meanwhile start on the overflow already counting
+    if (motor_begin_next()) {
+        timer5_set_period(motor_period(1));
+    } else {
+        timer5_stop();
+    }
+}
+
+uint32_t motor_queue_depth(void){
+    return motion_head - motion_tail;
+}
+
+//Starts a planned move now, fails if one is running or queued
+int motor_start_move(uint32_t steps, motor_dir_t direction, const motion_profile_t *profile){
+    if (motor_busy()) return I2C_ERR_BUS_BUSY;
+    return motor_queue_move(steps, direction, profile);
+}
+
+_Bool motor_busy(void){
+    return steps_remaining != 0 || motion_head != motion_tail || active_stream != 0;
+}
+
+uint32_t motor_stop(void){
+    uint32_t cut = 0;
+
+    // Timer5 may be gated when nothing runs, don't touch it then
+    uint32_t irq = irq_save();
+    if (motor_busy()) {
+        timer5_stop();
+        if (active_stream) {
+            move_stream_t *stream = active_stream;
+            const drive_table_t *table = stream->table;
+            uint8_t delta = stream->direction == MOTOR_FORWARD ? 1 : table->length - 1;
+            cut = stream->total - stream->tail;
+            motor_stream_end((stream->start_phase + stream->tail * delta) & (table->length - 1));
+        }
+        cut += steps_remaining;
+        steps_remaining = 0;
+        motion_tail = motion_head;
+    }
+    irq_restore(irq);
+    return cut;
+}
+
+static void motor_limit_edge(const gpio_event_t *event){
+    (void)event;
+    if (motor_stop()) motor_limit_stops++;
+}
+
+int motor_bind_limit(uint8_t pin, gpio_edge_t edge){
+    // No debounce, the first edge of a bouncing switch is the one that counts
+    return gpio1_watch(pin, edge, 0, motor_limit_edge);
+}
+
+void motor_bind_button(uint32_t steps, motor_dir_t direction, const motion_profile_t *profile){
+    button_move.steps = steps;
+    button_move.profile = profile;
+    button_move.axis_steps[0] = steps;
+    button_move.axis_steps[1] = 0;
+    button_move.direction[0] = direction;
+    button_move.direction[1] = MOTOR_FORWARD;
+}
+
+void motor_button_pressed(void){
+    if (button_move.profile) {
+        // A press during a move only queues, its first step waits for the moves ahead of it
+        if (!motor_busy()) PROF_ARM(PROF_EDGE_TO_STEP);
+        motor_queue_push(&button_move);
+    }
+}
+
+//Called once per Timer5 overflow, writes the next coil pattern and queues the period after next
+void motor_step_tick(void){
+    PROF_BEGIN(tick_start);
+    // A frame the engine gave up on, put the board back before the next step. Streams don't keep
+    // the shadow current, a fault during one waits until it has ended
+    if (!active_stream && I2C_tx_take_fault()) {
+        motor_recover();
+    }
+    if (active_stream) {
+        motor_stream_tick();
+    } else if (steps_remaining == 0) {
+        timer5_stop();
+    } else if (drive_step() < 0) {
+        // Nothing of the step reached the ring, the same step goes out on the next overflow
+    } else {
+        PROF_END_ARMED(PROF_EDGE_TO_STEP);   // only the first step after a press from idle records
+        if (--steps_remaining == 0) {
+            // The overflow already counting is the first period of the next move
+            if (motor_begin_next()) {
+                timer5_set_period(motor_period(1));
+            } else {
+                timer5_stop();
+            }
+        } else {
+            step_index++;
+            timer5_set_period(motor_period(step_index + 1));
+        }
+    }
+    PROF_END(PROF_STEP_TICK, tick_start);
+}
+
 void delay(unsigned int counts) {
     while (counts > 0) {
-        asm("NOP");
+        CPU_NOP();
         // This empty loop will just count down to zero
         counts--;
     }
 }
 
-void pca_reset(void){
-    HWREG(I2C1.BASE + I2C1.IRQSTATUS_RAW) = I2C1.IRQ_RESET;
-    HWREG(I2C1.BASE + I2C1.SA) = 0x00; //general call
-    HWREG(I2C1.BASE + I2C1.CNT) = 0x1; // Number of bytes to transfer
-    HWREG(I2C1.BASE + I2C1.CON) = I2C1.START_TRANSFER;
-    HWREG(I2C1.BASE + I2C1.DATA) = 0x06;
+//Brings a board that was just reset back to its shadow. Registers the shadow doesn't know are at
+//their power-on value now, so only what differs from power-on is sent: PRE_SCALE while the
+//oscillator still sleeps, MODE2..LED15 in as few bursts as fit, and MODE1 as recorded last
+static int pca_dev_replay(pca_dev_t *dev){
+    int first = -1;
+    int last = -1;
+    int err;
+
+    for (int reg = 0; reg < PCA_ALL_LED_ON_L; reg++) {
+        if (!pca_shadow_is_valid(dev, reg)) pca_shadow_update(dev, reg, pca_power_on_value(reg));
+    }
+    if (!pca_shadow_is_valid(dev, PCA_Controller.PRE_SCALE)) {
+        pca_shadow_update(dev, PCA_Controller.PRE_SCALE, pca_power_on_value(PCA_Controller.PRE_SCALE));
+    }
+    uint8_t mode1 = dev->shadow[PCA_Controller.MODE1_REG];
+    if ((err = pca_dev_write_byte(dev, PCA_Controller.MODE1_REG, mode1 | PCA_Controller.MODE1_SLEEP | PCA_Controller.MODE1_AUTO_INC)) < 0) return err;
+    if (dev->shadow[PCA_Controller.PRE_SCALE] != pca_power_on_value(PCA_Controller.PRE_SCALE)) {
+        if ((err = pca_dev_write_byte(dev, PCA_Controller.PRE_SCALE, dev->shadow[PCA_Controller.PRE_SCALE])) < 0) return err;
+    }
+    for (int reg = PCA_Controller.MODE2_REG; reg < PCA_ALL_LED_ON_L; reg++) {
+        if (dev->shadow[reg] == pca_power_on_value(reg)) continue;
+        if (first < 0) first = reg;
+        last = reg;
+    }
+    for (int reg = first; first >= 0 && reg <= last; reg += PCA_BURST_MAX) {
+        uint8_t len = last - reg + 1 > PCA_BURST_MAX ? PCA_BURST_MAX : last - reg + 1;
+        if ((err = pca_dev_write_burst(dev, reg, &dev->shadow[reg], len)) < 0) return err;
+    }
+    return pca_dev_write_byte(dev, PCA_Controller.MODE1_REG, mode1);
+}
+
+//Tier 4 of the recovery ladder, for boards that were reset or lost power. A general call puts
+//every board in a known state, then each registered board gets its shadow back, or motor_init()
+//for a default board whose shadow knows nothing
+int motor_recover(void){
+    uint8_t swrst = PCA_Controller.RESET;
+    int err;
+
+    i2c_recovery.reinits++;
+    pca_recovering = 1;
+    err = pca_transmit(0x00, &swrst, 1);
+    pca_stats.transactions++;
+    pca_stats.bytes += 2;
+    for (uint8_t d = 0; d < pca_device_count && !err; d++) {
+        pca_dev_t *dev = pca_devices[d];
+        if (dev == &pca_default && !pca_shadow_is_valid(dev, PCA_Controller.MODE1_REG)) {
+            pca_shadow_load_defaults(dev);
+            err = motor_init();
+        } else {
+            err = pca_dev_replay(dev);
+        }
+    }
+    pca_recovering = 0;
+    return err < 0 ? err : I2C_OK;
+}
+
+//Between moves only, the polled reads would share the bus with the step writes otherwise
+int motor_verify(void){
+    int mismatches = 0;
+    int err;
+
+    if (motor_busy()) return I2C_ERR_BUS_BUSY;
+    for (uint8_t d = 0; d < pca_device_count; d++) {
+        if ((err = pca_dev_verify(pca_devices[d])) < 0) return err;
+        mismatches += err;
+    }
+    if (mismatches && (err = motor_recover()) < 0) return err;
+    return mismatches;
+}
+
+void motor_idle(void){
+    // Bus tiers for a frame the I2C1 ISR stalled on
+    I2C_tx_service();
+    // Masked, so a press can't queue a move between the check and the gating
+    uint32_t irq = irq_save();
+    if (!motor_busy()) {
+        if (I2C_tx_take_fault()) {
+            motor_recover();
+        } else {
+            per_clocks_gate();
+        }
+    }
+    // WFI wakes on a pending IRQ with the I bit set, the handler runs at irq_restore(). A frame
+    // that stalled since the service call above is picked up on the next pass instead. A frame
+    // wedged on SCL raises nothing, between moves no step tick wakes the loop for its deadline,
+    // so it only sleeps on a busy engine while a move runs
+    if (!I2C_tx_stalled() && (motor_busy() || I2C_tx_idle())) CPU_WAIT();
+    irq_restore(irq);
+}
+
+int pca_reset(void){
+    uint8_t swrst = PCA_Controller.RESET;
+
+    int err = pca_transmit(0x00, &swrst, 1); //general call, every board on the bus resets
+    if (!err) {
+        for (uint8_t d = 0; d < pca_device_count; d++) {
+            pca_shadow_load_defaults(pca_devices[d]);
+        }
+    }
+    pca_stats.transactions++;
+    pca_stats.bytes += 2;
+    return err;
+}
+
+uint32_t pca_bus_time_us(const pca_bus_stats_t *stats, uint32_t bus_khz){
+    uint32_t clocks = stats->bytes * 9 + stats->transactions * 2;
+    return (clocks * 1000) / bus_khz;
 }
 
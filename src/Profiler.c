@@ -0,0 +1,137 @@
+/*
+ * PMU cycle counter profiler, see Profiler.h. The functions are always built so the histogram
+ * code can run on the host; the PROF_* macros decide whether anything calls them.
+ */
+
+#include <stdint.h>
+#include "../include/BeagleBoneMaster.h"
+#include "../include/Profiler.h"
+
+prof_stats_t prof_stats[PROF_PROBES];
+
+static const char *const prof_names[PROF_PROBES] = {
+    "pca_write_byte",
+    "pca_write_motor_pins",
+    "irq_director",
+    "edge_to_step",
+    "motor_step_tick",
+};
+
+void profiler_reset(void){
+    for (int p = 0; p < PROF_PROBES; p++) {
+        prof_stats_t *s = &prof_stats[p];
+        s->armed = 0;
+        s->count = 0;
+        s->min = 0xFFFFFFFF;
+        s->max = 0;
+        s->total = 0;
+        for (int b = 0; b < PROF_BUCKETS; b++) {
+            s->hist[b] = 0;
+        }
+    }
+}
+
+void prof_counter_start(void){
+#ifndef HWREG_SIM
+    uint32_t pmcr;
+    // PMCR: E enables the counters, C resets CCNT, D clear counts every cycle
+    asm volatile("MRC p15, 0, %0, c9, c12, 0" : "=r" (pmcr));
+    pmcr = (pmcr | 0x5) & ~0x8;
+    asm volatile("MCR p15, 0, %0, c9, c12, 0" :: "r" (pmcr));
+    // PMCNTENSET bit 31 starts CCNT
+    asm volatile("MCR p15, 0, %0, c9, c12, 1" :: "r" (0x80000000));
+#endif
+}
+
+void profiler_init(void){
+    prof_counter_start();
+    profiler_reset();
+}
+
+uint32_t prof_cycles(void){
+#ifdef HWREG_SIM
+    return (uint32_t)hwsim_time_ns();
+#else
+    uint32_t ccnt;
+    asm volatile("MRC p15, 0, %0, c9, c13, 0" : "=r" (ccnt));
+    return ccnt;
+#endif
+}
+
+void prof_record(prof_probe_t probe, uint32_t cycles){
+    prof_stats_t *s = &prof_stats[probe];
+    int bucket = cycles ? 32 - __builtin_clz(cycles) : 0;
+
+    if (bucket >= PROF_BUCKETS) bucket = PROF_BUCKETS - 1;
+    s->hist[bucket]++;
+    s->count++;
+    s->total += cycles;
+    if (cycles < s->min) s->min = cycles;
+    if (cycles > s->max) s->max = cycles;
+}
+
+void prof_end(prof_probe_t probe, uint32_t start){
+    prof_record(probe, prof_cycles() - start); // wraps correctly across a CCNT rollover
+}
+
+void prof_arm(prof_probe_t probe){
+    prof_stats[probe].start = prof_cycles();
+    prof_stats[probe].armed = 1;
+}
+
+void prof_end_armed(prof_probe_t probe){
+    uint32_t now = prof_cycles();
+    prof_stats_t *s = &prof_stats[probe];
+
+    if (!s->armed) return;
+    s->armed = 0;
+    prof_record(probe, now - s->start);
+}
+
+// Small formatter, no printf on the target
+static char *prof_put_str(char *p, const char *s){
+    while (*s) *p++ = *s++;
+    return p;
+}
+
+static char *prof_put_u32(char *p, uint32_t v){
+    char digits[10];
+    int n = 0;
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    while (n) *p++ = digits[--n];
+    return p;
+}
+
+void profiler_dump(prof_out_t out){
+    char line[96];
+
+    for (int probe = 0; probe < PROF_PROBES; probe++) {
+        const prof_stats_t *s = &prof_stats[probe];
+        char *p = line;
+
+        p = prof_put_str(p, prof_names[probe]);
+        p = prof_put_str(p, " count=");
+        p = prof_put_u32(p, s->count);
+        p = prof_put_str(p, " min=");
+        p = prof_put_u32(p, s->count ? s->min : 0);
+        p = prof_put_str(p, " max=");
+        p = prof_put_u32(p, s->max);
+        p = prof_put_str(p, " mean=");
+        p = prof_put_u32(p, s->count ? (uint32_t)(s->total / s->count) : 0);
+        *p = '\0';
+        out(line);
+
+        for (int b = 0; b < PROF_BUCKETS; b++) {
+            if (!s->hist[b]) continue;
+            p = prof_put_str(line, "  <2^");
+            p = prof_put_u32(p, b);
+            p = prof_put_str(p, " ");
+            p = prof_put_u32(p, s->hist[b]);
+            *p = '\0';
+            out(line);
+        }
+    }
+}
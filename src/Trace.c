@@ -0,0 +1,46 @@
+/*
+ * PCA frame trace ring, see Trace.h. Like the profiler the functions are always built, the
+ * TRACE_* macros decide whether the driver calls them.
+ */
+
+#include <stdint.h>
+#include "../include/Profiler.h"
+#include "../include/Trace.h"
+
+trace_ring_t trace_ring = {
+    .magic = TRACE_MAGIC,
+    .version = TRACE_VERSION,
+    .entry_size = sizeof(trace_entry_t),
+    .len = TRACE_LEN,
+    .clock_khz = TRACE_CLOCK_KHZ,
+};
+
+void trace_reset(void){
+    for (uint32_t i = 0; i < TRACE_LEN; i++) {
+        trace_ring.entries[i] = (trace_entry_t){0};
+    }
+    trace_ring.head = 0;
+}
+
+void trace_init(void){
+    prof_counter_start();
+    trace_reset();
+}
+
+void trace_frame(uint8_t address, const uint8_t *frame, uint32_t len, int status){
+    uint32_t count = len > 1 ? len - 1 : 1;
+    uint32_t now = prof_cycles();
+
+    if (count > TRACE_LEN) count = TRACE_LEN;
+    // LDREX/STREX on the A8. A nested ISR that records in between takes the exclusive monitor
+    // with its own STREX, ours then fails and the add goes again after the ISR's slots
+    uint32_t slot = __atomic_fetch_add(&trace_ring.head, count, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < count; i++) {
+        trace_entry_t *e = &trace_ring.entries[(slot + i) & (TRACE_LEN - 1)];
+        e->time = now;
+        e->address = address | (i ? TRACE_CONT : 0);
+        e->reg = frame[0] + i;
+        e->value = len > 1 ? frame[i + 1] : 0;
+        e->status = status;
+    }
+}
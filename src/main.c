@@ -4,9 +4,8 @@
  * Description: This file contains the main program flow for controlling a stepper motor using the PCA9685
  *              Motor Controller over I2C. The motor executes 200 steps in a counter-clockwise direction
  *              when a push button is pressed. It includes initializations for the GPIO, I2C, and motor
- *              controller, as well as the main control loop which awaits a button press to start the
- *              motor sequence. The program utilizes interrupt-driven button press detection and manages
- *              precise motor stepping timing.
+ *              controller. Each button press queues a move from the GPIO1 ISR and the Timer5 ISR
+ *              steps the queued moves back to back, so main() only sleeps.
  * Author: Reece Wayt
  * Date: April 20, 2024
  */
@@ -16,52 +15,64 @@
 #include <stdint.h>
 #include "../include/BeagleBoneMaster.h"
 #include "../include/MotorControllerLib.h"
+#include "../include/MotionPlanner.h"
+#include "../include/Profiler.h"
+#include "../include/Trace.h"
 
 #define NUMSTEPS 200
 #define STACK_SIZE 1024
+//Move profile: cruise speed in steps/s, acceleration in steps/s^2, jerk in steps/s^3
+#define MAX_VELOCITY 1000
+#define ACCELERATION 8000
+#define JERK 80000
 
 //program stacks, used for IRQ Service
 volatile unsigned int svc_stack[STACK_SIZE];
 volatile unsigned int irq_stack[STACK_SIZE];
 //push button flag to start step sequence
 volatile int push_button;
+//acceleration ramp shared by every move
+static motion_profile_t move_profile;
 
 int main(void) {
     //initialize button to false
     push_button = 0;
     //Setup stacks with asm (optional and dependant on development env)
     setup_stacks(STACK_SIZE);
+    //start the PMU cycle counter, nothing without -DPROFILER
+    PROF_INIT();
+    //empty the PCA frame trace, nothing without -DTRACE
+    TRACE_INIT();
     //initialize gpio interrupts and fall edge detection
     gpio1_init();
     //unmask gpio1 interrupt from interrupt controller
     IRQ_init();
-    //setup i2c bus
+    //step clock, counts once a move is started
+    timer5_init();
+    //setup i2c bus at I2C1_BUS_KHZ (-DI2C1_BUS_KHZ, 400 by default), PSC/SCLL/SCLH are planned for the rate
     I2C_init();
     //initialize pca motor controller settings
     motor_init();
+    //precompute the S-curve ramp, no planning math runs while stepping
+    planner_build_profile(&move_profile, MAX_VELOCITY, ACCELERATION, JERK);
 
-    //clear_interrupt_mask_bit() of CPSR;
-    uint32_t cpsr;
-    asm("MRS %0, CPSR" : "=r" (cpsr));
-    cpsr &= ~(1 << 7);
-    asm("MSR CPSR_c, %0" :: "r" (cpsr));
+    //every button press queues this move, presses during a move run after it
+    motor_bind_button(NUMSTEPS, MOTOR_FORWARD, &move_profile);
+#ifdef LIMIT_SWITCH_PIN
+    //a limit switch pulling GPIO1_n low stops the move from the GPIO1 ISR, e.g. -DLIMIT_SWITCH_PIN=12 (P8_12)
+    motor_bind_limit(LIMIT_SWITCH_PIN, GPIO_EDGE_FALLING);
+#endif
 
-    while(1){
-        //wait for push_button irq
-        while(push_button == 0){
-            asm("NOP");
-        }
-        //Stepper Motor Loop
-        int step = 0;
-        for(int i = 0; i < NUMSTEPS; i++){
-            step = (step % 4) + 1;
-            full_step_motor(step);
-            //delay between each step for motor to adjust
-            delay(400000);
+    //register writes are queued from here on, the EDMA loads each frame and the I2C1 ISR chains them.
+    //Started before the I bit is cleared so no GPIO1/Timer5 ISR writes through the polled path
+    I2C_tx_engine_start_dma();
+    //clear IRQ mask bit of CPSR
+    clear_interrupt_mask_bit();
 
-        }
-        // Re-enable irq once step sequence is complete
-        gpio1_enable_irq(); 
+    //moves are queued by the GPIO1 ISR and stepped by the Timer5 ISR, between them the core sleeps
+    //in WFI with the I2C1 and Timer5 clocks gated
+    while(1){
+        motor_idle();
     }
     return 0;
-}
\ No newline at end of file
+}